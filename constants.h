@@ -60,11 +60,57 @@
 
 /*
 
+STREAM BUFFERS
+
+*/
+
+#define STREAM_REGIONS              4
+
+/*
+
 MODEL UTILITIES
 
 */
 
 #define MAX_ERRORS 8
+#define MAX_DIRTY_SPANS 8 // per stream, nearest spans merge beyond this
+
+#define COMPRESS_POSITION_HALF      1
+#define COMPRESS_POSITION_SNORM16   2
+#define COMPRESS_NORMAL_OCT16       4
+#define COMPRESS_NORMAL_1010102     8
+#define COMPRESS_TEXCOORD_HALF      16
+#define VERTEX_INTERLEAVED          64
+
+#define MODEL_POSITIONS             1
+#define MODEL_NORMALS               2
+#define MODEL_TEXCOORDS             4
+#define MODEL_INDICES               8
+
+#define MODEL_BVH_BINS              16
+#define MODEL_BVH_TASK_SIZE         8192 // subtrees this small are built on the thread pool
+#define MODEL_BVH_MAX_DEPTH         48 // deeper ranges split in half, keeps the stack below
+#define MODEL_BVH_STACK             128
+
+/*
+
+SCENE UTILITIES
+
+*/
+
+#define SCENE_MARGIN                0.1f // leaf boxes grow by this fraction of the item's size per side
+#define SCENE_SAH_BINS              16
+
+/*
+
+OCCLUSION UTILITIES
+
+*/
+
+#define OCCLUSION_WIDTH             256
+#define OCCLUSION_HEIGHT            128
+#define OCCLUSION_TILE_W            64 // multiple of 4
+#define OCCLUSION_TILE_H            32
 
 /*
 
@@ -79,3 +125,11 @@ TGA UTILITIES
 #define ERR_COMPRESSED		-1
 #define OK					 0
 
+#define TEXTURE_CACHE_EXTENSION ".dds" // mip chains are cached next to the TGA
+
+#define MIP_BOX             0
+#define MIP_KAISER          1
+#define MIP_KAISER_TAPS     4 // either side of the center, 8 in all
+#define MIP_KAISER_ALPHA    4.0f
+
+#define TEXTURE_RESIDENT_SIZE 64 // managed textures over budget keep the levels at most this big
@@ -32,6 +32,20 @@ author of MicroGLUT and examiner for university computer graphics course TSKB07.
 #include <GL/glext.h>
 #include <GL/glx.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// SSSE3 code is compiled per function and picked at runtime, plain builds target SSE2 only
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define TGA_SSSE3
+#endif
 
 #include "glutilities.h"
 
@@ -285,7 +299,10 @@ void glUtilitiesDisplayFunc(void (*func)(void)) {
     display = func;
 }
 
+static void fence_stream_buffers();
 void glUtilitiesSwapBuffers() {
+    fence_stream_buffers();
+    glUtilitiesUpdateTextureManager();
 	glFlush();
 	glXSwapBuffers(DISPLAY, WINDOW);
 }
@@ -1172,10 +1189,395 @@ void glUtilitiesUseFBO(FBOData *out, FBOData *in1, FBOData *in2) {
 
 /*
 
+THREAD UTILITIES
+
+*/
+
+typedef void (*ParallelFunc)(void *arg, int i);
+
+typedef struct PoolJob {
+    ParallelFunc func;
+    void *arg;
+
+    int count;
+    int next; // next index to hand out
+    int done; // indices finished
+
+    struct PoolJob *nextJob;
+} PoolJob;
+
+static int WORKER_COUNT = -1; // -1 until the pool has been started
+static pthread_t *WORKERS = NULL;
+
+static pthread_mutex_t POOL_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t POOL_WAKE = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t POOL_DONE = PTHREAD_COND_INITIALIZER;
+
+static PoolJob *JOB_QUEUE = NULL;
+static char POOL_EXIT = 0;
+
+// Claims the next index of the first job with work left, POOL_MUTEX must be held
+static PoolJob *claim_job(int *index) {
+    while(JOB_QUEUE && JOB_QUEUE->next >= JOB_QUEUE->count) {
+        JOB_QUEUE = JOB_QUEUE->nextJob; // fully handed out
+    }
+
+    PoolJob *job = JOB_QUEUE;
+    if(job) {
+        *index = job->next++;
+    }
+
+    return job;
+}
+
+static void finish_job_index(PoolJob *job) {
+    pthread_mutex_lock(&POOL_MUTEX);
+    job->done++;
+    if(job->done == job->count) {
+        pthread_cond_broadcast(&POOL_DONE);
+    }
+    pthread_mutex_unlock(&POOL_MUTEX);
+}
+
+static void *worker_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&POOL_MUTEX);
+    while(!POOL_EXIT) {
+        int index;
+        PoolJob *job = claim_job(&index);
+        if(!job) {
+            pthread_cond_wait(&POOL_WAKE, &POOL_MUTEX);
+            continue;
+        }
+        pthread_mutex_unlock(&POOL_MUTEX);
+
+        job->func(job->arg, index);
+        finish_job_index(job);
+
+        pthread_mutex_lock(&POOL_MUTEX);
+    }
+    pthread_mutex_unlock(&POOL_MUTEX);
+
+    return NULL;
+}
+
+static void stop_worker_threads() {
+    pthread_mutex_lock(&POOL_MUTEX);
+    POOL_EXIT = 1;
+    pthread_cond_broadcast(&POOL_WAKE);
+    pthread_mutex_unlock(&POOL_MUTEX);
+
+    for(int i = 0; i < WORKER_COUNT; i++) {
+        pthread_join(WORKERS[i], NULL);
+    }
+
+    free(WORKERS);
+    WORKERS = NULL;
+    WORKER_COUNT = -1;
+    POOL_EXIT = 0;
+}
+
+void glUtilitiesSetWorkerThreads(int n) {
+    if(WORKER_COUNT >= 0) {
+        stop_worker_threads();
+    }
+
+    if(n < 0) {
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1; // calling thread works too
+    }
+
+    if(n < 0) {
+        n = 0;
+    }
+
+    WORKERS = (pthread_t *)calloc(n > 0 ? n : 1, sizeof(pthread_t));
+    WORKER_COUNT = 0;
+    for(int i = 0; i < n; i++) {
+        if(pthread_create(&WORKERS[i], NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "glUtilitiesSetWorkerThreads: could only start %d of %d threads\n", i, n);
+            break;
+        }
+        WORKER_COUNT++;
+    }
+}
+
+int glUtilitiesGetWorkerThreads() {
+    if(WORKER_COUNT < 0) {
+        glUtilitiesSetWorkerThreads(-1);
+    }
+
+    return WORKER_COUNT;
+}
+
+static void start_job(PoolJob *job, ParallelFunc func, void *arg, int count) {
+    job->func = func;
+    job->arg = arg;
+    job->count = count;
+    job->next = 0;
+    job->done = 0;
+    job->nextJob = NULL;
+
+    if(count <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&POOL_MUTEX);
+    PoolJob **tail = &JOB_QUEUE;
+    while(*tail) {
+        tail = &(*tail)->nextJob;
+    }
+    *tail = job;
+    pthread_cond_broadcast(&POOL_WAKE);
+    pthread_mutex_unlock(&POOL_MUTEX);
+}
+
+// Helps out with the job's own indices, then blocks until the workers are done with the rest
+static void wait_job(PoolJob *job) {
+    pthread_mutex_lock(&POOL_MUTEX);
+    while(job->next < job->count) {
+        int index = job->next++;
+        pthread_mutex_unlock(&POOL_MUTEX);
+
+        job->func(job->arg, index);
+        finish_job_index(job);
+
+        pthread_mutex_lock(&POOL_MUTEX);
+    }
+
+    while(job->done < job->count) {
+        pthread_cond_wait(&POOL_DONE, &POOL_MUTEX);
+    }
+
+    for(PoolJob **it = &JOB_QUEUE; *it; it = &(*it)->nextJob) {
+        if(*it == job) {
+            *it = job->nextJob; // the job usually lives on the caller's stack
+            break;
+        }
+    }
+    pthread_mutex_unlock(&POOL_MUTEX);
+}
+
+// Runs func(arg, i) for every i in [0, count) on the pool and returns once all are done
+static void parallel_for(ParallelFunc func, void *arg, int count) {
+    if(count <= 1 || glUtilitiesGetWorkerThreads() == 0) {
+        for(int i = 0; i < count; i++) {
+            func(arg, i);
+        }
+        return;
+    }
+
+    PoolJob job;
+    start_job(&job, func, arg, count);
+    wait_job(&job);
+}
+
+/*
+
+STREAM BUFFERS
+
+*/
+
+static int PERSISTENT_MAPPING = -1; // checked when the first stream buffer is created
+static StreamBuffer *STREAM_BUFFERS = NULL;
+
+static bool has_extension(const char *name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for(int i = 0; i < count; i++) {
+        if(strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void create_stream_storage(StreamBuffer *s) {
+    if(PERSISTENT_MAPPING < 0) {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        PERSISTENT_MAPPING = major > 4 || (major == 4 && minor >= 4) || has_extension("GL_ARB_buffer_storage");
+    }
+
+    glGenBuffers(1, &s->buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+    if(PERSISTENT_MAPPING) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, s->size, NULL, flags);
+        s->mapping = (char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, s->size, flags);
+    }
+    else {
+        glBufferData(GL_COPY_WRITE_BUFFER, s->size, NULL, GL_STREAM_DRAW);
+        s->mapping = NULL;
+    }
+
+    s->head = 0;
+    s->region = 0;
+    s->dirty = 0;
+}
+
+static void dispose_stream_storage(StreamBuffer *s) {
+    for(int i = 0; i < STREAM_REGIONS; i++) {
+        if(s->fences[i]) {
+            glDeleteSync(s->fences[i]);
+            s->fences[i] = 0;
+        }
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+    if(s->mapping || s->mapped) {
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    glDeleteBuffers(1, &s->buffer);
+    s->mapping = NULL;
+    s->mapped = 0;
+}
+
+// Waits until the GPU is done with what was written into the region in an earlier frame
+static void stream_enter_region(StreamBuffer *s, int region) {
+    if(s->fences[region]) {
+        while(glClientWaitSync(s->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(s->fences[region]);
+        s->fences[region] = 0;
+    }
+}
+
+void glUtilitiesStreamCommit(StreamBuffer *s) {
+    if(s->mapped) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        s->mapped = 0;
+    }
+}
+
+StreamBuffer *glUtilitiesCreateStreamBuffer(GLsizeiptr size) {
+    StreamBuffer *s = (StreamBuffer *)calloc(1, sizeof(StreamBuffer));
+    s->size = size;
+    create_stream_storage(s);
+
+    s->next = STREAM_BUFFERS;
+    STREAM_BUFFERS = s;
+    return s;
+}
+
+void *glUtilitiesStreamAlloc(StreamBuffer *s, GLsizeiptr size, GLsizeiptr alignment, GLintptr *offset) {
+    glUtilitiesStreamCommit(s);
+
+    for(;;) {
+        GLintptr start = alignment > 1 ? (s->head + alignment - 1) / alignment * alignment : s->head;
+        char wrapped = start + size > s->size;
+        if(wrapped) {
+            start = 0;
+        }
+
+        if(s->mapping && size <= s->size) {
+            GLsizeiptr regionSize = (s->size + STREAM_REGIONS - 1) / STREAM_REGIONS;
+            int first = (int)(start / regionSize);
+            int last = (int)((start + (size > 0 ? size - 1 : 0)) / regionSize);
+
+            // Entering a region written earlier in the same frame, fence what has been
+            // submitted and wait for it. Writing on in the current region is always safe.
+            bool lapped = false;
+            for(int r = first; r <= last; r++) {
+                lapped |= (wrapped || r != s->region) && (s->dirty & (1 << r));
+            }
+
+            if(!lapped) {
+                for(int r = first; r <= last; r++) {
+                    if(wrapped || r != s->region) {
+                        stream_enter_region(s, r);
+                    }
+                    s->dirty |= 1 << r;
+                }
+                s->region = last;
+                s->head = start + size;
+                *offset = start;
+                return s->mapping + start;
+            }
+
+            glUtilitiesStreamFence(s);
+            continue;
+        }
+        else if(!s->mapping && size <= s->size) {
+            // Without persistent mapping the ring is orphaned when it wraps instead of fenced
+            glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+            if(wrapped) {
+                glBufferData(GL_COPY_WRITE_BUFFER, s->size, NULL, GL_STREAM_DRAW);
+            }
+            s->head = start + size;
+            *offset = start;
+            void *mapping = glMapBufferRange(GL_COPY_WRITE_BUFFER, start, size > 0 ? size : 1, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            s->mapped = mapping != NULL;
+            return mapping;
+        }
+
+        // Too small for the allocation, the old storage lives on until the GPU is done with it
+        dispose_stream_storage(s);
+        do {
+            s->size *= 2;
+        } while(s->size < size);
+        create_stream_storage(s);
+    }
+}
+
+// Fences the regions written since the last call, done for every stream buffer by glUtilitiesSwapBuffers
+void glUtilitiesStreamFence(StreamBuffer *s) {
+    glUtilitiesStreamCommit(s);
+    for(int r = 0; r < STREAM_REGIONS; r++) {
+        if(s->dirty & (1 << r)) {
+            if(s->fences[r]) {
+                glDeleteSync(s->fences[r]);
+            }
+            s->fences[r] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+    s->dirty = 0;
+}
+
+static void fence_stream_buffers() {
+    for(StreamBuffer *s = STREAM_BUFFERS; s; s = s->next) {
+        glUtilitiesStreamFence(s);
+    }
+}
+
+void glUtilitiesDisposeStreamBuffer(StreamBuffer *s) {
+    if(s) {
+        StreamBuffer **p = &STREAM_BUFFERS;
+        while(*p != s) {
+            p = &(*p)->next;
+        }
+        *p = s->next;
+
+        dispose_stream_storage(s);
+        free(s);
+    }
+}
+
+/*
+
 MODEL UTILITIES
 
 */
 
+// Plain comparisons rather than fminf/fmaxf (libm calls without -ffast-math) or SetV3, inner loops compile to minss/maxss
+static inline float min_f(float a, float b) {
+    return b < a ? b : a;
+}
+
+static inline float max_f(float a, float b) {
+    return b > a ? b : a;
+}
+
+static inline Vector3 min_v3(Vector3 a, Vector3 b) {
+    a.x = min_f(a.x, b.x); a.y = min_f(a.y, b.y); a.z = min_f(a.z, b.z);
+    return a;
+}
+
+static inline Vector3 max_v3(Vector3 a, Vector3 b) {
+    a.x = max_f(a.x, b.x); a.y = max_f(a.y, b.y); a.z = max_f(a.z, b.z);
+    return a;
+}
+
 static char LINE_END = 0;
 static char FILE_END = 0;
 
@@ -1306,6 +1708,7 @@ static Material **parse_material(char *n) {
             materials[materialCount - 1] = (Material *)calloc(sizeof(Material), 1);
 			m = materials[materialCount - 1];
 			materials[materialCount] = NULL;
+            m->d = 1; // opaque unless d or Tr says otherwise
 
             parse_string(line, &pos, m->newmtl);
         }
@@ -1785,83 +2188,320 @@ void to_triangles(struct Mesh *mp) {
     }
 }
 
-static void generate_normals(Mesh* m) {
-    if(m->vertices && !m->vertexNormals) {
-        m->vertexNormals = (Vector3 *)calloc(sizeof(Vector3) * m->vertexCount, 1);
-        m->normalsCount = m->vertexCount;
-        m->normalsIndex = (int *)calloc(m->coordCount, sizeof(GLuint));
-		memcpy(m->normalsIndex, m->coordIndex, sizeof(GLuint) * m->coordCount);
-    
-		int face;
-		int normalIndex;
-        for(face = 0; face * 3 < m->coordCount; face++) {
-            int i0 = m->coordIndex[face * 3 + 0];
-            int i1 = m->coordIndex[face * 3 + 1];
-            int i2 = m->coordIndex[face * 3 + 2];
+static float NORMAL_CREASE_COS = -2.0f; // below -1 every face is smoothed into its vertices
 
-            Vector3 v0 = SubV3(m->vertices[i1], m->vertices[i0]);
-            Vector3 v1 = SubV3(m->vertices[i2], m->vertices[i0]);
-            Vector3 v2 = SubV3(m->vertices[i2], m->vertices[i1]);
+void glUtilitiesSetNormalCreaseAngle(float degrees) {
+    if(degrees <= 0.0f || degrees >= 180.0f) {
+        NORMAL_CREASE_COS = -2.0f;
+    }
+    else {
+        NORMAL_CREASE_COS = cos(degrees * M_PI / 180.0);
+    }
+}
 
-            float sqrLen0 = Dot(v0, v0);
-			float sqrLen1 = Dot(v1, v1);
-			float sqrLen2 = Dot(v2, v2);
+#define NORMAL_CHUNK 4096
+
+typedef struct NormalJob {
+    Mesh *mesh;
+    int faceCount;
+
+    Vector3 *faceNormals; // unnormalized, length is twice the face area
+    float *cornerWeights; // interior angle at each corner
+
+    int *cornerStarts; // vertex -> range in vertexCorners
+    int *vertexCorners;
+
+    // Crease mode only
+    Vector3 *uniqueNormals; // per adjacency slot, compacted per vertex
+    int *uniqueCounts;
+    int *cornerSlots;
+} NormalJob;
+
+// Angle from the cross product length and the dot product, atan2 for y >= 0.
+// Abramowitz & Stegun 4.4.48 on the octant, |error| < 1.2e-5 rad.
+static inline float fast_atan2(float y, float x) {
+    float ax = fabsf(x);
+    float t = min_f(ax, y) / max_f(max_f(ax, y), 1e-30f);
+    float s = t * t;
+    float r = t * (0.9998660f + s * (-0.3302995f + s * (0.1801410f + s * (-0.0851330f + s * 0.0208351f))));
+    r = y > ax ? (float)M_PI_2 - r : r;
+    return x < 0.0f ? (float)M_PI - r : r;
+}
 
-            float len0 = 1e-3f;
-            if(sqrLen0 >= 1e-6f) {
-                len0 = sqrt(sqrLen0);
-            }
+// |e_a x e_b| is twice the area at every corner, so one sqrt gives all three sines
+static void face_normal_weights(const Vector3 *v, const int *idx, Vector3 *n, float *w) {
+    Vector3 p0 = v[idx[0]], p1 = v[idx[1]], p2 = v[idx[2]];
 
-            float len1 = 1e-3f;
-            if(sqrLen1 >= 1e-6f) {
-                len1 = sqrt(sqrLen1);
-            }
+    float e0x = p1.x - p0.x, e0y = p1.y - p0.y, e0z = p1.z - p0.z;
+    float e1x = p2.x - p0.x, e1y = p2.y - p0.y, e1z = p2.z - p0.z;
+    float e2x = p2.x - p1.x, e2y = p2.y - p1.y, e2z = p2.z - p1.z;
 
-            float len2 = 1e-3f;
-            if(sqrLen2 >= 1e-6f) {
-                len2 = sqrt(sqrLen2);
-            }
+    n->x = e0y * e1z - e0z * e1y;
+    n->y = e0z * e1x - e0x * e1z;
+    n->z = e0x * e1y - e0y * e1x;
+    float area2 = sqrtf(n->x * n->x + n->y * n->y + n->z * n->z);
 
-            float influence0 =  Dot(v0, v1) / (len0 * len1);
-			float influence1 = -Dot(v0, v2) / (len0 * len2);
-			float influence2 =  Dot(v1, v2) / (len1 * len2);
+    float a0 = fast_atan2(area2, e0x * e1x + e0y * e1y + e0z * e1z);
+    float a1 = fast_atan2(area2, -(e0x * e2x + e0y * e2y + e0z * e2z));
 
-            float angle0 = acos(influence0);
-            if(influence0 >= 1.f) {
-                angle0 = 0;
-            }
-            else if(influence0 <= -1.f) {
-                angle0 = M_PI;
-            }
+    w[0] = a0;
+    w[1] = a1;
+    w[2] = max_f((float)M_PI - a0 - a1, 0.0f); // angles of a triangle sum to pi
+}
+
+#ifdef __SSE2__
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 fast_atan2_4(__m128 y, __m128 x) {
+    __m128 ax = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+    __m128 t = _mm_div_ps(_mm_min_ps(ax, y), _mm_max_ps(_mm_max_ps(ax, y), _mm_set1_ps(1e-30f)));
+    __m128 s = _mm_mul_ps(t, t);
+
+    __m128 p = _mm_set1_ps(0.0208351f);
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-0.0851330f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.1801410f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-0.3302995f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.9998660f));
+
+    __m128 r = _mm_mul_ps(t, p);
+    r = select4(_mm_cmpgt_ps(y, ax), _mm_sub_ps(_mm_set1_ps((float)M_PI_2), r), r);
+    return select4(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps((float)M_PI), r), r);
+}
+
+#define GATHER4(v, idx, k, c) _mm_setr_ps(v[idx[k]].c, v[idx[k + 3]].c, v[idx[k + 6]].c, v[idx[k + 9]].c)
+
+// Same as face_normal_weights for four consecutive triangles
+static void face_normal_weights4(const Vector3 *v, const int *idx, Vector3 *n, float *w) {
+    __m128 p0x = GATHER4(v, idx, 0, x), p0y = GATHER4(v, idx, 0, y), p0z = GATHER4(v, idx, 0, z);
+    __m128 p1x = GATHER4(v, idx, 1, x), p1y = GATHER4(v, idx, 1, y), p1z = GATHER4(v, idx, 1, z);
+    __m128 p2x = GATHER4(v, idx, 2, x), p2y = GATHER4(v, idx, 2, y), p2z = GATHER4(v, idx, 2, z);
+
+    __m128 e0x = _mm_sub_ps(p1x, p0x), e0y = _mm_sub_ps(p1y, p0y), e0z = _mm_sub_ps(p1z, p0z);
+    __m128 e1x = _mm_sub_ps(p2x, p0x), e1y = _mm_sub_ps(p2y, p0y), e1z = _mm_sub_ps(p2z, p0z);
+    __m128 e2x = _mm_sub_ps(p2x, p1x), e2y = _mm_sub_ps(p2y, p1y), e2z = _mm_sub_ps(p2z, p1z);
+
+    __m128 nx = _mm_sub_ps(_mm_mul_ps(e0y, e1z), _mm_mul_ps(e0z, e1y));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(e0z, e1x), _mm_mul_ps(e0x, e1z));
+    __m128 nz = _mm_sub_ps(_mm_mul_ps(e0x, e1y), _mm_mul_ps(e0y, e1x));
+    __m128 area2 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+
+    __m128 d01 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, e1x), _mm_mul_ps(e0y, e1y)), _mm_mul_ps(e0z, e1z));
+    __m128 d02 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, e2x), _mm_mul_ps(e0y, e2y)), _mm_mul_ps(e0z, e2z));
+
+    __m128 a0 = fast_atan2_4(area2, d01);
+    __m128 a1 = fast_atan2_4(area2, _mm_sub_ps(_mm_setzero_ps(), d02));
+    __m128 a2 = _mm_max_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps((float)M_PI), a0), a1), _mm_setzero_ps());
+
+    float fx[4], fy[4], fz[4], w0[4], w1[4], w2[4];
+    _mm_storeu_ps(fx, nx);
+    _mm_storeu_ps(fy, ny);
+    _mm_storeu_ps(fz, nz);
+    _mm_storeu_ps(w0, a0);
+    _mm_storeu_ps(w1, a1);
+    _mm_storeu_ps(w2, a2);
+
+    for(int i = 0; i < 4; i++) {
+        n[i].x = fx[i];
+        n[i].y = fy[i];
+        n[i].z = fz[i];
+        w[i * 3 + 0] = w0[i];
+        w[i * 3 + 1] = w1[i];
+        w[i * 3 + 2] = w2[i];
+    }
+}
+#endif
+
+static void compute_face_chunk(void *arg, int chunk) {
+    NormalJob *job = (NormalJob *)arg;
+    const Vector3 *v = job->mesh->vertices;
+    const int *idx = job->mesh->coordIndex;
+
+    int face = chunk * NORMAL_CHUNK;
+    int end = face + NORMAL_CHUNK;
+    if(end > job->faceCount) {
+        end = job->faceCount;
+    }
 
-            float angle1 = acos(influence1);
-            if(influence1 >= 1.f) {
-                angle1 = 0;
+#ifdef __SSE2__
+    for(; face + 4 <= end; face += 4) {
+        face_normal_weights4(v, &idx[face * 3], &job->faceNormals[face], &job->cornerWeights[face * 3]);
+    }
+#endif
+
+    for(; face < end; face++) {
+        face_normal_weights(v, &idx[face * 3], &job->faceNormals[face], &job->cornerWeights[face * 3]);
+    }
+}
+
+static void gather_smooth_chunk(void *arg, int chunk) {
+    NormalJob *job = (NormalJob *)arg;
+    Mesh *m = job->mesh;
+
+    int vertex = chunk * NORMAL_CHUNK;
+    int end = vertex + NORMAL_CHUNK;
+    if(end > m->vertexCount) {
+        end = m->vertexCount;
+    }
+
+    for(; vertex < end; vertex++) {
+        // Corners are listed in face order, so the sum matches a serial scatter
+        Vector3 sum = {{0}, {0}, {0}};
+        for(int i = job->cornerStarts[vertex]; i < job->cornerStarts[vertex + 1]; i++) {
+            int corner = job->vertexCorners[i];
+            Vector3 n = job->faceNormals[corner / 3];
+            float w = job->cornerWeights[corner];
+            sum.x += n.x * w;
+            sum.y += n.y * w;
+            sum.z += n.z * w;
+        }
+
+        float len = sqrtf(sum.x * sum.x + sum.y * sum.y + sum.z * sum.z);
+        if(len > 0.01f) {
+            sum.x /= len;
+            sum.y /= len;
+            sum.z /= len;
+        }
+        m->vertexNormals[vertex] = sum;
+    }
+}
+
+static void gather_crease_chunk(void *arg, int chunk) {
+    NormalJob *job = (NormalJob *)arg;
+    Mesh *m = job->mesh;
+
+    int vertex = chunk * NORMAL_CHUNK;
+    int end = vertex + NORMAL_CHUNK;
+    if(end > m->vertexCount) {
+        end = m->vertexCount;
+    }
+
+    for(; vertex < end; vertex++) {
+        int start = job->cornerStarts[vertex];
+        int stop = job->cornerStarts[vertex + 1];
+        int unique = 0;
+
+        for(int i = start; i < stop; i++) {
+            int corner = job->vertexCorners[i];
+            Vector3 fn = job->faceNormals[corner / 3];
+            float fl = sqrtf(fn.x * fn.x + fn.y * fn.y + fn.z * fn.z);
+
+            // Only faces within the crease angle of this corner's face contribute
+            Vector3 sum = {{0}, {0}, {0}};
+            for(int j = start; j < stop; j++) {
+                int other = job->vertexCorners[j];
+                Vector3 on = job->faceNormals[other / 3];
+                float ol = sqrtf(on.x * on.x + on.y * on.y + on.z * on.z);
+                if(fn.x * on.x + fn.y * on.y + fn.z * on.z >= NORMAL_CREASE_COS * fl * ol) {
+                    float w = job->cornerWeights[other];
+                    sum.x += on.x * w;
+                    sum.y += on.y * w;
+                    sum.z += on.z * w;
+                }
             }
-            else if(influence1 <= -1.f) {
-                angle1 = M_PI;
+
+            float len = sqrtf(sum.x * sum.x + sum.y * sum.y + sum.z * sum.z);
+            if(len > 0.01f) {
+                sum.x /= len;
+                sum.y /= len;
+                sum.z /= len;
             }
 
-            float angle2 = acos(influence2);
-            if(influence2 >= 1.f) {
-                angle2 = 0;
+            int slot;
+            for(slot = 0; slot < unique; slot++) {
+                Vector3 u = job->uniqueNormals[start + slot];
+                if(u.x == sum.x && u.y == sum.y && u.z == sum.z) {
+                    break;
+                }
             }
-            else if(influence2 <= -1.f) {
-                angle2 = M_PI;
+
+            if(slot == unique) {
+                job->uniqueNormals[start + unique++] = sum;
             }
+            job->cornerSlots[corner] = slot;
+        }
+        job->uniqueCounts[vertex] = unique;
+    }
+}
 
-            Vector3 normal = Cross(v0, v1);
-			m->vertexNormals[i0] = AddV3(Scalar(normal, angle0), m->vertexNormals[i0]);
-			m->vertexNormals[i1] = AddV3(Scalar(normal, angle1), m->vertexNormals[i1]);
-			m->vertexNormals[i2] = AddV3(Scalar(normal, angle2), m->vertexNormals[i2]);
+static void generate_normals(Mesh* m) {
+    if(m->vertices && !m->vertexNormals) {
+        NormalJob job;
+        memset(&job, 0, sizeof(job));
+        job.mesh = m;
+        job.faceCount = m->coordCount / 3;
+
+        job.faceNormals = (Vector3 *)malloc(sizeof(Vector3) * (job.faceCount + 1));
+        job.cornerWeights = (float *)malloc(sizeof(float) * (job.faceCount * 3 + 1));
+        parallel_for(compute_face_chunk, &job, (job.faceCount + NORMAL_CHUNK - 1) / NORMAL_CHUNK);
+
+        // Vertex -> face corner adjacency (counting sort keeps face order)
+        int cornerCount = job.faceCount * 3;
+        job.cornerStarts = (int *)calloc(m->vertexCount + 1, sizeof(int));
+        job.vertexCorners = (int *)malloc(sizeof(int) * (cornerCount + 1));
+
+        int corner;
+        for(corner = 0; corner < cornerCount; corner++) {
+            job.cornerStarts[m->coordIndex[corner] + 1]++;
         }
 
-        for(normalIndex = 0; normalIndex < m->normalsCount; normalIndex++) {
-			float len = Norm(m->vertexNormals[normalIndex]);
-            if(len > 0.01f) {
-				m->vertexNormals[normalIndex] = Scalar(m->vertexNormals[normalIndex], 1 / len);
+        int vertex;
+        for(vertex = 0; vertex < m->vertexCount; vertex++) {
+            job.cornerStarts[vertex + 1] += job.cornerStarts[vertex];
+        }
+
+        int *fill = (int *)malloc(sizeof(int) * (m->vertexCount + 1));
+        memcpy(fill, job.cornerStarts, sizeof(int) * m->vertexCount);
+        for(corner = 0; corner < cornerCount; corner++) {
+            job.vertexCorners[fill[m->coordIndex[corner]]++] = corner;
+        }
+        free(fill);
+
+        int chunks = (m->vertexCount + NORMAL_CHUNK - 1) / NORMAL_CHUNK;
+        m->normalsIndex = (int *)calloc(m->coordCount, sizeof(GLuint));
+
+        if(NORMAL_CREASE_COS < -1.0f) {
+            m->vertexNormals = (Vector3 *)calloc(sizeof(Vector3) * m->vertexCount, 1);
+            m->normalsCount = m->vertexCount;
+            memcpy(m->normalsIndex, m->coordIndex, sizeof(GLuint) * m->coordCount);
+
+            parallel_for(gather_smooth_chunk, &job, chunks);
+        }
+        else {
+            job.uniqueNormals = (Vector3 *)malloc(sizeof(Vector3) * (cornerCount + 1));
+            job.uniqueCounts = (int *)malloc(sizeof(int) * (m->vertexCount + 1));
+            job.cornerSlots = (int *)malloc(sizeof(int) * (cornerCount + 1));
+
+            parallel_for(gather_crease_chunk, &job, chunks);
+
+            // Compact the per-vertex unique normals into one array
+            int *base = (int *)malloc(sizeof(int) * (m->vertexCount + 1));
+            m->normalsCount = 0;
+            for(vertex = 0; vertex < m->vertexCount; vertex++) {
+                base[vertex] = m->normalsCount;
+                m->normalsCount += job.uniqueCounts[vertex];
+            }
+
+            m->vertexNormals = (Vector3 *)malloc(sizeof(Vector3) * (m->normalsCount + 1));
+            for(vertex = 0; vertex < m->vertexCount; vertex++) {
+                memcpy(&m->vertexNormals[base[vertex]], &job.uniqueNormals[job.cornerStarts[vertex]], sizeof(Vector3) * job.uniqueCounts[vertex]);
+            }
+
+            for(corner = 0; corner < cornerCount; corner++) {
+                m->normalsIndex[corner] = base[m->coordIndex[corner]] + job.cornerSlots[corner];
             }
+
+            free(base);
+            free(job.uniqueNormals);
+            free(job.uniqueCounts);
+            free(job.cornerSlots);
         }
+
+        free(job.faceNormals);
+        free(job.cornerWeights);
+        free(job.cornerStarts);
+        free(job.vertexCorners);
     }
 }
 
@@ -2186,6 +2826,50 @@ static void dispose_mesh(Mesh *m) {
     }
 }
 
+// Box and sphere around the vertices, the sphere is centered on the box
+static void compute_bounds(Model *m) {
+    if(!m->vertexArray || m->numVertices == 0) {
+        m->boundsMin = m->boundsMax = m->boundsCenter = SetV3(0, 0, 0);
+        m->boundsRadius = 0;
+        return;
+    }
+
+    Vector3 lo = m->vertexArray[0], hi = m->vertexArray[0];
+    for(int i = 1; i < m->numVertices; i++) {
+        Vector3 p = m->vertexArray[i];
+        lo.x = min_f(lo.x, p.x); lo.y = min_f(lo.y, p.y); lo.z = min_f(lo.z, p.z);
+        hi.x = max_f(hi.x, p.x); hi.y = max_f(hi.y, p.y); hi.z = max_f(hi.z, p.z);
+    }
+    m->boundsMin = lo;
+    m->boundsMax = hi;
+    m->boundsCenter = SetV3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+
+    float r = 0;
+    for(int i = 0; i < m->numVertices; i++) {
+        Vector3 d = SubV3(m->vertexArray[i], m->boundsCenter);
+        r = max_f(r, d.x * d.x + d.y * d.y + d.z * d.z);
+    }
+    m->boundsRadius = sqrtf(r);
+}
+
+// Grows the bounds to contain edited vertices, they never shrink until the next reload
+static void expand_bounds(Model *m, int first, int count) {
+    for(int i = first; i < first + count; i++) {
+        Vector3 p = m->vertexArray[i];
+        m->boundsMin.x = min_f(m->boundsMin.x, p.x); m->boundsMin.y = min_f(m->boundsMin.y, p.y); m->boundsMin.z = min_f(m->boundsMin.z, p.z);
+        m->boundsMax.x = max_f(m->boundsMax.x, p.x); m->boundsMax.y = max_f(m->boundsMax.y, p.y); m->boundsMax.z = max_f(m->boundsMax.z, p.z);
+
+        Vector3 d = SubV3(p, m->boundsCenter);
+        float distance = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+        if(distance > m->boundsRadius) {
+            float r = (m->boundsRadius + distance) / 2;
+            float t = (r - m->boundsRadius) / distance;
+            m->boundsCenter = SetV3(m->boundsCenter.x + d.x * t, m->boundsCenter.y + d.y * t, m->boundsCenter.z + d.z * t);
+            m->boundsRadius = r;
+        }
+    }
+}
+
 void glUtilitiesCenterModel(Model *m) {
     float maxx = -1e10;
     float maxy = -1e10;
@@ -2227,6 +2911,13 @@ void glUtilitiesCenterModel(Model *m) {
 		m->vertexArray[i].y -= (maxy + miny) / 2.0f;
 		m->vertexArray[i].z -= (maxz + minz) / 2.0f;
     }
+
+    Vector3 c = SetV3((maxx + minx) / 2.0f, (maxy + miny) / 2.0f, (maxz + minz) / 2.0f);
+    m->boundsMin = SubV3(m->boundsMin, c);
+    m->boundsMax = SubV3(m->boundsMax, c);
+    m->boundsCenter = SubV3(m->boundsCenter, c);
+
+    glUtilitiesMarkModelDirty(m, MODEL_POSITIONS, 0, m->numVertices);
 }
 
 void glUtilitiesScaleModel(Model *m, float sx, float sy, float sz) {
@@ -2235,448 +2926,6253 @@ void glUtilitiesScaleModel(Model *m, float sx, float sy, float sz) {
 		m->vertexArray[i].y *= sy;
 		m->vertexArray[i].z *= sz;
 	}
+
+    Vector3 a = SetV3(m->boundsMin.x * sx, m->boundsMin.y * sy, m->boundsMin.z * sz);
+    Vector3 b = SetV3(m->boundsMax.x * sx, m->boundsMax.y * sy, m->boundsMax.z * sz);
+    m->boundsMin = SetV3(min_f(a.x, b.x), min_f(a.y, b.y), min_f(a.z, b.z));
+    m->boundsMax = SetV3(max_f(a.x, b.x), max_f(a.y, b.y), max_f(a.z, b.z));
+    m->boundsCenter = SetV3(m->boundsCenter.x * sx, m->boundsCenter.y * sy, m->boundsCenter.z * sz);
+    m->boundsRadius *= max_f(fabsf(sx), max_f(fabsf(sy), fabsf(sz)));
+
+    glUtilitiesMarkModelDirty(m, MODEL_POSITIONS, 0, m->numVertices);
 }
 
-static void report_loader_error(const char *caller, const char *n) {
-	static unsigned int err_count = 0;
-    if(err_count < MAX_ERRORS) {
-		fprintf(stderr, "%s warning: '%s' not found in shader!\n", caller, n);
-        err_count++;
-    }
-    else if(err_count == MAX_ERRORS) {
-	    fprintf(stderr, "%s: Nr of errors bigger than %i. No more will be printed.\n", caller, MAX_ERRORS);
-        err_count++;
+static void dispose_edges(Model *m) {
+    if(m->edgeIb) {
+        glDeleteBuffers(1, &m->edgeIb);
     }
+    m->edgeIb = 0;
+    m->numEdgeIndices = 0;
 }
 
-// TODO: Write helper function for glUtilitiesDrawModel & glUtilitiesDrawWireframe to avoid so much code repetition
-void glUtilitiesDrawModel(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
-    if(m) {
-        glBindVertexArray(m->vao);
-        glUseProgram(program);
-        
-		glBindBuffer(GL_ARRAY_BUFFER, m->vb);
-		GLint loc = glGetAttribLocation(program, vertexVar);
-		if(loc >= 0) {
-			glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0); 
-			glEnableVertexAttribArray(loc);
+static void add_dirty_span(ModelDirtySpans *d, int first, int count) {
+    int last = first + count;
+
+    // Swallow every span it overlaps or touches
+    for(int i = 0; i < d->numSpans;) {
+        int f = d->first[i], l = d->first[i] + d->count[i];
+        if(f <= last && first <= l) {
+            first = f < first ? f : first;
+            last = l > last ? l : last;
+            d->numSpans--;
+            d->first[i] = d->first[d->numSpans];
+            d->count[i] = d->count[d->numSpans];
         }
         else {
-            report_loader_error("glUtilitiesDrawModel", vertexVar);
-        }
-
-		if(normalVar) {
-			loc = glGetAttribLocation(program, normalVar);
-		    if(loc >= 0) {
-				glBindBuffer(GL_ARRAY_BUFFER, m->nb);
-				glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-				glEnableVertexAttribArray(loc);
-            }
-            else {
-                report_loader_error("glUtilitiesDrawModel", normalVar);
-            }
+            i++;
         }
+    }
 
-		if(m->texCoordArray && textureVar) {
-			loc = glGetAttribLocation(program, textureVar);
-			if(loc >= 0) {
-				glBindBuffer(GL_ARRAY_BUFFER, m->tb);
-				glVertexAttribPointer(loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-				glEnableVertexAttribArray(loc);
-            }
-            else {
-                report_loader_error("glUtilitiesDrawModel", textureVar);
+    if(d->numSpans == MAX_DIRTY_SPANS) {
+        // Out of spans, grow the closest one, re-uploading the gap is cheaper than a full upload
+        int closest = 0, closestGap = 0x7fffffff;
+        for(int i = 0; i < d->numSpans; i++) {
+            int f = d->first[i], l = d->first[i] + d->count[i];
+            int gap = f > last ? f - last : first - l;
+            if(gap < closestGap) {
+                closestGap = gap;
+                closest = i;
             }
         }
 
-		glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, 0L);
+        int f = d->first[closest], l = d->first[closest] + d->count[closest];
+        d->first[closest] = f < first ? f : first;
+        d->count[closest] = (l > last ? l : last) - d->first[closest];
+        return;
     }
+
+    d->first[d->numSpans] = first;
+    d->count[d->numSpans] = last - first;
+    d->numSpans++;
 }
 
-void glUtilitiesDrawWireframe(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
-	if(m) {
-		glBindVertexArray(m->vao);
-        glUseProgram(program);
-
-		glBindBuffer(GL_ARRAY_BUFFER, m->vb);
-		GLint loc = glGetAttribLocation(program, vertexVar);
-		if(loc >= 0) {
-			glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0); 
-			glEnableVertexAttribArray(loc);
-        }
-        else {
-            report_loader_error("glUtilitiesDrawWireframe", vertexVar);
-        }
+void glUtilitiesMarkModelDirty(Model *m, int streams, int first, int count) {
+    if(!m || count <= 0) {
+        return;
+    }
 
-		if (normalVar) {
-			loc = glGetAttribLocation(program, normalVar);
-			if(loc >= 0) {
-				glBindBuffer(GL_ARRAY_BUFFER, m->nb);
-				glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-				glEnableVertexAttribArray(loc);
-            }
-            else {
-                report_loader_error("glUtilitiesDrawWireframe", normalVar);
+    for(int i = 0; i < 4; i++) {
+        if(streams & (1 << i)) {
+            int n = i == 3 ? m->numIndices : m->numVertices;
+            int f = first < 0 ? 0 : first;
+            int l = first + count > n ? n : first + count;
+            if(l > f) {
+                add_dirty_span(&m->dirty[i], f, l - f);
             }
         }
+    }
 
-		if(m->texCoordArray && textureVar) {
-			loc = glGetAttribLocation(program, textureVar);
-			if(loc >= 0) {
-				glBindBuffer(GL_ARRAY_BUFFER, m->tb);
-				glVertexAttribPointer(loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-				glEnableVertexAttribArray(loc);
-            }
-            else {
-                report_loader_error("glUtilitiesDrawWireframe", textureVar);
-            }
-        }
+    if(m->bvh) {
+        m->bvh->stale |= streams & (MODEL_POSITIONS | MODEL_INDICES);
+    }
 
-		glDrawElements(GL_LINE_STRIP, m->numIndices, GL_UNSIGNED_INT, 0L);
+    if(streams & MODEL_INDICES) {
+        dispose_edges(m); // rebuilt by the next wireframe draw
     }
 }
 
-void glUtilitiesReloadModelData(Model *m) {
-	glBindVertexArray(m->vao);
-	
-    glBindBuffer(GL_ARRAY_BUFFER, m->vb);
-	glBufferData(GL_ARRAY_BUFFER, m->numVertices * 3 * sizeof(GLfloat), m->vertexArray, GL_STATIC_DRAW);
-	
-    glBindBuffer(GL_ARRAY_BUFFER, m->nb);
-	glBufferData(GL_ARRAY_BUFFER, m->numVertices * 3 * sizeof(GLfloat), m->normalArray, GL_STATIC_DRAW);
-    
-	if (m->texCoordArray) {
-		glBindBuffer(GL_ARRAY_BUFFER, m->tb);
-		glBufferData(GL_ARRAY_BUFFER, m->numVertices * 2 * sizeof(GLfloat), m->texCoordArray, GL_STATIC_DRAW);
-    }
-    
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), m->indexArray, GL_STATIC_DRAW);
+static bool OPTIMIZE_MODELS = false;
+
+void glUtilitiesSetModelOptimization(bool active) {
+    OPTIMIZE_MODELS = active;
 }
 
-static void generate_model_buffers(Model *m) {
-    glGenVertexArrays(1, &m->vao);
-	glGenBuffers(1, &m->vb);
-	glGenBuffers(1, &m->ib);
-	glGenBuffers(1, &m->nb);
-    
-	if (m->texCoordArray) {
-		glGenBuffers(1, &m->tb);
+#define STATS_CACHE_SIZE 16
+
+void glUtilitiesModelCacheStats(Model *m, ModelCacheStats *stats) {
+    // FIFO post-transform cache, a vertex is a hit if fewer than STATS_CACHE_SIZE misses happened since it was loaded
+    int *stamps = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    for(int i = 0; i < m->numVertices; i++) {
+        stamps[i] = -STATS_CACHE_SIZE - 1;
     }
-    
-    glUtilitiesReloadModelData(m);
+
+    int misses = 0;
+    for(int i = 0; i < m->numIndices; i++) {
+        GLuint v = m->indexArray[i];
+        if(misses - stamps[v] > STATS_CACHE_SIZE) {
+            stamps[v] = misses++;
+        }
+    }
+    free(stamps);
+
+    stats->acmr = m->numIndices > 0 ? misses / (m->numIndices / 3.0f) : 0.0f;
+    stats->atvr = m->numVertices > 0 ? misses / (float)m->numVertices : 0.0f;
 }
 
-Model* glUtilitiesLoadModel(const char* n) {
-	Mesh *mesh = load_obj(n);
-    to_triangles(mesh);
+#define FORSYTH_CACHE_SIZE 32
 
-    generate_normals(mesh);
-    
-    Model *model = generate_model(mesh);
-    dispose_mesh(mesh);
+static float forsyth_vertex_score(int cachePos, int remaining) {
+    if(remaining == 0) {
+        return -1.0f;
+    }
 
-    generate_model_buffers(model);
-    model->data = 0;
+    float score = 0.0f;
+    if(cachePos >= 0) {
+        if(cachePos < 3) {
+            score = 0.75f; // used by the last triangle
+        }
+        else {
+            score = powf(1.0f - (cachePos - 3) / (float)(FORSYTH_CACHE_SIZE - 3), 1.5f);
+        }
+    }
 
-    return model;
+    return score + 2.0f / sqrtf((float)remaining);
 }
 
-Model** glUtilitiesLoadModelSet(const char* n) {
-	Mesh *mesh = load_obj(n);
-	Mesh **mm = split_to_meshes(mesh);
+// Tom Forsyth's linear-speed vertex cache optimisation, reorders triangles only
+// Degenerate triangles name a vertex more than once, only its first corner counts
+static bool repeated_corner(const GLuint *indices, int i) {
+    int first = i - i % 3;
+    for(int k = first; k < i; k++) {
+        if(indices[k] == indices[i]) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    int i;
-	for (i = 0; mm[i] != NULL; i++) {} // for populating i
-	
-    Model **md = (Model **)calloc(sizeof(Model *), i + 1);
-    for(i = 0; mm[i] != NULL; i++) {
-        to_triangles(mm[i]);
-        generate_normals(mm[i]);
-		md[i] = generate_model(mm[i]);
-        dispose_mesh(mm[i]);
+static void optimize_vertex_cache(GLuint *indices, int numIndices, int numVertices) {
+    int numTris = numIndices / 3;
+
+    int *remaining = (int *)calloc(numVertices + 1, sizeof(int));
+    int *triStarts = (int *)calloc(numVertices + 1, sizeof(int));
+    int *vertexTris = (int *)malloc(sizeof(int) * (numIndices + 1));
+    int *cachePos = (int *)malloc(sizeof(int) * (numVertices + 1));
+    float *vertexScore = (float *)malloc(sizeof(float) * (numVertices + 1));
+    float *triScore = (float *)malloc(sizeof(float) * (numTris + 1));
+    char *emitted = (char *)calloc(numTris + 1, 1);
+    GLuint *out = (GLuint *)malloc(sizeof(GLuint) * (numIndices + 1));
+
+    int i, j;
+    for(i = 0; i < numTris * 3; i++) {
+        if(!repeated_corner(indices, i)) {
+            remaining[indices[i]]++;
+        }
     }
 
-    free(mm);
-    dispose_material_list(MATERIALS);
-    dispose_mesh(mesh);
-    
-    MATERIAL_NAME_LIST = NULL;
-	MATERIALS = NULL;
+    for(i = 0; i < numVertices; i++) {
+        triStarts[i + 1] = triStarts[i] + remaining[i];
+        cachePos[i] = -1;
+        vertexScore[i] = forsyth_vertex_score(-1, remaining[i]);
+    }
 
-    for(i = 0; md[i] != NULL; i++) {
-        generate_model_buffers(md[i]);
-		md[i]->data = 0;
+    int *fill = (int *)malloc(sizeof(int) * (numVertices + 1));
+    memcpy(fill, triStarts, sizeof(int) * numVertices);
+    for(i = 0; i < numTris * 3; i++) {
+        if(!repeated_corner(indices, i)) {
+            vertexTris[fill[indices[i]]++] = i / 3;
+        }
     }
+    free(fill);
 
-    return md;
-}
+    for(i = 0; i < numTris; i++) {
+        triScore[i] = vertexScore[indices[i * 3]] + vertexScore[indices[i * 3 + 1]] + vertexScore[indices[i * 3 + 2]];
+    }
 
-Model* glUtilitiesLoadModelData(Vector3 *vertices, Vector3 *normals, Vector2 *texCoords, Vector3 *colors, GLuint *indices, int numVertices, int numIndices) {
-	Model* m = (Model *)malloc(sizeof(Model));
-	memset(m, 0, sizeof(Model));
-    
-    m->vertexArray = vertices;
-	m->texCoordArray = texCoords;
-	m->normalArray = normals;
-	m->indexArray = indices;
-	m->numVertices = numVertices;
-	m->numIndices = numIndices;
-	m->data = 1;
+    int cache[FORSYTH_CACHE_SIZE + 3];
+    int cacheCount = 0;
+    int nextFallback = 0;
+    int best = -1;
 
-    generate_model_buffers(m);
+    for(int outTri = 0; outTri < numTris; outTri++) {
+        if(best < 0) {
+            // Nothing useful in the cache, continue with the first triangle left in input order
+            while(emitted[nextFallback]) {
+                nextFallback++;
+            }
+            best = nextFallback;
+        }
 
-    return m;
-}
+        emitted[best] = 1;
+        memcpy(&out[outTri * 3], &indices[best * 3], sizeof(GLuint) * 3);
 
-void glUtilitiesDisposeModel(Model *m) {
-    if(m) {
-        if(m->data == 0) {
-		    if(m->vertexArray) {
-				free(m->vertexArray);
+        // Push the triangle's vertices to the front of the LRU cache
+        int newCache[FORSYTH_CACHE_SIZE + 3];
+        int newCount = 0;
+        for(j = 0; j < 3; j++) {
+            if(repeated_corner(indices, best * 3 + j)) {
+                continue;
             }
-
-            if(m->normalArray) {
-				free(m->normalArray);
+            GLuint v = indices[best * 3 + j];
+            newCache[newCount++] = v;
+            remaining[v]--;
+
+            // Move the emitted triangle to the end of this vertex' active range
+            int start = triStarts[v];
+            for(int k = start; k < start + remaining[v] + 1; k++) {
+                if(vertexTris[k] == best) {
+                    vertexTris[k] = vertexTris[start + remaining[v]];
+                    vertexTris[start + remaining[v]] = best;
+                    break;
+                }
             }
+        }
 
-            if(m->texCoordArray) {
-				free(m->texCoordArray);
+        for(j = 0; j < cacheCount; j++) {
+            int v = cache[j];
+            if(v != (int)indices[best * 3] && v != (int)indices[best * 3 + 1] && v != (int)indices[best * 3 + 2]) {
+                newCache[newCount++] = v;
             }
+        }
 
-            if(m->colorArray) {
-				free(m->colorArray);
-            }
+        // Rescore everything that was touched, vertices pushed out of the cache included
+        for(j = 0; j < newCount; j++) {
+            int v = newCache[j];
+            cachePos[v] = j < FORSYTH_CACHE_SIZE ? j : -1;
+            vertexScore[v] = forsyth_vertex_score(cachePos[v], remaining[v]);
+        }
 
-            if(m->indexArray) {
-				free(m->indexArray);
+        best = -1;
+        float bestScore = -1.0f;
+        for(j = 0; j < newCount; j++) {
+            int v = newCache[j];
+            for(int k = triStarts[v]; k < triStarts[v] + remaining[v]; k++) {
+                int t = vertexTris[k];
+                float score = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+                triScore[t] = score;
+                if(score > bestScore) {
+                    bestScore = score;
+                    best = t;
+                }
             }
         }
 
-        glDeleteBuffers(1, &m->vb);
-		glDeleteBuffers(1, &m->ib);
-		glDeleteBuffers(1, &m->nb);
-		glDeleteBuffers(1, &m->tb);
-		glDeleteVertexArrays(1, &m->vao);
+        cacheCount = newCount < FORSYTH_CACHE_SIZE ? newCount : FORSYTH_CACHE_SIZE;
+        memcpy(cache, newCache, sizeof(int) * cacheCount);
+    }
 
-        if (m->material) {
-			free(m->material);
-        }
+    memcpy(indices, out, sizeof(GLuint) * numTris * 3);
+
+    free(remaining);
+    free(triStarts);
+    free(vertexTris);
+    free(cachePos);
+    free(vertexScore);
+    free(triScore);
+    free(emitted);
+    free(out);
+}
+
+typedef struct TriangleCluster {
+    int start, count; // in triangles
+    float sortKey;
+} TriangleCluster;
+
+static int compare_clusters(const void *a, const void *b) {
+    float ka = ((const TriangleCluster *)a)->sortKey;
+    float kb = ((const TriangleCluster *)b)->sortKey;
+    if(ka != kb) {
+        return ka > kb ? -1 : 1;
     }
-    
-    free(m);
+    return ((const TriangleCluster *)a)->start - ((const TriangleCluster *)b)->start;
 }
 
-/*
+// Splits the cache optimised order where the FIFO cache restarts and draws outward facing clusters first (Sander et al.)
+static void optimize_overdraw(GLuint *indices, int numIndices, int numVertices, Vector3 *vertices) {
+    int numTris = numIndices / 3;
+    if(numTris == 0 || !vertices) {
+        return;
+    }
 
-TGA UTILITIES
+    TriangleCluster *clusters = (TriangleCluster *)malloc(sizeof(TriangleCluster) * numTris);
+    int clusterCount = 0;
 
-*/
+    int *stamps = (int *)malloc(sizeof(int) * (numVertices + 1));
+    for(int i = 0; i < numVertices; i++) {
+        stamps[i] = -STATS_CACHE_SIZE - 1;
+    }
 
-static bool MIPMAP = true;
+    int misses = 0;
+    for(int t = 0; t < numTris; t++) {
+        int triMisses = 0;
+        for(int j = 0; j < 3; j++) {
+            GLuint v = indices[t * 3 + j];
+            if(misses - stamps[v] > STATS_CACHE_SIZE) {
+                stamps[v] = misses++;
+                triMisses++;
+            }
+        }
 
-void glUtilitiesLoadTGASetMipmapping(bool active) {
-    MIPMAP = active;
-}
+        if(t == 0 || triMisses == 3) {
+            clusters[clusterCount].start = t;
+            clusters[clusterCount].count = 0;
+            clusterCount++;
+        }
+        clusters[clusterCount - 1].count++;
+    }
+    free(stamps);
 
-bool glUtilitiesLoadTGATextureData(const char *filename, TextureData *texture) {
-	GLuint i;
-	GLubyte uncompressedheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	GLubyte compressedheader[12] = {0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	GLubyte uncompressedbwheader[12] = {0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	GLubyte compressedbwheader[12] = {0, 0, 11, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	GLubyte actualHeader[12];
-    GLubyte header[6];
+    if(clusterCount > 1) {
+        Vector3 meshCenter = {{0}, {0}, {0}};
+        for(int i = 0; i < numVertices; i++) {
+            meshCenter.x += vertices[i].x / numVertices;
+            meshCenter.y += vertices[i].y / numVertices;
+            meshCenter.z += vertices[i].z / numVertices;
+        }
 
-	GLuint bytesPerPixel;
-	GLuint imageSize;
-	GLuint temp;
+        for(int c = 0; c < clusterCount; c++) {
+            Vector3 center = {{0}, {0}, {0}};
+            Vector3 normal = {{0}, {0}, {0}};
+            float area = 0.0f;
+
+            for(int t = clusters[c].start; t < clusters[c].start + clusters[c].count; t++) {
+                Vector3 p0 = vertices[indices[t * 3]];
+                Vector3 p1 = vertices[indices[t * 3 + 1]];
+                Vector3 p2 = vertices[indices[t * 3 + 2]];
+
+                Vector3 e0 = {{p1.x - p0.x}, {p1.y - p0.y}, {p1.z - p0.z}};
+                Vector3 e1 = {{p2.x - p0.x}, {p2.y - p0.y}, {p2.z - p0.z}};
+                Vector3 n = {{e0.y * e1.z - e0.z * e1.y}, {e0.z * e1.x - e0.x * e1.z}, {e0.x * e1.y - e0.y * e1.x}};
+                float a = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+
+                center.x += (p0.x + p1.x + p2.x) / 3.0f * a;
+                center.y += (p0.y + p1.y + p2.y) / 3.0f * a;
+                center.z += (p0.z + p1.z + p2.z) / 3.0f * a;
+                normal.x += n.x;
+                normal.y += n.y;
+                normal.z += n.z;
+                area += a;
+            }
 
-    GLubyte *rowP;
-	
-    long rowSize, stepSize, bytesRead;
-	long row, rowLimit;
-	
-    int err;
-    int b;
-	
-    GLubyte rle;
-	GLubyte pixelData[4];	
-	
-	char flipped;
-	long step;
-	
-    FILE *file = fopen(filename, "rb");
-	err = 0;
+            float key = 0.0f;
+            float len = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+            if(area > 0.0f && len > 0.0f) {
+                key = ((center.x / area - meshCenter.x) * normal.x +
+                       (center.y / area - meshCenter.y) * normal.y +
+                       (center.z / area - meshCenter.z) * normal.z) / len;
+            }
+            clusters[c].sortKey = key;
+        }
 
-	if (file == NULL) {
-        err = 1;
+        qsort(clusters, clusterCount, sizeof(TriangleCluster), compare_clusters);
+
+        GLuint *out = (GLuint *)malloc(sizeof(GLuint) * numTris * 3);
+        int outTri = 0;
+        for(int c = 0; c < clusterCount; c++) {
+            memcpy(&out[outTri * 3], &indices[clusters[c].start * 3], sizeof(GLuint) * clusters[c].count * 3);
+            outTri += clusters[c].count;
+        }
+        memcpy(indices, out, sizeof(GLuint) * numTris * 3);
+        free(out);
     }
-	else if (fread(actualHeader, 1, sizeof(actualHeader), file) != sizeof(actualHeader)) {
-        err = 2;
+
+    free(clusters);
+}
+
+// Renumbers vertices in order of first use so vertex fetch walks the arrays linearly
+static void optimize_vertex_fetch(Model *m) {
+    int *remap = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    for(int i = 0; i < m->numVertices; i++) {
+        remap[i] = -1;
     }
-	else if (
-				(memcmp(uncompressedheader, actualHeader, sizeof(uncompressedheader)-4) != 0) &&
-				(memcmp(compressedheader, actualHeader, sizeof(compressedheader)-4) != 0) &&
-				(memcmp(uncompressedbwheader, actualHeader, sizeof(uncompressedheader)-4) != 0) &&
-				(memcmp(compressedbwheader, actualHeader, sizeof(compressedheader)-4) != 0)
-			) {
-		err = 3; // Does The Header Match What We Want?
-		for (i = 0; i < 12; i++) {
-			printf("%d ", actualHeader[i]);
+
+    int next = 0;
+    for(int i = 0; i < m->numIndices; i++) {
+        GLuint v = m->indexArray[i];
+        if(remap[v] < 0) {
+            remap[v] = next++;
         }
-		printf("\n");
-	}
-	else if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
-        err = 4;
+        m->indexArray[i] = remap[v];
     }
-	
-	if (err != 0) {
-		switch (err) {
-			case 1: printf("could not open file %s\n", filename); break;
-			case 2: printf("could not read header of %s\n", filename); break;
-			case 3: printf("unsupported format in %s\n", filename); break;
-			case 4: printf("could not read file %s\n", filename); break;
-		}
-		
-		if(file == NULL) {
-			return false;
 
-        } 
-        else {
-			fclose(file);
-			return false;
-		}
-	}
+    for(int l = 0; l < m->numLods; l++) {
+        for(int i = 0; i < m->lods[l].numIndices; i++) {
+            m->lods[l].indexArray[i] = remap[m->lods[l].indexArray[i]];
+        }
+    }
 
-	texture->w  = header[1] * 256 + header[0];
-    texture->h = header[3] * 256 + header[2];
-	if (texture->w <= 0 || texture->h <= 0 || (header[4] != 24 && header[4] != 32 && header[4] != 8)) {
-		fclose(file);		// If Anything Failed, Close The File
-		return false;
-	}
-	flipped = (header[5] & 32) != 0;
+    // Unreferenced vertices go last
+    for(int i = 0; i < m->numVertices; i++) {
+        if(remap[i] < 0) {
+            remap[i] = next++;
+        }
+    }
 
-	texture->bpp = header[4];
-	bytesPerPixel = texture->bpp/8;
-	imageSize = texture->w * texture->h * bytesPerPixel;
-	rowSize	= texture->w * bytesPerPixel;
-	stepSize = texture->w * bytesPerPixel;
-	texture->imageData = (GLubyte *)calloc(1, imageSize);
-	if (texture->imageData == NULL) {
-		fclose(file);
-		return false;
-	}
+    if(m->vertexArray) {
+        Vector3 *tmp = (Vector3 *)malloc(sizeof(Vector3) * m->numVertices);
+        for(int i = 0; i < m->numVertices; i++) {
+            tmp[remap[i]] = m->vertexArray[i];
+        }
+        memcpy(m->vertexArray, tmp, sizeof(Vector3) * m->numVertices);
+        free(tmp);
+    }
 
-	if (flipped) {
-		step = -stepSize;
-		rowP = &texture->imageData[imageSize - stepSize];
-		row = 0 + (texture->h -1) * stepSize;
-	}
-	else {
-		step = stepSize;
-		rowP = &texture->imageData[0];
-		row = 0;
-	}
+    if(m->normalArray) {
+        Vector3 *tmp = (Vector3 *)malloc(sizeof(Vector3) * m->numVertices);
+        for(int i = 0; i < m->numVertices; i++) {
+            tmp[remap[i]] = m->normalArray[i];
+        }
+        memcpy(m->normalArray, tmp, sizeof(Vector3) * m->numVertices);
+        free(tmp);
+    }
 
-	if (actualHeader[2] == 2 || actualHeader[2] == 3) {
-		for (i = 0; i < texture->h; i++) {
-			bytesRead = fread(rowP, 1, rowSize, file);
-			rowP += step;
-			if (bytesRead != rowSize) {
-				free(texture->imageData);
-				fclose(file);
-				return false;
-			}
-		}
-	}
-	else {
-		i = row;
-		rowLimit = row + rowSize;
-		do {
-			bytesRead = fread(&rle, 1, 1, file);
-			if (rle < 128) {
-				bytesRead = fread(&texture->imageData[i], 1, (rle+1)*bytesPerPixel, file);
-				i += bytesRead;
-				if (bytesRead == 0) {
-					i = imageSize;
-                }
-			}
-			else {
-				bytesRead = fread(&pixelData, 1, bytesPerPixel, file);
-				do {
-					for (b = 0; b < bytesPerPixel; b++) {
-						texture->imageData[i+b] = pixelData[b];
-                    }
-					i += bytesPerPixel;
-					rle = rle - 1;
-				} while (rle > 127);
-			}
-			if (i >= rowLimit) {
-				row = row + step;
-				rowLimit = row + rowSize;
-				i = row;
-			}
-		} while (i < imageSize);
-	}
+    if(m->colorArray) {
+        Vector3 *tmp = (Vector3 *)malloc(sizeof(Vector3) * m->numVertices);
+        for(int i = 0; i < m->numVertices; i++) {
+            tmp[remap[i]] = m->colorArray[i];
+        }
+        memcpy(m->colorArray, tmp, sizeof(Vector3) * m->numVertices);
+        free(tmp);
+    }
 
-	if (bytesPerPixel >= 3) {
-        for (i = 0; i < (int)(imageSize); i += bytesPerPixel) {
-            temp = texture->imageData[i];
-            texture->imageData[i] = texture->imageData[i + 2];
-            texture->imageData[i + 2] = temp;
+    if(m->texCoordArray) {
+        Vector2 *tmp = (Vector2 *)malloc(sizeof(Vector2) * m->numVertices);
+        for(int i = 0; i < m->numVertices; i++) {
+            tmp[remap[i]] = m->texCoordArray[i];
         }
-    }	
-	fclose (file);
+        memcpy(m->texCoordArray, tmp, sizeof(Vector2) * m->numVertices);
+        free(tmp);
+    }
 
-	return true;
+    free(remap);
 }
 
-bool glUtilitiesLoadTGATexture(const char *n, TextureData *tex) {
-    char ok;
-    GLuint type = GL_RGBA;
-
-    ok = glUtilitiesLoadTGATextureData(n, tex);
-    if(!ok) {
-        return false;
+static void optimize_model(Model *m, ModelCacheStats *before, ModelCacheStats *after) {
+    if(before) {
+        glUtilitiesModelCacheStats(m, before);
     }
 
-    glGenTextures(1, &tex->texID);
-    glBindTexture(GL_TEXTURE_2D, tex->texID);
+    if(m->numIndices >= 3 && m->numVertices > 0) {
+        free(m->clusters); // triangle ranges are about to change
+        m->clusters = NULL;
+        m->numClusters = 0;
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    
-    if(tex->bpp == 8) {
-        type = GL_RED;
+        optimize_vertex_cache(m->indexArray, m->numIndices - m->numIndices % 3, m->numVertices);
+        optimize_overdraw(m->indexArray, m->numIndices - m->numIndices % 3, m->numVertices, m->vertexArray);
+        optimize_vertex_fetch(m);
     }
 
-    if(tex->bpp == 24) {
-        type = GL_RGB;
-    }
-	glTexImage2D(GL_TEXTURE_2D, 0, type, tex->w, tex->h, 0, type, GL_UNSIGNED_BYTE, tex[0].imageData);
-    
-	if(MIPMAP) {
-		glGenerateMipmap(GL_TEXTURE_2D);
-		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    if(after) {
+        glUtilitiesModelCacheStats(m, after);
     }
-    
-    return true;
 }
 
-void glUtilitiesLoadTGATextureSimple(const char *n, GLuint *tex) {
-	TextureData texture;
-    memset(&texture, 0, sizeof(texture));
-
-	if (glUtilitiesLoadTGATexture(n, &texture)) {
-		if(texture.imageData) {
-			free(texture.imageData);
+void glUtilitiesOptimizeModel(Model *m, ModelCacheStats *before, ModelCacheStats *after) {
+    if(m) {
+        optimize_model(m, before, after);
+        if(m->vao) {
+            glUtilitiesReloadModelData(m);
         }
+    }
+}
+
+static float matrix_max_scale(Matrix4 m) {
+    float sx = m.m[0] * m.m[0] + m.m[4] * m.m[4] + m.m[8] * m.m[8];
+    float sy = m.m[1] * m.m[1] + m.m[5] * m.m[5] + m.m[9] * m.m[9];
+    float sz = m.m[2] * m.m[2] + m.m[6] * m.m[6] + m.m[10] * m.m[10];
+    return sqrtf(max_f(sx, max_f(sy, sz)));
+}
+
+// Row-major matrix times point, as uploaded with transpose = GL_TRUE
+static Vector3 transform_point(Matrix4 m, Vector3 p) {
+    Vector3 r;
+    r.x = m.m[0] * p.x + m.m[1] * p.y + m.m[2] * p.z + m.m[3];
+    r.y = m.m[4] * p.x + m.m[5] * p.y + m.m[6] * p.z + m.m[7];
+    r.z = m.m[8] * p.x + m.m[9] * p.y + m.m[10] * p.z + m.m[11];
+    return r;
+}
+
+static Vector3 transform_direction(Matrix4 m, Vector3 d) {
+    Vector3 r;
+    r.x = m.m[0] * d.x + m.m[1] * d.y + m.m[2] * d.z;
+    r.y = m.m[4] * d.x + m.m[5] * d.y + m.m[6] * d.z;
+    r.z = m.m[8] * d.x + m.m[9] * d.y + m.m[10] * d.z;
+    return r;
+}
+
+// Left, right, bottom, top, near, far planes (ax + by + cz + d >= 0 inside), normalized
+static void extract_frustum_planes(Matrix4 m, float planes[6][4]) {
+    for(int i = 0; i < 3; i++) {
+        for(int k = 0; k < 4; k++) {
+            planes[i * 2][k] = m.m[12 + k] + m.m[i * 4 + k];
+            planes[i * 2 + 1][k] = m.m[12 + k] - m.m[i * 4 + k];
+        }
+    }
+
+    for(int i = 0; i < 6; i++) {
+        float len = sqrtf(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+        if(len > 0.0f) {
+            for(int k = 0; k < 4; k++) {
+                planes[i][k] /= len;
+            }
+        }
+    }
+}
+
+static int VERTEX_COMPRESSION = 0;
+
+void glUtilitiesSetVertexCompression(int flags) {
+    VERTEX_COMPRESSION = flags;
+}
+
+static GLushort float_to_half(float f) {
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+
+    unsigned int sign = (x >> 16) & 0x8000;
+    int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = x & 0x7fffff;
+
+    if(((x >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0); // inf, nan
+    }
+
+    if(exponent >= 31) {
+        return sign | 0x7c00; // overflow
+    }
+
+    if(exponent <= 0) {
+        if(exponent < -10) {
+            return sign; // too small, flush to zero
+        }
+        mantissa |= 0x800000;
+        unsigned int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int midpoint = 1u << (shift - 1);
+        if(rest > midpoint || (rest == midpoint && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+    unsigned int rest = mantissa & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++; // carry into the exponent is the correct rounding
+    }
+    return half;
+}
+
+static GLshort float_to_snorm16(float f) {
+    f = f > 1.0f ? 1.0f : (f < -1.0f ? -1.0f : f);
+    return (GLshort)lrintf(f * 32767.0f);
+}
+
+// Octahedral normal encoding, decoded in the vertex shader
+static void encode_octahedral(Vector3 n, GLshort *out) {
+    float l = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if(l <= 0.0f) {
+        out[0] = out[1] = 0;
+        return;
+    }
+
+    float x = n.x / l, y = n.y / l;
+    if(n.z < 0.0f) {
+        float ox = x;
+        x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    out[0] = float_to_snorm16(x);
+    out[1] = float_to_snorm16(y);
+}
+
+static GLuint encode_1010102(Vector3 n) {
+    int x = (int)lrintf((n.x > 1.0f ? 1.0f : (n.x < -1.0f ? -1.0f : n.x)) * 511.0f);
+    int y = (int)lrintf((n.y > 1.0f ? 1.0f : (n.y < -1.0f ? -1.0f : n.y)) * 511.0f);
+    int z = (int)lrintf((n.z > 1.0f ? 1.0f : (n.z < -1.0f ? -1.0f : n.z)) * 511.0f);
+    return ((GLuint)x & 0x3ff) | (((GLuint)y & 0x3ff) << 10) | (((GLuint)z & 0x3ff) << 20);
+}
+
+static int position_stride(Model *m) {
+    return (m->vertexFormat & (COMPRESS_POSITION_HALF | COMPRESS_POSITION_SNORM16)) ? 4 * sizeof(GLushort) : 3 * sizeof(GLfloat);
+}
+
+static int normal_stride(Model *m) {
+    return (m->vertexFormat & (COMPRESS_NORMAL_OCT16 | COMPRESS_NORMAL_1010102)) ? 4 : 3 * sizeof(GLfloat);
+}
+
+static int texcoord_stride(Model *m) {
+    return (m->vertexFormat & COMPRESS_TEXCOORD_HALF) ? 2 * sizeof(GLushort) : 2 * sizeof(GLfloat);
+}
+
+// Interleaved vertices are position, normal, texcoord, every attribute 4-byte aligned
+static int normal_offset(Model *m) {
+    return (m->vertexFormat & VERTEX_INTERLEAVED) ? position_stride(m) : 0;
+}
+
+static int texcoord_offset(Model *m) {
+    return (m->vertexFormat & VERTEX_INTERLEAVED) ? normal_offset(m) + (m->normalArray ? normal_stride(m) : 0) : 0;
+}
+
+static int vertex_stride(Model *m) {
+    return texcoord_offset(m) + (m->texCoordArray ? texcoord_stride(m) : 0);
+}
+
+// Stride passed to glVertexAttribPointer for an attribute whose own size is n
+static int attribute_stride(Model *m, int n) {
+    return (m->vertexFormat & VERTEX_INTERLEAVED) ? vertex_stride(m) : n;
+}
+
+// Quantization range of the positions, position = decodeOffset + decodeScale * attribute
+static void compute_decode_range(Model *m) {
+    m->decodeOffset = SetV3(0, 0, 0);
+    m->decodeScale = SetV3(1, 1, 1);
+    if(!m->vertexArray || m->numVertices == 0 || !(m->vertexFormat & (COMPRESS_POSITION_HALF | COMPRESS_POSITION_SNORM16))) {
+        return;
+    }
+
+    Vector3 lo = m->vertexArray[0], hi = m->vertexArray[0];
+    for(int i = 1; i < m->numVertices; i++) {
+        Vector3 p = m->vertexArray[i];
+        lo.x = min_f(lo.x, p.x); lo.y = min_f(lo.y, p.y); lo.z = min_f(lo.z, p.z);
+        hi.x = max_f(hi.x, p.x); hi.y = max_f(hi.y, p.y); hi.z = max_f(hi.z, p.z);
+    }
+    m->decodeOffset = SetV3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+
+    if(m->vertexFormat & COMPRESS_POSITION_SNORM16) {
+        m->decodeScale = SetV3(max_f((hi.x - lo.x) / 2, 1e-20f), max_f((hi.y - lo.y) / 2, 1e-20f), max_f((hi.z - lo.z) / 2, 1e-20f));
+    }
+}
+
+// The pack functions convert vertices [first, first + count) to the model's format, caller frees
+static void *pack_positions(Model *m, int first, int count) {
+    if(!m->vertexArray || !(m->vertexFormat & (COMPRESS_POSITION_HALF | COMPRESS_POSITION_SNORM16))) {
+        return NULL;
+    }
+
+    Vector3 *v = m->vertexArray + first;
+    GLushort *packed = (GLushort *)malloc(sizeof(GLushort) * 4 * (count + 1));
+    if(m->vertexFormat & COMPRESS_POSITION_SNORM16) {
+        for(int i = 0; i < count; i++) {
+            packed[i * 4 + 0] = (GLushort)float_to_snorm16((v[i].x - m->decodeOffset.x) / m->decodeScale.x);
+            packed[i * 4 + 1] = (GLushort)float_to_snorm16((v[i].y - m->decodeOffset.y) / m->decodeScale.y);
+            packed[i * 4 + 2] = (GLushort)float_to_snorm16((v[i].z - m->decodeOffset.z) / m->decodeScale.z);
+            packed[i * 4 + 3] = 32767;
+        }
+    }
+    else {
+        // Half floats around the center, most precision where the model is
+        for(int i = 0; i < count; i++) {
+            packed[i * 4 + 0] = float_to_half(v[i].x - m->decodeOffset.x);
+            packed[i * 4 + 1] = float_to_half(v[i].y - m->decodeOffset.y);
+            packed[i * 4 + 2] = float_to_half(v[i].z - m->decodeOffset.z);
+            packed[i * 4 + 3] = 0x3c00;
+        }
+    }
+
+    return packed;
+}
+
+static void *pack_normals(Model *m, int first, int count) {
+    if(!m->normalArray || !(m->vertexFormat & (COMPRESS_NORMAL_OCT16 | COMPRESS_NORMAL_1010102))) {
+        return NULL;
+    }
+
+    GLuint *packed = (GLuint *)malloc(sizeof(GLuint) * (count + 1));
+    for(int i = 0; i < count; i++) {
+        if(m->vertexFormat & COMPRESS_NORMAL_OCT16) {
+            encode_octahedral(m->normalArray[first + i], (GLshort *)&packed[i]);
+        }
+        else {
+            packed[i] = encode_1010102(m->normalArray[first + i]);
+        }
+    }
+
+    return packed;
+}
+
+static void *pack_texcoords(Model *m, int first, int count) {
+    if(!m->texCoordArray || !(m->vertexFormat & COMPRESS_TEXCOORD_HALF)) {
+        return NULL;
+    }
+
+    GLushort *packed = (GLushort *)malloc(sizeof(GLushort) * 2 * (count + 1));
+    for(int i = 0; i < count; i++) {
+        packed[i * 2 + 0] = float_to_half(m->texCoordArray[first + i].x);
+        packed[i * 2 + 1] = float_to_half(m->texCoordArray[first + i].y);
+    }
+
+    return packed;
+}
+
+// One buffer with every attribute of a vertex next to each other
+static void *pack_interleaved(Model *m, int first, int count) {
+    int stride = vertex_stride(m);
+    int ps = position_stride(m), ns = normal_stride(m), ts = texcoord_stride(m);
+    int no = normal_offset(m), to = texcoord_offset(m);
+
+    char *positions = (char *)pack_positions(m, first, count);
+    char *normals = (char *)pack_normals(m, first, count);
+    char *texCoords = (char *)pack_texcoords(m, first, count);
+    const char *p = positions ? positions : (const char *)(m->vertexArray + first);
+    const char *n = normals ? normals : (m->normalArray ? (const char *)(m->normalArray + first) : NULL);
+    const char *t = texCoords ? texCoords : (m->texCoordArray ? (const char *)(m->texCoordArray + first) : NULL);
+
+    char *packed = (char *)malloc((size_t)stride * (count + 1));
+    for(int i = 0; i < count; i++) {
+        char *v = packed + (size_t)i * stride;
+        memcpy(v, p + (size_t)i * ps, ps);
+        if(n) {
+            memcpy(v + no, n + (size_t)i * ns, ns);
+        }
+        if(t) {
+            memcpy(v + to, t + (size_t)i * ts, ts);
+        }
+    }
+
+    free(positions);
+    free(normals);
+    free(texCoords);
+    return packed;
+}
+
+// 16-bit whenever every vertex can be addressed, independent of the COMPRESS_* flags
+static GLenum choose_index_type(Model *m) {
+    if(m->numVertices <= 65536) {
+        return GL_UNSIGNED_SHORT;
+    }
+    return GL_UNSIGNED_INT;
+}
+
+static int index_size(Model *m) {
+    return m->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+// Indices in the model's index type, the caller frees the result if it isn't indices
+static const void *pack_index_data(Model *m, const GLuint *indices, int count) {
+    if(m->indexType != GL_UNSIGNED_SHORT) {
+        return indices;
+    }
+
+    GLushort *packed = (GLushort *)malloc(sizeof(GLushort) * (count + 1));
+    for(int i = 0; i < count; i++) {
+        packed[i] = (GLushort)indices[i];
+    }
+    return packed;
+}
+
+// Uploads to the bound element array buffer in the model's index type
+static void upload_index_data(Model *m, const GLuint *indices, int count) {
+    const void *packed = pack_index_data(m, indices, count);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)count * index_size(m), packed, GL_STATIC_DRAW);
+    if(packed != indices) {
+        free((void *)packed);
+    }
+}
+
+void glUtilitiesCompressModel(Model *m, int flags) {
+    if(m) {
+        m->vertexFormat = flags;
+        glUtilitiesReloadModelData(m);
+    }
+}
+
+void glUtilitiesSetModelDecodeUniforms(Model *m, GLuint program, const char *offsetVar, const char *scaleVar) {
+    glUseProgram(program);
+    glUniform3f(glGetUniformLocation(program, offsetVar), m->decodeOffset.x, m->decodeOffset.y, m->decodeOffset.z);
+    glUniform3f(glGetUniformLocation(program, scaleVar), m->decodeScale.x, m->decodeScale.y, m->decodeScale.z);
+}
+
+#define ARENA_MIN_VERTICES 65536
+#define ARENA_MIN_INDEX_WORDS 262144
+
+typedef struct ArenaRange {
+    int offset, size;
+} ArenaRange;
+
+typedef struct ArenaHeap {
+    ArenaRange *free; // sorted by offset, neighbours are always coalesced
+    int numFree, maxFree;
+    int capacity;
+} ArenaHeap;
+
+typedef struct MeshArena {
+    int vertexFormat, stride;
+    GLuint vao, vb, ib;
+    ArenaHeap vertices; // in vertices of stride bytes
+    ArenaHeap indices; // in 4-byte words, keeps both index types aligned
+    int numModels;
+    ModelBinding *bindings; // configured VAOs shared by the arena's models
+    int numBindings;
+    struct MeshArena *next;
+} MeshArena;
+
+static bool same_name(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static char *copy_name(const char *n) {
+    return n ? strdup(n) : NULL;
+}
+
+static void dispose_bindings(ModelBinding **bindings, int *numBindings) {
+    for(int i = 0; i < *numBindings; i++) {
+        glDeleteVertexArrays(1, &(*bindings)[i].vao);
+        free((*bindings)[i].vertexVar);
+        free((*bindings)[i].normalVar);
+        free((*bindings)[i].textureVar);
+    }
+
+    free(*bindings);
+    *bindings = NULL;
+    *numBindings = 0;
+}
+
+static bool MESH_ARENA = false;
+static MeshArena *MESH_ARENAS = NULL;
+
+void glUtilitiesSetMeshArena(bool active) {
+    MESH_ARENA = active;
+}
+
+static void heap_release(ArenaHeap *h, int offset, int size) {
+    int i = 0;
+    while(i < h->numFree && h->free[i].offset < offset) {
+        i++;
+    }
+
+    bool left = i > 0 && h->free[i - 1].offset + h->free[i - 1].size == offset;
+    bool right = i < h->numFree && offset + size == h->free[i].offset;
+    if(left && right) {
+        h->free[i - 1].size += size + h->free[i].size;
+        memmove(&h->free[i], &h->free[i + 1], sizeof(ArenaRange) * (h->numFree - i - 1));
+        h->numFree--;
+    }
+    else if(left) {
+        h->free[i - 1].size += size;
+    }
+    else if(right) {
+        h->free[i].offset = offset;
+        h->free[i].size += size;
+    }
+    else {
+        if(h->numFree == h->maxFree) {
+            h->maxFree = h->maxFree ? h->maxFree * 2 : 16;
+            h->free = (ArenaRange *)realloc(h->free, sizeof(ArenaRange) * h->maxFree);
+        }
+        memmove(&h->free[i + 1], &h->free[i], sizeof(ArenaRange) * (h->numFree - i));
+        h->free[i].offset = offset;
+        h->free[i].size = size;
+        h->numFree++;
+    }
+}
+
+// First fit, -1 if no free range is big enough
+static int heap_allocate(ArenaHeap *h, int size) {
+    for(int i = 0; i < h->numFree; i++) {
+        if(h->free[i].size >= size) {
+            int offset = h->free[i].offset;
+            h->free[i].offset += size;
+            h->free[i].size -= size;
+            if(h->free[i].size == 0) {
+                memmove(&h->free[i], &h->free[i + 1], sizeof(ArenaRange) * (h->numFree - i - 1));
+                h->numFree--;
+            }
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// Resizes the buffer's storage but keeps its name, so VAOs and models referencing it stay valid
+static void grow_arena_buffer(GLuint buffer, GLsizeiptr oldSize, GLsizeiptr newSize) {
+    GLuint copy;
+    glGenBuffers(1, &copy);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, copy);
+    glBufferData(GL_COPY_WRITE_BUFFER, oldSize, NULL, GL_STATIC_COPY);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+
+    glBufferData(GL_COPY_READ_BUFFER, newSize, NULL, GL_STATIC_DRAW);
+    glCopyBufferSubData(GL_COPY_WRITE_BUFFER, GL_COPY_READ_BUFFER, 0, 0, oldSize);
+    glDeleteBuffers(1, &copy);
+}
+
+static int arena_allocate(ArenaHeap *h, int size, GLuint buffer, int unit, int minCapacity) {
+    int offset = heap_allocate(h, size);
+    if(offset < 0) {
+        int capacity = h->capacity * 2 > h->capacity + size ? h->capacity * 2 : h->capacity + size;
+        capacity = capacity > minCapacity ? capacity : minCapacity;
+
+        grow_arena_buffer(buffer, (GLsizeiptr)h->capacity * unit, (GLsizeiptr)capacity * unit);
+        heap_release(h, h->capacity, capacity - h->capacity);
+        h->capacity = capacity;
+        offset = heap_allocate(h, size);
+    }
+    return offset;
+}
+
+static MeshArena *find_arena(int vertexFormat, int stride) {
+    MeshArena *a;
+    for(a = MESH_ARENAS; a; a = a->next) {
+        if(a->vertexFormat == vertexFormat && a->stride == stride) {
+            return a;
+        }
+    }
+
+    a = (MeshArena *)calloc(1, sizeof(MeshArena));
+    a->vertexFormat = vertexFormat;
+    a->stride = stride;
+    glGenVertexArrays(1, &a->vao);
+    glGenBuffers(1, &a->vb);
+    glGenBuffers(1, &a->ib);
+
+    glBindVertexArray(a->vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, a->ib);
+    glBindVertexArray(0);
+
+    a->next = MESH_ARENAS;
+    MESH_ARENAS = a;
+    return a;
+}
+
+static void dispose_arena(MeshArena *a) {
+    MeshArena **p = &MESH_ARENAS;
+    while(*p != a) {
+        p = &(*p)->next;
+    }
+    *p = a->next;
+
+    dispose_bindings(&a->bindings, &a->numBindings);
+    glDeleteBuffers(1, &a->vb);
+    glDeleteBuffers(1, &a->ib);
+    glDeleteVertexArrays(1, &a->vao);
+    free(a->vertices.free);
+    free(a->indices.free);
+    free(a);
+}
+
+// Returns the model's ranges, the arena goes away with its last model
+static void arena_release_model(Model *m) {
+    MeshArena *a = m->arena;
+    if(a && m->arenaVertices > 0) {
+        heap_release(&a->vertices, m->baseVertex, m->arenaVertices);
+        heap_release(&a->indices, (int)(m->indexOffset / 4), m->arenaIndexWords);
+        m->arenaVertices = 0;
+        if(--a->numModels == 0) {
+            dispose_arena(a);
+        }
+    }
+    m->arena = NULL;
+}
+
+static void upload_model_indices(Model *m) {
+    if(m->arena) {
+        const void *packed = pack_index_data(m, m->indexArray, m->numIndices);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m->ib);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, m->indexOffset, (GLsizeiptr)m->numIndices * index_size(m), packed);
+        if(packed != m->indexArray) {
+            free((void *)packed);
+        }
+    }
+    else {
+        glBindVertexArray(m->vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
+        upload_index_data(m, m->indexArray, m->numIndices);
+    }
+}
+
+// (Re)allocates the model in the arena of its current format and uploads it there
+static void arena_store_model(Model *m) {
+    MeshArena *a = find_arena(m->vertexFormat, vertex_stride(m));
+    a->numModels++; // keeps a alive if it is also the model's old arena
+    arena_release_model(m);
+
+    m->arena = a;
+    m->arenaVertices = m->numVertices > 0 ? m->numVertices : 1;
+    m->arenaIndexWords = (m->numIndices * index_size(m) + 3) / 4 + 1;
+    m->baseVertex = arena_allocate(&a->vertices, m->arenaVertices, a->vb, a->stride, ARENA_MIN_VERTICES);
+    m->indexOffset = (GLintptr)arena_allocate(&a->indices, m->arenaIndexWords, a->ib, 4, ARENA_MIN_INDEX_WORDS) * 4;
+
+    m->vao = a->vao;
+    m->vb = a->vb;
+    m->ib = a->ib;
+    m->nb = 0;
+    m->tb = 0;
+
+    void *packed = pack_interleaved(m, 0, m->numVertices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, a->vb);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)m->baseVertex * a->stride, (GLsizeiptr)m->numVertices * a->stride, packed);
+    free(packed);
+
+    upload_model_indices(m);
+}
+
+static int LOD_LEVELS = 0;
+static float LOD_THRESHOLD = 1.0f;
+
+void glUtilitiesSetModelLODLevels(int levels) {
+    LOD_LEVELS = levels > 0 ? levels : 0;
+}
+
+void glUtilitiesSetLODThreshold(float pixels) {
+    LOD_THRESHOLD = pixels;
+}
+
+typedef struct Quadric {
+    double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+} Quadric;
+
+static void quadric_add_plane(Quadric *q, double nx, double ny, double nz, double d, double w) {
+    q->a00 += w * nx * nx; q->a01 += w * nx * ny; q->a02 += w * nx * nz; q->a03 += w * nx * d;
+    q->a11 += w * ny * ny; q->a12 += w * ny * nz; q->a13 += w * ny * d;
+    q->a22 += w * nz * nz; q->a23 += w * nz * d;
+    q->a33 += w * d * d;
+}
+
+static void quadric_add(Quadric *q, const Quadric *o) {
+    q->a00 += o->a00; q->a01 += o->a01; q->a02 += o->a02; q->a03 += o->a03;
+    q->a11 += o->a11; q->a12 += o->a12; q->a13 += o->a13;
+    q->a22 += o->a22; q->a23 += o->a23;
+    q->a33 += o->a33;
+}
+
+static double quadric_error(const Quadric *q, Vector3 p) {
+    double x = p.x, y = p.y, z = p.z;
+    double e = q->a00 * x * x + q->a11 * y * y + q->a22 * z * z + q->a33
+             + 2 * (q->a01 * x * y + q->a02 * x * z + q->a12 * y * z + q->a03 * x + q->a13 * y + q->a23 * z);
+    return e > 0 ? e : 0;
+}
+
+static Vector3 triangle_normal(Vector3 p0, Vector3 p1, Vector3 p2) {
+    Vector3 n;
+    float e0x = p1.x - p0.x, e0y = p1.y - p0.y, e0z = p1.z - p0.z;
+    float e1x = p2.x - p0.x, e1y = p2.y - p0.y, e1z = p2.z - p0.z;
+    n.x = e0y * e1z - e0z * e1y;
+    n.y = e0z * e1x - e0x * e1z;
+    n.z = e0x * e1y - e0y * e1x;
+    return n;
+}
+
+typedef struct Collapse {
+    double cost;
+    int from, to; // welded vertex ids
+} Collapse;
+
+static int compare_collapses(const void *a, const void *b) {
+    double ca = ((const Collapse *)a)->cost;
+    double cb = ((const Collapse *)b)->cost;
+    return ca < cb ? -1 : (ca > cb ? 1 : 0);
+}
+
+typedef struct EdgeRef {
+    unsigned long long key; // smaller vertex id in the high bits
+    int tri;
+} EdgeRef;
+
+static int compare_edge_refs(const void *a, const void *b) {
+    const EdgeRef *ea = (const EdgeRef *)a;
+    const EdgeRef *eb = (const EdgeRef *)b;
+    if(ea->key != eb->key) {
+        return ea->key < eb->key ? -1 : 1;
+    }
+    return ea->tri - eb->tri;
+}
+
+typedef struct Simplifier {
+    Model *model;
+
+    int weldedCount;
+    int *weldedIds; // model vertex -> welded position id
+    int *copyStarts; // welded id -> range in copies
+    int *copies; // model vertices sharing a position
+    Vector3 *positions;
+
+    Quadric *quadrics; // planes of the full-detail mesh, carried from level to level
+    int *merged; // welded id -> the one it collapsed into, itself while still in the mesh
+} Simplifier;
+
+typedef struct SortedVertex {
+    Vector3 p;
+    int index;
+} SortedVertex;
+
+static int compare_sorted_vertices(const void *a, const void *b) {
+    int c = memcmp(&((const SortedVertex *)a)->p, &((const SortedVertex *)b)->p, sizeof(Vector3));
+    return c != 0 ? c : ((const SortedVertex *)a)->index - ((const SortedVertex *)b)->index;
+}
+
+static void init_simplifier(Simplifier *s, Model *m) {
+    s->model = m;
+
+    // Weld vertices that were only split for differing normals/texture coordinates
+    SortedVertex *order = (SortedVertex *)malloc(sizeof(SortedVertex) * (m->numVertices + 1));
+    for(int i = 0; i < m->numVertices; i++) {
+        order[i].p = m->vertexArray[i];
+        order[i].index = i;
+    }
+    qsort(order, m->numVertices, sizeof(SortedVertex), compare_sorted_vertices);
+
+    s->weldedIds = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    s->positions = (Vector3 *)malloc(sizeof(Vector3) * (m->numVertices + 1));
+    s->weldedCount = 0;
+    for(int i = 0; i < m->numVertices; i++) {
+        if(i == 0 || memcmp(&order[i].p, &order[i - 1].p, sizeof(Vector3)) != 0) {
+            s->positions[s->weldedCount++] = order[i].p;
+        }
+        s->weldedIds[order[i].index] = s->weldedCount - 1;
+    }
+
+    s->copyStarts = (int *)calloc(s->weldedCount + 1, sizeof(int));
+    s->copies = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    for(int i = 0; i < m->numVertices; i++) {
+        s->copyStarts[s->weldedIds[i] + 1]++;
+    }
+
+    for(int i = 0; i < s->weldedCount; i++) {
+        s->copyStarts[i + 1] += s->copyStarts[i];
+    }
+
+    for(int i = 0; i < m->numVertices; i++) {
+        s->copies[i] = order[i].index; // sorted by position, so already grouped
+    }
+    free(order);
+}
+
+// Face planes, plus perpendicular planes along open borders to keep the outline in place
+static void init_quadrics(Simplifier *s, const GLuint *indices, int numIndices) {
+    int numTris = numIndices / 3;
+    s->quadrics = (Quadric *)calloc(s->weldedCount + 1, sizeof(Quadric));
+    s->merged = (int *)malloc(sizeof(int) * (s->weldedCount + 1));
+    for(int i = 0; i < s->weldedCount; i++) {
+        s->merged[i] = i;
+    }
+
+    EdgeRef *edges = (EdgeRef *)malloc(sizeof(EdgeRef) * (numIndices + 1));
+    for(int t = 0; t < numTris; t++) {
+        int w[3];
+        Vector3 p[3];
+        for(int k = 0; k < 3; k++) {
+            w[k] = s->weldedIds[indices[t * 3 + k]];
+            p[k] = s->positions[w[k]];
+        }
+
+        Vector3 n = triangle_normal(p[0], p[1], p[2]);
+        double len = sqrt((double)n.x * n.x + (double)n.y * n.y + (double)n.z * n.z);
+        if(len > 0) {
+            double d = -(n.x * p[0].x + n.y * p[0].y + n.z * p[0].z) / len;
+            for(int k = 0; k < 3; k++) {
+                quadric_add_plane(&s->quadrics[w[k]], n.x / len, n.y / len, n.z / len, d, 1.0);
+            }
+        }
+
+        for(int k = 0; k < 3; k++) {
+            unsigned int a = w[k], b = w[(k + 1) % 3];
+            edges[t * 3 + k].key = a < b ? ((unsigned long long)a << 32 | b) : ((unsigned long long)b << 32 | a);
+            edges[t * 3 + k].tri = t;
+        }
+    }
+
+    qsort(edges, numTris * 3, sizeof(EdgeRef), compare_edge_refs);
+    for(int i = 0; i < numTris * 3; i++) {
+        bool border = (i == 0 || edges[i - 1].key != edges[i].key) && (i + 1 == numTris * 3 || edges[i + 1].key != edges[i].key);
+        if(!border) {
+            continue;
+        }
+
+        int a = (int)(edges[i].key >> 32), b = (int)(edges[i].key & 0xffffffffu);
+        Vector3 pa = s->positions[a], pb = s->positions[b];
+        double ex = pb.x - pa.x, ey = pb.y - pa.y, ez = pb.z - pa.z;
+
+        // Plane through the edge, perpendicular to its only triangle
+        const GLuint *t = &indices[edges[i].tri * 3];
+        Vector3 fn = triangle_normal(s->positions[s->weldedIds[t[0]]], s->positions[s->weldedIds[t[1]]], s->positions[s->weldedIds[t[2]]]);
+        double nx = ey * fn.z - ez * fn.y, ny = ez * fn.x - ex * fn.z, nz = ex * fn.y - ey * fn.x;
+        double len = sqrt(nx * nx + ny * ny + nz * nz);
+        if(len > 0) {
+            nx /= len; ny /= len; nz /= len;
+            quadric_add_plane(&s->quadrics[a], nx, ny, nz, -(nx * pa.x + ny * pa.y + nz * pa.z), 4.0);
+            quadric_add_plane(&s->quadrics[b], nx, ny, nz, -(nx * pa.x + ny * pa.y + nz * pa.z), 4.0);
+        }
+    }
+    free(edges);
+}
+
+static int merged_into(Simplifier *s, int v) {
+    while(s->merged[v] != v) {
+        s->merged[v] = s->merged[s->merged[v]];
+        v = s->merged[v];
+    }
+    return v;
+}
+
+static Vector3 closest_point_triangle(Vector3 p, Vector3 a, Vector3 b, Vector3 c);
+
+// Largest distance from a full-detail position to the triangles around the vertex it was merged into
+static float lod_deviation(Simplifier *s, const GLuint *indices, int numIndices) {
+    Model *m = s->model;
+    int wc = s->weldedCount;
+    int *triStarts = (int *)calloc(wc + 1, sizeof(int));
+    int *vertexTris = (int *)malloc(sizeof(int) * (numIndices + 1));
+    for(int i = 0; i < numIndices; i++) {
+        triStarts[s->weldedIds[indices[i]] + 1]++;
+    }
+    for(int i = 0; i < wc; i++) {
+        triStarts[i + 1] += triStarts[i];
+    }
+
+    int *fill = (int *)malloc(sizeof(int) * (wc + 1));
+    memcpy(fill, triStarts, sizeof(int) * wc);
+    for(int i = 0; i < numIndices; i++) {
+        vertexTris[fill[s->weldedIds[indices[i]]]++] = i / 3;
+    }
+    free(fill);
+
+    float deviation = 0.0f;
+    for(int v = 0; v < wc; v++) {
+        int to = merged_into(s, v);
+        if(to == v) {
+            continue; // still a vertex of the mesh
+        }
+
+        Vector3 p = s->positions[v];
+        float closest = INFINITY;
+        for(int i = triStarts[to]; i < triStarts[to + 1]; i++) {
+            const GLuint *t = &indices[vertexTris[i] * 3];
+            Vector3 d = SubV3(p, closest_point_triangle(p, m->vertexArray[t[0]], m->vertexArray[t[1]], m->vertexArray[t[2]]));
+            closest = min_f(closest, d.x * d.x + d.y * d.y + d.z * d.z);
+        }
+        if(closest < INFINITY) {
+            deviation = max_f(deviation, closest);
+        }
+    }
+
+    free(triStarts);
+    free(vertexTris);
+    return sqrtf(deviation);
+}
+
+static void dispose_simplifier(Simplifier *s) {
+    free(s->quadrics);
+    free(s->merged);
+    free(s->weldedIds);
+    free(s->copyStarts);
+    free(s->copies);
+    free(s->positions);
+}
+
+static float attribute_distance(Model *m, int a, int b) {
+    float d = 0.0f;
+    if(m->normalArray) {
+        Vector3 na = m->normalArray[a], nb = m->normalArray[b];
+        d += (na.x - nb.x) * (na.x - nb.x) + (na.y - nb.y) * (na.y - nb.y) + (na.z - nb.z) * (na.z - nb.z);
+    }
+
+    if(m->texCoordArray) {
+        Vector2 ta = m->texCoordArray[a], tb = m->texCoordArray[b];
+        d += (ta.x - tb.x) * (ta.x - tb.x) + (ta.y - tb.y) * (ta.y - tb.y);
+    }
+
+    return d;
+}
+
+// Half-edge collapses on the welded mesh. Every model vertex at a removed position moves to the copy
+// of the target position in the same attribute region, so seams stay closed and attributes stay valid.
+static int simplify_indices(Simplifier *s, GLuint *indices, int numIndices, int targetIndices) {
+    Model *m = s->model;
+    int numTris = numIndices / 3;
+    int wc = s->weldedCount;
+
+    int *welded = (int *)malloc(sizeof(int) * (numIndices + 1));
+    for(int i = 0; i < numIndices; i++) {
+        welded[i] = s->weldedIds[indices[i]];
+    }
+
+    int *triStarts = (int *)malloc(sizeof(int) * (wc + 1));
+    int *vertexTris = (int *)malloc(sizeof(int) * (numIndices + 1));
+    int *locked = (int *)calloc(wc + 1, sizeof(int));
+    int *vertexRemap = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    Collapse *collapses = (Collapse *)malloc(sizeof(Collapse) * (wc + 1));
+
+    for(int pass = 1; numTris * 3 > targetIndices && pass < 64; pass++) {
+        // Welded vertex -> triangle adjacency of the current mesh
+        memset(triStarts, 0, sizeof(int) * (wc + 1));
+        for(int i = 0; i < numTris * 3; i++) {
+            triStarts[welded[i] + 1]++;
+        }
+        for(int i = 0; i < wc; i++) {
+            triStarts[i + 1] += triStarts[i];
+        }
+
+        int *fill = (int *)malloc(sizeof(int) * (wc + 1));
+        memcpy(fill, triStarts, sizeof(int) * wc);
+        for(int i = 0; i < numTris * 3; i++) {
+            vertexTris[fill[welded[i]]++] = i / 3;
+        }
+        free(fill);
+
+        // Cheapest collapse out of every vertex
+        for(int i = 0; i < wc; i++) {
+            collapses[i].cost = -1;
+        }
+
+        for(int t = 0; t < numTris; t++) {
+            for(int k = 0; k < 3; k++) {
+                int a = welded[t * 3 + k], b = welded[t * 3 + (k + 1) % 3];
+                Quadric q = s->quadrics[a];
+                quadric_add(&q, &s->quadrics[b]);
+
+                double cost = quadric_error(&q, s->positions[b]);
+                if(collapses[a].cost < 0 || cost < collapses[a].cost) {
+                    collapses[a].cost = cost;
+                    collapses[a].from = a;
+                    collapses[a].to = b;
+                }
+
+                cost = quadric_error(&q, s->positions[a]);
+                if(collapses[b].cost < 0 || cost < collapses[b].cost) {
+                    collapses[b].cost = cost;
+                    collapses[b].from = b;
+                    collapses[b].to = a;
+                }
+            }
+        }
+
+        int collapseCount = 0;
+        for(int i = 0; i < wc; i++) {
+            if(collapses[i].cost >= 0) {
+                collapses[collapseCount++] = collapses[i];
+            }
+        }
+        qsort(collapses, collapseCount, sizeof(Collapse), compare_collapses);
+
+        for(int i = 0; i < m->numVertices; i++) {
+            vertexRemap[i] = i;
+        }
+
+        int removed = 0;
+        int budget = (numTris * 3 - targetIndices) / 3;
+        for(int c = 0; c < collapseCount && removed < budget; c++) {
+            int from = collapses[c].from, to = collapses[c].to;
+            if(locked[from] == pass || locked[to] == pass) {
+                continue;
+            }
+
+            // Reject collapses that flip or badly skew a surrounding triangle
+            Vector3 target = s->positions[to];
+            bool valid = true;
+            int dropped = 0;
+            for(int i = triStarts[from]; i < triStarts[from + 1] && valid; i++) {
+                int t = vertexTris[i];
+                Vector3 p[3], q[3];
+                bool hasTo = false;
+                for(int k = 0; k < 3; k++) {
+                    p[k] = s->positions[welded[t * 3 + k]];
+                    q[k] = welded[t * 3 + k] == from ? target : p[k];
+                    hasTo |= welded[t * 3 + k] == to;
+                }
+
+                if(hasTo) {
+                    dropped++;
+                    continue;
+                }
+
+                Vector3 n0 = triangle_normal(p[0], p[1], p[2]);
+                Vector3 n1 = triangle_normal(q[0], q[1], q[2]);
+                double d = (double)n0.x * n1.x + (double)n0.y * n1.y + (double)n0.z * n1.z;
+                double l = sqrt(((double)n0.x * n0.x + (double)n0.y * n0.y + (double)n0.z * n0.z) * ((double)n1.x * n1.x + (double)n1.y * n1.y + (double)n1.z * n1.z));
+                valid = d > 0.25 * l;
+            }
+
+            if(!valid || dropped == 0) {
+                continue;
+            }
+
+            // Move each copy of 'from' to the copy of 'to' it shares a triangle with, or the closest in attributes
+            for(int i = s->copyStarts[from]; i < s->copyStarts[from + 1]; i++) {
+                int v = s->copies[i];
+                int best = -1;
+                for(int j = triStarts[from]; j < triStarts[from + 1] && best < 0; j++) {
+                    int t = vertexTris[j];
+                    if(indices[t * 3] != (GLuint)v && indices[t * 3 + 1] != (GLuint)v && indices[t * 3 + 2] != (GLuint)v) {
+                        continue;
+                    }
+                    for(int k = 0; k < 3; k++) {
+                        if(welded[t * 3 + k] == to) {
+                            best = indices[t * 3 + k];
+                        }
+                    }
+                }
+
+                float bestDistance = 1e30f;
+                for(int j = s->copyStarts[to]; j < s->copyStarts[to + 1] && best < 0; j++) {
+                    float d = attribute_distance(m, v, s->copies[j]);
+                    if(d < bestDistance) {
+                        bestDistance = d;
+                        vertexRemap[v] = s->copies[j];
+                    }
+                }
+
+                if(best >= 0) {
+                    vertexRemap[v] = best;
+                }
+            }
+
+            for(int i = triStarts[from]; i < triStarts[from + 1]; i++) {
+                int t = vertexTris[i];
+                for(int k = 0; k < 3; k++) {
+                    locked[welded[t * 3 + k]] = pass;
+                }
+            }
+
+            quadric_add(&s->quadrics[to], &s->quadrics[from]);
+            s->merged[from] = to;
+            removed += dropped;
+        }
+
+        if(removed == 0) {
+            break;
+        }
+
+        int out = 0;
+        for(int t = 0; t < numTris; t++) {
+            GLuint v0 = vertexRemap[indices[t * 3]], v1 = vertexRemap[indices[t * 3 + 1]], v2 = vertexRemap[indices[t * 3 + 2]];
+            int w0 = s->weldedIds[v0], w1 = s->weldedIds[v1], w2 = s->weldedIds[v2];
+            if(w0 != w1 && w1 != w2 && w0 != w2) {
+                indices[out * 3] = v0;
+                indices[out * 3 + 1] = v1;
+                indices[out * 3 + 2] = v2;
+                welded[out * 3] = w0;
+                welded[out * 3 + 1] = w1;
+                welded[out * 3 + 2] = w2;
+                out++;
+            }
+        }
+        numTris = out;
+    }
+
+    free(welded);
+    free(triStarts);
+    free(vertexTris);
+    free(locked);
+    free(vertexRemap);
+    free(collapses);
+
+    return numTris * 3;
+}
+
+static void dispose_lods(Model *m) {
+    for(int i = 0; i < m->numLods; i++) {
+        free(m->lods[i].indexArray);
+        if(m->lods[i].ib) {
+            glDeleteBuffers(1, &m->lods[i].ib);
+        }
+    }
+
+    free(m->lods);
+    m->lods = NULL;
+    m->numLods = 0;
+}
+
+static void generate_lods(Model *m, int levels, float ratio) {
+    dispose_lods(m);
+    if(levels <= 0 || m->numIndices < 3 || !m->vertexArray) {
+        return;
+    }
+
+    compute_bounds(m); // the sphere drives LOD selection
+
+    Simplifier s;
+    init_simplifier(&s, m);
+    init_quadrics(&s, m->indexArray, m->numIndices - m->numIndices % 3);
+
+    m->lods = (ModelLOD *)calloc(levels, sizeof(ModelLOD));
+    GLuint *source = m->indexArray;
+    int sourceCount = m->numIndices - m->numIndices % 3;
+    float error = 0.0f;
+
+    for(int level = 0; level < levels; level++) {
+        GLuint *indices = (GLuint *)malloc(sizeof(GLuint) * (sourceCount + 1));
+        memcpy(indices, source, sizeof(GLuint) * sourceCount);
+
+        int target = (int)(sourceCount / 3 * ratio) * 3;
+        int count = simplify_indices(&s, indices, sourceCount, target);
+        if(count >= sourceCount || count == 0) {
+            free(indices);
+            break; // no further progress possible
+        }
+
+        error = max_f(error, lod_deviation(&s, indices, count)); // never below a finer level's, selection walks them in order
+        m->lods[level].indexArray = indices;
+        m->lods[level].numIndices = count;
+        m->lods[level].error = error;
+        m->numLods++;
+
+        source = indices;
+        sourceCount = count;
+    }
+
+    dispose_simplifier(&s);
+}
+
+static void upload_lods(Model *m) {
+    for(int i = 0; i < m->numLods; i++) {
+        if(!m->lods[i].ib) {
+            glGenBuffers(1, &m->lods[i].ib);
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->lods[i].ib);
+        upload_index_data(m, m->lods[i].indexArray, m->lods[i].numIndices);
+    }
+}
+
+void glUtilitiesGenerateLODs(Model *m, int levels, float ratio) {
+    if(m) {
+        generate_lods(m, levels, ratio);
+        if(m->vao) {
+            glBindVertexArray(0); // keep m->ib as the VAO's element buffer
+            upload_lods(m);
+        }
+    }
+}
+
+int glUtilitiesSelectLOD(Model *m, Matrix4 projection, Matrix4 modelView) {
+    if(!m || m->numLods == 0) {
+        return 0;
+    }
+
+    // Row-major matrices, as uploaded with transpose = GL_TRUE
+    Vector3 c = m->boundsCenter;
+    float z = modelView.m[8] * c.x + modelView.m[9] * c.y + modelView.m[10] * c.z + modelView.m[11];
+
+    float scale = matrix_max_scale(modelView);
+
+    float pixelsPerUnit = fabsf(projection.m[5]) * WINDOW_HEIGHT * 0.5f * scale;
+    if(projection.m[14] != 0.0f) {
+        float distance = -z - m->boundsRadius * scale;
+        if(distance <= 0.0f) {
+            return 0; // camera inside the bounding sphere
+        }
+        pixelsPerUnit /= distance;
+    }
+
+    int level = 0;
+    while(level < m->numLods && m->lods[level].error * pixelsPerUnit <= LOD_THRESHOLD) {
+        level++;
+    }
+
+    return level;
+}
+
+#define CLUSTER_MAX_VERTICES 64
+#define CLUSTER_MAX_TRIANGLES 124
+
+static void compute_cluster_bounds(Model *m, ModelCluster *c) {
+    GLuint *idx = &m->indexArray[c->indexOffset];
+    int numTris = c->numIndices / 3;
+
+    Vector3 lo = m->vertexArray[idx[0]], hi = lo;
+    for(int i = 1; i < c->numIndices; i++) {
+        Vector3 p = m->vertexArray[idx[i]];
+        lo.x = min_f(lo.x, p.x); lo.y = min_f(lo.y, p.y); lo.z = min_f(lo.z, p.z);
+        hi.x = max_f(hi.x, p.x); hi.y = max_f(hi.y, p.y); hi.z = max_f(hi.z, p.z);
+    }
+
+    c->center = SetV3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+    c->radius = 0.0f;
+    for(int i = 0; i < c->numIndices; i++) {
+        Vector3 p = m->vertexArray[idx[i]];
+        float d = (p.x - c->center.x) * (p.x - c->center.x) + (p.y - c->center.y) * (p.y - c->center.y) + (p.z - c->center.z) * (p.z - c->center.z);
+        c->radius = max_f(c->radius, d);
+    }
+    c->radius = sqrtf(c->radius);
+
+    // Normal cone: average face direction and the widest deviation from it
+    Vector3 *normals = (Vector3 *)malloc(sizeof(Vector3) * (numTris + 1));
+    Vector3 axis = {{0}, {0}, {0}};
+    for(int t = 0; t < numTris; t++) {
+        Vector3 n = triangle_normal(m->vertexArray[idx[t * 3]], m->vertexArray[idx[t * 3 + 1]], m->vertexArray[idx[t * 3 + 2]]);
+        float len = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+        if(len > 0.0f) {
+            n.x /= len; n.y /= len; n.z /= len;
+        }
+        normals[t] = n;
+        axis.x += n.x; axis.y += n.y; axis.z += n.z;
+    }
+
+    float len = sqrtf(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+    float minDot = -1.0f;
+    if(len > 0.0f) {
+        axis.x /= len; axis.y /= len; axis.z /= len;
+        minDot = 1.0f;
+        for(int t = 0; t < numTris; t++) {
+            Vector3 n = normals[t];
+            if(n.x == 0.0f && n.y == 0.0f && n.z == 0.0f) {
+                continue; // degenerate triangles are never visible
+            }
+            minDot = min_f(minDot, axis.x * n.x + axis.y * n.y + axis.z * n.z);
+        }
+    }
+
+    c->coneAxis = axis;
+    c->coneApex = c->center;
+    if(minDot <= 0.1f) {
+        c->coneCutoff = 2.0f; // spread too wide, never cone culled
+    }
+    else {
+        // Apex: the point where every triangle plane is behind the cone
+        float maxT = 0.0f;
+        for(int t = 0; t < numTris; t++) {
+            Vector3 n = normals[t];
+            Vector3 p = m->vertexArray[idx[t * 3]];
+            float dn = axis.x * n.x + axis.y * n.y + axis.z * n.z;
+            if(dn > 0.0f) {
+                float dc = (c->center.x - p.x) * n.x + (c->center.y - p.y) * n.y + (c->center.z - p.z) * n.z;
+                maxT = max_f(maxT, dc / dn);
+            }
+        }
+
+        c->coneApex = SetV3(c->center.x - axis.x * maxT, c->center.y - axis.y * maxT, c->center.z - axis.z * maxT);
+        c->coneCutoff = sqrtf(1.0f - minDot * minDot);
+    }
+
+    free(normals);
+}
+
+static void dispose_clusters(Model *m) {
+    free(m->clusters);
+    m->clusters = NULL;
+    m->numClusters = 0;
+}
+
+// Greedy meshlets grown over shared vertices, triangles of a cluster are made contiguous in indexArray
+static void build_clusters(Model *m) {
+    dispose_clusters(m);
+
+    int numTris = m->numIndices / 3;
+    if(numTris == 0 || !m->vertexArray) {
+        return;
+    }
+
+    int *triStarts = (int *)calloc(m->numVertices + 1, sizeof(int));
+    int *vertexTris = (int *)malloc(sizeof(int) * (numTris * 3 + 1));
+    for(int i = 0; i < numTris * 3; i++) {
+        triStarts[m->indexArray[i] + 1]++;
+    }
+    for(int i = 0; i < m->numVertices; i++) {
+        triStarts[i + 1] += triStarts[i];
+    }
+
+    int *fill = (int *)malloc(sizeof(int) * (m->numVertices + 1));
+    memcpy(fill, triStarts, sizeof(int) * m->numVertices);
+    for(int i = 0; i < numTris * 3; i++) {
+        vertexTris[fill[m->indexArray[i]]++] = i / 3;
+    }
+    free(fill);
+
+    char *used = (char *)calloc(numTris + 1, 1);
+    int *inCluster = (int *)malloc(sizeof(int) * (m->numVertices + 1)); // cluster id that last used the vertex
+    for(int i = 0; i < m->numVertices; i++) {
+        inCluster[i] = -1;
+    }
+
+    GLuint *out = (GLuint *)malloc(sizeof(GLuint) * (numTris * 3 + 1));
+    m->clusters = (ModelCluster *)calloc(numTris + 1, sizeof(ModelCluster));
+
+    int outTris = 0;
+    int nextSeed = 0;
+    int clusterVerts[CLUSTER_MAX_VERTICES];
+
+    while(outTris < numTris) {
+        while(used[nextSeed]) {
+            nextSeed++;
+        }
+
+        int id = m->numClusters++;
+        ModelCluster *c = &m->clusters[id];
+        c->indexOffset = outTris * 3;
+
+        int vertexCount = 0;
+        int tri = nextSeed;
+        while(tri >= 0) {
+            used[tri] = 1;
+            for(int k = 0; k < 3; k++) {
+                GLuint v = m->indexArray[tri * 3 + k];
+                out[outTris * 3 + k] = v;
+                if(inCluster[v] != id) {
+                    inCluster[v] = id;
+                    clusterVerts[vertexCount++] = v;
+                }
+            }
+            outTris++;
+            c->numIndices += 3;
+
+            if(c->numIndices / 3 >= CLUSTER_MAX_TRIANGLES) {
+                break;
+            }
+
+            // Next: the unused neighbour adding the fewest new vertices
+            tri = -1;
+            int bestNew = 4;
+            for(int i = 0; i < vertexCount && bestNew > 0; i++) {
+                int v = clusterVerts[i];
+                for(int j = triStarts[v]; j < triStarts[v + 1]; j++) {
+                    int t = vertexTris[j];
+                    if(used[t]) {
+                        continue;
+                    }
+
+                    int added = 0;
+                    for(int k = 0; k < 3; k++) {
+                        added += inCluster[m->indexArray[t * 3 + k]] != id;
+                    }
+
+                    if(added < bestNew && vertexCount + added <= CLUSTER_MAX_VERTICES) {
+                        bestNew = added;
+                        tri = t;
+                    }
+                }
+            }
+
+            if(tri < 0 && vertexCount + 3 <= CLUSTER_MAX_VERTICES) {
+                // No connected triangle left, take the closest of the next few unused ones
+                Vector3 center = {{0}, {0}, {0}};
+                for(int i = 0; i < vertexCount; i++) {
+                    center.x += m->vertexArray[clusterVerts[i]].x / vertexCount;
+                    center.y += m->vertexArray[clusterVerts[i]].y / vertexCount;
+                    center.z += m->vertexArray[clusterVerts[i]].z / vertexCount;
+                }
+
+                float bestDistance = 1e30f;
+                for(int t = nextSeed, tries = 0; t < numTris && tries < 32; t++) {
+                    if(used[t]) {
+                        continue;
+                    }
+                    tries++;
+
+                    Vector3 p = m->vertexArray[m->indexArray[t * 3]];
+                    float d = (p.x - center.x) * (p.x - center.x) + (p.y - center.y) * (p.y - center.y) + (p.z - center.z) * (p.z - center.z);
+                    if(d < bestDistance) {
+                        bestDistance = d;
+                        tri = t;
+                    }
+                }
+            }
+        }
+    }
+
+    free(triStarts);
+    free(vertexTris);
+    free(used);
+    free(inCluster);
+
+    memcpy(m->indexArray, out, sizeof(GLuint) * numTris * 3);
+    free(out);
+
+    m->clusters = (ModelCluster *)realloc(m->clusters, sizeof(ModelCluster) * m->numClusters);
+    for(int i = 0; i < m->numClusters; i++) {
+        compute_cluster_bounds(m, &m->clusters[i]);
+    }
+}
+
+void glUtilitiesBuildClusters(Model *m) {
+    if(m) {
+        build_clusters(m);
+        if(m->vao) {
+            upload_model_indices(m);
+        }
+
+        // Triangle ids and edges follow the new order
+        if(m->bvh) {
+            m->bvh->stale |= MODEL_INDICES;
+        }
+        dispose_edges(m);
+    }
+}
+
+int glUtilitiesCullClusters(Model *m, Matrix4 projection, Matrix4 modelView, char *visible) {
+    if(!m || !m->clusters) {
+        return 0;
+    }
+
+    float planes[6][4];
+    extract_frustum_planes(projection, planes);
+
+    float scale = matrix_max_scale(modelView);
+    int count = 0;
+    for(int i = 0; i < m->numClusters; i++) {
+        ModelCluster *c = &m->clusters[i];
+        Vector3 center = transform_point(modelView, c->center);
+        float radius = c->radius * scale;
+
+        char inside = 1;
+        for(int p = 0; p < 6 && inside; p++) {
+            inside = planes[p][0] * center.x + planes[p][1] * center.y + planes[p][2] * center.z + planes[p][3] >= -radius;
+        }
+
+        // Camera sits at the view space origin, cull if it is inside the cluster's back-facing cone
+        if(inside && c->coneCutoff <= 1.0f) {
+            Vector3 apex = transform_point(modelView, c->coneApex);
+            Vector3 axis = transform_direction(modelView, c->coneAxis);
+            float al = sqrtf(apex.x * apex.x + apex.y * apex.y + apex.z * apex.z);
+            float xl = sqrtf(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+            if(al > 0.0f && xl > 0.0f) {
+                inside = (apex.x * axis.x + apex.y * axis.y + apex.z * axis.z) / (al * xl) < c->coneCutoff;
+            }
+        }
+
+        visible[i] = inside;
+        count += inside;
+    }
+
+    return count;
+}
+
+void glUtilitiesModelWorldBounds(Model *m, Matrix4 transform, Vector3 *min, Vector3 *max) {
+    // Transformed box center plus the extents projected on each axis
+    Vector3 c = transform_point(transform, SetV3((m->boundsMin.x + m->boundsMax.x) / 2, (m->boundsMin.y + m->boundsMax.y) / 2, (m->boundsMin.z + m->boundsMax.z) / 2));
+    Vector3 e = SetV3((m->boundsMax.x - m->boundsMin.x) / 2, (m->boundsMax.y - m->boundsMin.y) / 2, (m->boundsMax.z - m->boundsMin.z) / 2);
+    float *t = transform.m;
+    Vector3 r = SetV3(fabsf(t[0]) * e.x + fabsf(t[1]) * e.y + fabsf(t[2]) * e.z,
+                      fabsf(t[4]) * e.x + fabsf(t[5]) * e.y + fabsf(t[6]) * e.z,
+                      fabsf(t[8]) * e.x + fabsf(t[9]) * e.y + fabsf(t[10]) * e.z);
+    *min = SubV3(c, r);
+    *max = SetV3(c.x + r.x, c.y + r.y, c.z + r.z);
+}
+
+static bool box_in_frustum(float planes[6][4], Vector3 lo, Vector3 hi) {
+    Vector3 c = SetV3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+    Vector3 e = SetV3((hi.x - lo.x) / 2, (hi.y - lo.y) / 2, (hi.z - lo.z) / 2);
+    for(int p = 0; p < 6; p++) {
+        float d = planes[p][0] * c.x + planes[p][1] * c.y + planes[p][2] * c.z + planes[p][3];
+        float r = fabsf(planes[p][0]) * e.x + fabsf(planes[p][1]) * e.y + fabsf(planes[p][2]) * e.z;
+        if(d + r < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int glUtilitiesCullBoxes(Matrix4 viewProjection, Vector3 *mins, Vector3 *maxs, int count, char *visible) {
+    float planes[6][4];
+    extract_frustum_planes(viewProjection, planes);
+
+    int numVisible = 0, i = 0;
+#ifdef __SSE2__
+    // Four boxes at a time, a box is out when center distance + projected extent < 0 for a plane
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for(; i + 4 <= count; i += 4) {
+        __m128 lx = _mm_setr_ps(mins[i].x, mins[i + 1].x, mins[i + 2].x, mins[i + 3].x);
+        __m128 ly = _mm_setr_ps(mins[i].y, mins[i + 1].y, mins[i + 2].y, mins[i + 3].y);
+        __m128 lz = _mm_setr_ps(mins[i].z, mins[i + 1].z, mins[i + 2].z, mins[i + 3].z);
+        __m128 hx = _mm_setr_ps(maxs[i].x, maxs[i + 1].x, maxs[i + 2].x, maxs[i + 3].x);
+        __m128 hy = _mm_setr_ps(maxs[i].y, maxs[i + 1].y, maxs[i + 2].y, maxs[i + 3].y);
+        __m128 hz = _mm_setr_ps(maxs[i].z, maxs[i + 1].z, maxs[i + 2].z, maxs[i + 3].z);
+        __m128 cx = _mm_mul_ps(_mm_add_ps(lx, hx), half), ex = _mm_mul_ps(_mm_sub_ps(hx, lx), half);
+        __m128 cy = _mm_mul_ps(_mm_add_ps(ly, hy), half), ey = _mm_mul_ps(_mm_sub_ps(hy, ly), half);
+        __m128 cz = _mm_mul_ps(_mm_add_ps(lz, hz), half), ez = _mm_mul_ps(_mm_sub_ps(hz, lz), half);
+
+        __m128 outside = _mm_setzero_ps();
+        for(int p = 0; p < 6; p++) {
+            __m128 px = _mm_set1_ps(planes[p][0]), py = _mm_set1_ps(planes[p][1]), pz = _mm_set1_ps(planes[p][2]);
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, cx), _mm_mul_ps(py, cy)), _mm_add_ps(_mm_mul_ps(pz, cz), _mm_set1_ps(planes[p][3])));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_and_ps(px, absMask), ex), _mm_mul_ps(_mm_and_ps(py, absMask), ey)), _mm_mul_ps(_mm_and_ps(pz, absMask), ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+        }
+
+        int mask = _mm_movemask_ps(outside);
+        for(int k = 0; k < 4; k++) {
+            visible[i + k] = !(mask & (1 << k));
+            numVisible += visible[i + k];
+        }
+    }
+#endif
+    for(; i < count; i++) {
+        visible[i] = box_in_frustum(planes, mins[i], maxs[i]);
+        numVisible += visible[i];
+    }
+
+    return numVisible;
+}
+
+int glUtilitiesCullModels(Matrix4 viewProjection, Model **models, Matrix4 *transforms, int count, char *visible) {
+    static Vector3 *mins = NULL, *maxs = NULL;
+    static int capacity = 0;
+    if(capacity < count) {
+        capacity = count;
+        mins = (Vector3 *)realloc(mins, sizeof(Vector3) * capacity);
+        maxs = (Vector3 *)realloc(maxs, sizeof(Vector3) * capacity);
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(transforms) {
+            glUtilitiesModelWorldBounds(models[i], transforms[i], &mins[i], &maxs[i]);
+        }
+        else {
+            mins[i] = models[i]->boundsMin;
+            maxs[i] = models[i]->boundsMax;
+        }
+    }
+
+    return glUtilitiesCullBoxes(viewProjection, mins, maxs, count, visible);
+}
+
+static float box_area(Vector3 lo, Vector3 hi) {
+    float dx = hi.x - lo.x, dy = hi.y - lo.y, dz = hi.z - lo.z;
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// Entry distance of the ray into the box, INFINITY on a miss
+static float ray_box(Vector3 origin, Vector3 inverse, Vector3 lo, Vector3 hi, float maxDistance) {
+    Vector3 t0, t1;
+    t0.x = (lo.x - origin.x) * inverse.x; t1.x = (hi.x - origin.x) * inverse.x;
+    t0.y = (lo.y - origin.y) * inverse.y; t1.y = (hi.y - origin.y) * inverse.y;
+    t0.z = (lo.z - origin.z) * inverse.z; t1.z = (hi.z - origin.z) * inverse.z;
+    Vector3 near = min_v3(t0, t1), far = max_v3(t0, t1);
+
+    float tmin = near.x > near.y ? near.x : near.y;
+    tmin = near.z > tmin ? near.z : tmin;
+    tmin = tmin > 0 ? tmin : 0;
+    float tmax = far.x < far.y ? far.x : far.y;
+    tmax = far.z < tmax ? far.z : tmax;
+    return tmin <= tmax && tmin <= maxDistance ? tmin : INFINITY;
+}
+
+// Zero components become tiny so a ray starting on a slab plane gives no 0 * inf NaNs
+static Vector3 ray_inverse(Vector3 d) {
+    return SetV3(1 / (fabsf(d.x) > 1e-20f ? d.x : copysignf(1e-20f, d.x)),
+                 1 / (fabsf(d.y) > 1e-20f ? d.y : copysignf(1e-20f, d.y)),
+                 1 / (fabsf(d.z) > 1e-20f ? d.z : copysignf(1e-20f, d.z)));
+}
+
+static float box_distance_squared(Vector3 lo, Vector3 hi, Vector3 p) {
+    float dx = max_f(max_f(lo.x - p.x, p.x - hi.x), 0);
+    float dy = max_f(max_f(lo.y - p.y, p.y - hi.y), 0);
+    float dz = max_f(max_f(lo.z - p.z, p.z - hi.z), 0);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+typedef struct BVHBuildJob {
+    Model *m;
+    Vector3 *triMin, *triMax, *centroids;
+    int *order; // triangles, leaves own contiguous ranges
+
+    // Subtrees left for the pool by the top levels, each builds its own node array
+    int numTasks, taskCapacity;
+    int *taskFirst, *taskCount, *taskDepth, *taskSlot;
+    ModelBVHNode **taskNodes;
+    int *taskNumNodes;
+} BVHBuildJob;
+
+static int push_bvh_nodes(ModelBVHNode **nodes, int *numNodes, int *capacity, int n) {
+    if(*numNodes + n > *capacity) {
+        *capacity = (*numNodes + n) * 2;
+        *nodes = (ModelBVHNode *)realloc(*nodes, sizeof(ModelBVHNode) * *capacity);
+    }
+
+    int first = *numNodes;
+    *numNodes += n;
+    return first;
+}
+
+// Binned SAH split of order[first, first + count), returns the size of the left part
+static int split_bvh_range(BVHBuildJob *job, int first, int count, int depth) {
+    int *order = job->order + first;
+
+    Vector3 clo = job->centroids[order[0]], chi = clo;
+    for(int i = 1; i < count; i++) {
+        clo = min_v3(clo, job->centroids[order[i]]);
+        chi = max_v3(chi, job->centroids[order[i]]);
+    }
+
+    Vector3 extent = SubV3(chi, clo);
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    float axisMin = ((float *)&clo)[axis], axisExtent = ((float *)&extent)[axis];
+    if(axisExtent <= 0 || depth >= MODEL_BVH_MAX_DEPTH) {
+        return count / 2; // keeps the depth bounded, boxes still come from the contents
+    }
+
+    Vector3 binMin[MODEL_BVH_BINS], binMax[MODEL_BVH_BINS];
+    int binCount[MODEL_BVH_BINS] = {0};
+    float binScale = MODEL_BVH_BINS / axisExtent;
+    for(int i = 0; i < count; i++) {
+        int t = order[i];
+        int b = (int)((((float *)&job->centroids[t])[axis] - axisMin) * binScale);
+        b = b < MODEL_BVH_BINS ? b : MODEL_BVH_BINS - 1;
+        binMin[b] = binCount[b] ? min_v3(binMin[b], job->triMin[t]) : job->triMin[t];
+        binMax[b] = binCount[b] ? max_v3(binMax[b], job->triMax[t]) : job->triMax[t];
+        binCount[b]++;
+    }
+
+    float rightCost[MODEL_BVH_BINS];
+    Vector3 lo, hi;
+    int n = 0;
+    for(int b = MODEL_BVH_BINS - 1; b > 0; b--) {
+        if(binCount[b]) {
+            lo = n ? min_v3(lo, binMin[b]) : binMin[b];
+            hi = n ? max_v3(hi, binMax[b]) : binMax[b];
+            n += binCount[b];
+        }
+        rightCost[b] = n ? box_area(lo, hi) * n : 0;
+    }
+
+    float bestCost = INFINITY;
+    int bestBin = -1;
+    n = 0;
+    for(int b = 0; b < MODEL_BVH_BINS - 1; b++) {
+        if(binCount[b]) {
+            lo = n ? min_v3(lo, binMin[b]) : binMin[b];
+            hi = n ? max_v3(hi, binMax[b]) : binMax[b];
+            n += binCount[b];
+        }
+        if(n == 0 || n == count) {
+            continue;
+        }
+
+        float cost = box_area(lo, hi) * n + rightCost[b + 1];
+        if(cost < bestCost) {
+            bestCost = cost;
+            bestBin = b;
+        }
+    }
+
+    if(bestBin < 0) {
+        return count / 2;
+    }
+
+    int i = 0, j = count - 1;
+    while(i <= j) {
+        int b = (int)((((float *)&job->centroids[order[i]])[axis] - axisMin) * binScale);
+        if((b < MODEL_BVH_BINS ? b : MODEL_BVH_BINS - 1) <= bestBin) {
+            i++;
+        }
+        else {
+            int t = order[i]; order[i] = order[j]; order[j--] = t;
+        }
+    }
+    return i;
+}
+
+// Fills node n for the range, children are allocated as adjacent pairs. With spawn set,
+// ranges small enough are left as tasks for the pool instead (count = -1 - task).
+static void build_bvh_node(BVHBuildJob *job, ModelBVHNode **nodes, int *numNodes, int *capacity, int n, int first, int count, int depth, bool spawn) {
+    Vector3 lo = job->triMin[job->order[first]], hi = job->triMax[job->order[first]];
+    for(int i = 1; i < count; i++) {
+        lo = min_v3(lo, job->triMin[job->order[first + i]]);
+        hi = max_v3(hi, job->triMax[job->order[first + i]]);
+    }
+    (*nodes)[n].min = lo;
+    (*nodes)[n].max = hi;
+
+    if(count <= 4) {
+        (*nodes)[n].first = first;
+        (*nodes)[n].count = count;
+        return;
+    }
+
+    if(spawn && count <= MODEL_BVH_TASK_SIZE) {
+        if(job->numTasks == job->taskCapacity) {
+            job->taskCapacity = job->taskCapacity ? job->taskCapacity * 2 : 64;
+            job->taskFirst = (int *)realloc(job->taskFirst, sizeof(int) * job->taskCapacity);
+            job->taskCount = (int *)realloc(job->taskCount, sizeof(int) * job->taskCapacity);
+            job->taskDepth = (int *)realloc(job->taskDepth, sizeof(int) * job->taskCapacity);
+            job->taskSlot = (int *)realloc(job->taskSlot, sizeof(int) * job->taskCapacity);
+        }
+        job->taskFirst[job->numTasks] = first;
+        job->taskCount[job->numTasks] = count;
+        job->taskDepth[job->numTasks] = depth;
+        job->taskSlot[job->numTasks] = n;
+        (*nodes)[n].count = -1 - job->numTasks++;
+        return;
+    }
+
+    int left = split_bvh_range(job, first, count, depth);
+    int child = push_bvh_nodes(nodes, numNodes, capacity, 2);
+    (*nodes)[n].first = child;
+    (*nodes)[n].count = 0;
+
+    build_bvh_node(job, nodes, numNodes, capacity, child, first, left, depth + 1, spawn);
+    build_bvh_node(job, nodes, numNodes, capacity, child + 1, first + left, count - left, depth + 1, spawn);
+}
+
+static void build_bvh_task(void *arg, int task) {
+    BVHBuildJob *job = (BVHBuildJob *)arg;
+    ModelBVHNode *nodes = NULL;
+    int numNodes = 0, capacity = 0;
+    push_bvh_nodes(&nodes, &numNodes, &capacity, 1);
+    build_bvh_node(job, &nodes, &numNodes, &capacity, 0, job->taskFirst[task], job->taskCount[task], job->taskDepth[task], false);
+    job->taskNodes[task] = nodes;
+    job->taskNumNodes[task] = numNodes;
+}
+
+static void triangle_bounds_chunk(void *arg, int chunk) {
+    BVHBuildJob *job = (BVHBuildJob *)arg;
+    Model *m = job->m;
+    int end = (chunk + 1) * NORMAL_CHUNK < m->numIndices / 3 ? (chunk + 1) * NORMAL_CHUNK : m->numIndices / 3;
+    for(int t = chunk * NORMAL_CHUNK; t < end; t++) {
+        Vector3 a = m->vertexArray[m->indexArray[t * 3]];
+        Vector3 b = m->vertexArray[m->indexArray[t * 3 + 1]];
+        Vector3 c = m->vertexArray[m->indexArray[t * 3 + 2]];
+        job->triMin[t] = min_v3(a, min_v3(b, c));
+        job->triMax[t] = max_v3(a, max_v3(b, c));
+        job->centroids[t] = SetV3((job->triMin[t].x + job->triMax[t].x) / 2, (job->triMin[t].y + job->triMax[t].y) / 2, (job->triMin[t].z + job->triMax[t].z) / 2);
+        job->order[t] = t;
+    }
+}
+
+// Rewrites the leaf packets and boxes from the current positions, children always follow their parent
+static void refit_model_bvh(Model *m) {
+    ModelBVH *bvh = m->bvh;
+    for(int p = 0; p < bvh->numPackets; p++) {
+        float *packet = bvh->packets + p * 36;
+        for(int k = 0; k < 4; k++) {
+            int t = bvh->triangles[p * 4 + k];
+            Vector3 a = SetV3(0, 0, 0), e1 = a, e2 = a; // padding never hits
+            if(t >= 0) {
+                a = m->vertexArray[m->indexArray[t * 3]];
+                e1 = SubV3(m->vertexArray[m->indexArray[t * 3 + 1]], a);
+                e2 = SubV3(m->vertexArray[m->indexArray[t * 3 + 2]], a);
+            }
+            packet[0 + k] = a.x;  packet[4 + k] = a.y;  packet[8 + k] = a.z;
+            packet[12 + k] = e1.x; packet[16 + k] = e1.y; packet[20 + k] = e1.z;
+            packet[24 + k] = e2.x; packet[28 + k] = e2.y; packet[32 + k] = e2.z;
+        }
+    }
+
+    for(int n = bvh->numNodes - 1; n >= 0; n--) {
+        ModelBVHNode *node = &bvh->nodes[n];
+        if(node->count == 0) {
+            node->min = min_v3(bvh->nodes[node->first].min, bvh->nodes[node->first + 1].min);
+            node->max = max_v3(bvh->nodes[node->first].max, bvh->nodes[node->first + 1].max);
+            continue;
+        }
+
+        for(int k = 0; k < node->count; k++) {
+            int t = bvh->triangles[node->first * 4 + k];
+            for(int c = 0; c < 3; c++) {
+                Vector3 v = m->vertexArray[m->indexArray[t * 3 + c]];
+                node->min = k || c ? min_v3(node->min, v) : v;
+                node->max = k || c ? max_v3(node->max, v) : v;
+            }
+        }
+    }
+
+    bvh->stale = 0;
+}
+
+static void dispose_model_bvh(Model *m) {
+    if(m->bvh) {
+        free(m->bvh->nodes);
+        free(m->bvh->packets);
+        free(m->bvh->triangles);
+        free(m->bvh);
+        m->bvh = NULL;
+    }
+}
+
+void glUtilitiesBuildModelBVH(Model *m) {
+    dispose_model_bvh(m);
+
+    int numTriangles = m->numIndices / 3;
+    if(!m->vertexArray || !m->indexArray || numTriangles == 0) {
+        return;
+    }
+
+    BVHBuildJob job = {0};
+    job.m = m;
+    job.triMin = (Vector3 *)malloc(sizeof(Vector3) * numTriangles);
+    job.triMax = (Vector3 *)malloc(sizeof(Vector3) * numTriangles);
+    job.centroids = (Vector3 *)malloc(sizeof(Vector3) * numTriangles);
+    job.order = (int *)malloc(sizeof(int) * numTriangles);
+    parallel_for(triangle_bounds_chunk, &job, (numTriangles + NORMAL_CHUNK - 1) / NORMAL_CHUNK);
+
+    // Top levels here, the subtrees below MODEL_BVH_TASK_SIZE triangles on the pool
+    ModelBVHNode *nodes = NULL;
+    int numNodes = 0, capacity = 0;
+    push_bvh_nodes(&nodes, &numNodes, &capacity, 1);
+    build_bvh_node(&job, &nodes, &numNodes, &capacity, 0, 0, numTriangles, 0, glUtilitiesGetWorkerThreads() > 0);
+
+    job.taskNodes = (ModelBVHNode **)malloc(sizeof(ModelBVHNode *) * (job.numTasks + 1));
+    job.taskNumNodes = (int *)malloc(sizeof(int) * (job.numTasks + 1));
+    parallel_for(build_bvh_task, &job, job.numTasks);
+
+    // Task roots go into their placeholder, the rest is appended with the child indices shifted
+    for(int t = 0; t < job.numTasks; t++) {
+        ModelBVHNode *local = job.taskNodes[t];
+        int base = push_bvh_nodes(&nodes, &numNodes, &capacity, job.taskNumNodes[t] - 1) - 1;
+        for(int i = 0; i < job.taskNumNodes[t]; i++) {
+            ModelBVHNode node = local[i];
+            if(node.count == 0) {
+                node.first += base;
+            }
+            nodes[i == 0 ? job.taskSlot[t] : base + i] = node;
+        }
+        free(local);
+    }
+
+    // One packet of 4 triangles per leaf
+    ModelBVH *bvh = (ModelBVH *)calloc(1, sizeof(ModelBVH));
+    for(int n = 0; n < numNodes; n++) {
+        bvh->numPackets += nodes[n].count > 0;
+    }
+    bvh->packets = (float *)malloc(sizeof(float) * 36 * bvh->numPackets);
+    bvh->triangles = (int *)malloc(sizeof(int) * 4 * bvh->numPackets);
+
+    int p = 0;
+    for(int n = 0; n < numNodes; n++) {
+        if(nodes[n].count > 0) {
+            for(int k = 0; k < 4; k++) {
+                bvh->triangles[p * 4 + k] = k < nodes[n].count ? job.order[nodes[n].first + k] : -1;
+            }
+            nodes[n].first = p++;
+        }
+    }
+
+    bvh->nodes = nodes;
+    bvh->numNodes = numNodes;
+    m->bvh = bvh;
+    refit_model_bvh(m);
+
+    free(job.triMin);
+    free(job.triMax);
+    free(job.centroids);
+    free(job.order);
+    free(job.taskFirst);
+    free(job.taskCount);
+    free(job.taskDepth);
+    free(job.taskSlot);
+    free(job.taskNodes);
+    free(job.taskNumNodes);
+}
+
+// Brings a stale BVH up to date, false when the model has none
+static bool update_model_bvh(Model *m) {
+    if(!m->bvh) {
+        return false;
+    }
+
+    if(m->bvh->stale & MODEL_INDICES) {
+        glUtilitiesBuildModelBVH(m);
+    }
+    else if(m->bvh->stale) {
+        refit_model_bvh(m);
+    }
+    return m->bvh != NULL;
+}
+
+// Moller-Trumbore against the 4 triangles of a packet, returns the lane of the nearest hit closer than *best
+static int ray_packet(float *packet, Vector3 o, Vector3 d, float *best) {
+    int lane = -1;
+#ifdef __SSE2__
+    __m128 ax = _mm_loadu_ps(packet), ay = _mm_loadu_ps(packet + 4), az = _mm_loadu_ps(packet + 8);
+    __m128 e1x = _mm_loadu_ps(packet + 12), e1y = _mm_loadu_ps(packet + 16), e1z = _mm_loadu_ps(packet + 20);
+    __m128 e2x = _mm_loadu_ps(packet + 24), e2y = _mm_loadu_ps(packet + 28), e2z = _mm_loadu_ps(packet + 32);
+    __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+
+    // p = d x e2, det = e1 . p
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 valid = _mm_cmpneq_ps(det, _mm_setzero_ps());
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1), det);
+
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(o.x), ax), sy = _mm_sub_ps(_mm_set1_ps(o.y), ay), sz = _mm_sub_ps(_mm_set1_ps(o.z), az);
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+    // q = s x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+    __m128 zero = _mm_setzero_ps();
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1)));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(*best)));
+
+    int mask = _mm_movemask_ps(valid);
+    if(mask) {
+        float ts[4];
+        _mm_storeu_ps(ts, t);
+        for(int k = 0; k < 4; k++) {
+            if((mask & (1 << k)) && ts[k] < *best) {
+                *best = ts[k];
+                lane = k;
+            }
+        }
+    }
+#else
+    for(int k = 0; k < 4; k++) {
+        Vector3 a = SetV3(packet[k], packet[4 + k], packet[8 + k]);
+        Vector3 e1 = SetV3(packet[12 + k], packet[16 + k], packet[20 + k]);
+        Vector3 e2 = SetV3(packet[24 + k], packet[28 + k], packet[32 + k]);
+        Vector3 p = Cross(d, e2);
+        float det = Dot(e1, p);
+        if(det == 0) {
+            continue;
+        }
+
+        float inv = 1 / det;
+        Vector3 s = SubV3(o, a);
+        float u = Dot(s, p) * inv;
+        Vector3 q = Cross(s, e1);
+        float v = Dot(d, q) * inv;
+        float t = Dot(e2, q) * inv;
+        if(u >= 0 && v >= 0 && u + v <= 1 && t >= 0 && t < *best) {
+            *best = t;
+            lane = k;
+        }
+    }
+#endif
+    return lane;
+}
+
+static Vector3 model_triangle_normal(Model *m, int t) {
+    Vector3 a = m->vertexArray[m->indexArray[t * 3]];
+    Vector3 n = Cross(SubV3(m->vertexArray[m->indexArray[t * 3 + 1]], a), SubV3(m->vertexArray[m->indexArray[t * 3 + 2]], a));
+    float length = Norm(n);
+    return length > 0 ? Scalar(n, 1 / length) : SetV3(0, 1, 0);
+}
+
+bool glUtilitiesModelRaycast(Model *m, Vector3 origin, Vector3 direction, float maxDistance, ModelHit *hit) {
+    if(!update_model_bvh(m)) {
+        return false;
+    }
+
+    ModelBVH *bvh = m->bvh;
+    Vector3 inverse = ray_inverse(direction);
+    float best = maxDistance;
+    int triangle = -1;
+
+    int stack[MODEL_BVH_STACK];
+    int top = 0;
+    if(ray_box(origin, inverse, bvh->nodes[0].min, bvh->nodes[0].max, best) < INFINITY) {
+        stack[top++] = 0;
+    }
+    while(top > 0) {
+        ModelBVHNode *node = &bvh->nodes[stack[--top]];
+        if(node->count > 0) {
+            int lane = ray_packet(bvh->packets + node->first * 36, origin, direction, &best);
+            if(lane >= 0) {
+                triangle = bvh->triangles[node->first * 4 + lane];
+            }
+            continue;
+        }
+
+        // Nearer child on top, the farther one is often culled by then
+        float ta = ray_box(origin, inverse, bvh->nodes[node->first].min, bvh->nodes[node->first].max, best);
+        float tb = ray_box(origin, inverse, bvh->nodes[node->first + 1].min, bvh->nodes[node->first + 1].max, best);
+        int nearChild = ta <= tb ? node->first : node->first + 1;
+        if(max_f(ta, tb) < INFINITY) {
+            stack[top++] = nearChild == node->first ? node->first + 1 : node->first;
+        }
+        if(min_f(ta, tb) < INFINITY) {
+            stack[top++] = nearChild;
+        }
+    }
+
+    if(triangle < 0) {
+        return false;
+    }
+
+    if(hit) {
+        hit->triangle = triangle;
+        hit->distance = best;
+        hit->position = AddV3(origin, Scalar(direction, best));
+        hit->normal = model_triangle_normal(m, triangle);
+        if(Dot(hit->normal, direction) > 0) {
+            hit->normal = Scalar(hit->normal, -1);
+        }
+    }
+    return true;
+}
+
+// Ericson's closest point on triangle abc to p
+static Vector3 closest_point_triangle(Vector3 p, Vector3 a, Vector3 b, Vector3 c) {
+    Vector3 ab = SubV3(b, a), ac = SubV3(c, a), ap = SubV3(p, a);
+    float d1 = Dot(ab, ap), d2 = Dot(ac, ap);
+    if(d1 <= 0 && d2 <= 0) return a;
+
+    Vector3 bp = SubV3(p, b);
+    float d3 = Dot(ab, bp), d4 = Dot(ac, bp);
+    if(d3 >= 0 && d4 <= d3) return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if(vc <= 0 && d1 >= 0 && d3 <= 0) return AddV3(a, Scalar(ab, d1 / (d1 - d3)));
+
+    Vector3 cp = SubV3(p, c);
+    float d5 = Dot(ab, cp), d6 = Dot(ac, cp);
+    if(d6 >= 0 && d5 <= d6) return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if(vb <= 0 && d2 >= 0 && d6 <= 0) return AddV3(a, Scalar(ac, d2 / (d2 - d6)));
+
+    float va = d3 * d6 - d5 * d4;
+    if(va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+        return AddV3(b, Scalar(SubV3(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6))));
+    }
+
+    float denom = 1 / (va + vb + vc);
+    return AddV3(a, AddV3(Scalar(ab, vb * denom), Scalar(ac, vc * denom)));
+}
+
+// Lanes whose triangle plane is within radius of the center
+static int sphere_packet_mask(float *packet, Vector3 c, float radius) {
+#ifdef __SSE2__
+    __m128 e1x = _mm_loadu_ps(packet + 12), e1y = _mm_loadu_ps(packet + 16), e1z = _mm_loadu_ps(packet + 20);
+    __m128 e2x = _mm_loadu_ps(packet + 24), e2y = _mm_loadu_ps(packet + 28), e2z = _mm_loadu_ps(packet + 32);
+    __m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+    __m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(c.x), _mm_loadu_ps(packet));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(c.y), _mm_loadu_ps(packet + 4));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(c.z), _mm_loadu_ps(packet + 8));
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, sx), _mm_mul_ps(ny, sy)), _mm_mul_ps(nz, sz));
+    __m128 nn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+    return _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(d, d), _mm_mul_ps(nn, _mm_set1_ps(radius * radius))));
+#else
+    int mask = 0;
+    for(int k = 0; k < 4; k++) {
+        Vector3 n = Cross(SetV3(packet[12 + k], packet[16 + k], packet[20 + k]), SetV3(packet[24 + k], packet[28 + k], packet[32 + k]));
+        float d = Dot(n, SubV3(c, SetV3(packet[k], packet[4 + k], packet[8 + k])));
+        mask |= (d * d <= Dot(n, n) * radius * radius) << k;
+    }
+    return mask;
+#endif
+}
+
+int glUtilitiesModelSphereQuery(Model *m, Vector3 center, float radius, ModelHit *hits, int maxHits) {
+    if(!update_model_bvh(m)) {
+        return 0;
+    }
+
+    ModelBVH *bvh = m->bvh;
+    int stack[MODEL_BVH_STACK];
+    int top = 0, found = 0;
+    stack[top++] = 0;
+    while(top > 0) {
+        ModelBVHNode *node = &bvh->nodes[stack[--top]];
+        if(box_distance_squared(node->min, node->max, center) > radius * radius) {
+            continue;
+        }
+
+        if(node->count == 0) {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+            continue;
+        }
+
+        int mask = sphere_packet_mask(bvh->packets + node->first * 36, center, radius);
+        for(int k = 0; k < node->count; k++) {
+            if(!(mask & (1 << k))) {
+                continue;
+            }
+
+            int t = bvh->triangles[node->first * 4 + k];
+            Vector3 p = closest_point_triangle(center, m->vertexArray[m->indexArray[t * 3]], m->vertexArray[m->indexArray[t * 3 + 1]], m->vertexArray[m->indexArray[t * 3 + 2]]);
+            Vector3 d = SubV3(center, p);
+            float distance = Norm(d);
+            if(distance > radius) {
+                continue;
+            }
+
+            if(found < maxHits) {
+                hits[found].triangle = t;
+                hits[found].position = p;
+                hits[found].distance = distance;
+                hits[found].normal = distance > 0 ? Scalar(d, 1 / distance) : model_triangle_normal(m, t);
+            }
+            found++;
+        }
+    }
+
+    return found;
+}
+
+static void report_loader_error(const char *caller, const char *n) {
+	static unsigned int err_count = 0;
+    if(err_count < MAX_ERRORS) {
+		fprintf(stderr, "%s warning: '%s' not found in shader!\n", caller, n);
+        err_count++;
+    }
+    else if(err_count == MAX_ERRORS) {
+	    fprintf(stderr, "%s: Nr of errors bigger than %i. No more will be printed.\n", caller, MAX_ERRORS);
+        err_count++;
+    }
+}
+
+// Sets up the attributes of the bound VAO, only done once per cached binding
+static void configure_model_attributes(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar, const char *caller) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
+
+    char interleaved = (m->vertexFormat & VERTEX_INTERLEAVED) != 0;
+
+	glBindBuffer(GL_ARRAY_BUFFER, m->vb);
+	GLint loc = glGetAttribLocation(program, vertexVar);
+	if(loc >= 0) {
+        if(m->vertexFormat & COMPRESS_POSITION_SNORM16) {
+            glVertexAttribPointer(loc, 3, GL_SHORT, GL_TRUE, attribute_stride(m, position_stride(m)), 0);
+        }
+        else if(m->vertexFormat & COMPRESS_POSITION_HALF) {
+            glVertexAttribPointer(loc, 3, GL_HALF_FLOAT, GL_FALSE, attribute_stride(m, position_stride(m)), 0);
+        }
+        else {
+		    glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, attribute_stride(m, 0), 0); 
+        }
+		glEnableVertexAttribArray(loc);
+    }
+    else {
+        report_loader_error(caller, vertexVar);
+    }
+
+	if(normalVar && (m->normalArray || !interleaved)) {
+		loc = glGetAttribLocation(program, normalVar);
+	    if(loc >= 0) {
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved ? m->vb : m->nb);
+            const void *offset = (const void *)(size_t)normal_offset(m);
+            if(m->vertexFormat & COMPRESS_NORMAL_OCT16) {
+                glVertexAttribPointer(loc, 2, GL_SHORT, GL_TRUE, attribute_stride(m, normal_stride(m)), offset);
+            }
+            else if(m->vertexFormat & COMPRESS_NORMAL_1010102) {
+                glVertexAttribPointer(loc, 4, GL_INT_2_10_10_10_REV, GL_TRUE, attribute_stride(m, normal_stride(m)), offset);
+            }
+            else {
+			    glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, attribute_stride(m, 0), offset);
+            }
+			glEnableVertexAttribArray(loc);
+        }
+        else {
+            report_loader_error(caller, normalVar);
+        }
+    }
+
+	if(m->texCoordArray && textureVar) {
+		loc = glGetAttribLocation(program, textureVar);
+		if(loc >= 0) {
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved ? m->vb : m->tb);
+            const void *offset = (const void *)(size_t)texcoord_offset(m);
+            if(m->vertexFormat & COMPRESS_TEXCOORD_HALF) {
+                glVertexAttribPointer(loc, 2, GL_HALF_FLOAT, GL_FALSE, attribute_stride(m, texcoord_stride(m)), offset);
+            }
+            else {
+			    glVertexAttribPointer(loc, 2, GL_FLOAT, GL_FALSE, attribute_stride(m, 0), offset);
+            }
+			glEnableVertexAttribArray(loc);
+        }
+        else {
+            report_loader_error(caller, textureVar);
+        }
+    }
+}
+
+// VAO configured for the model and program, created on first use. Arena models share
+// theirs through the arena, keyed by which attributes the model's vertices have.
+static GLuint model_binding(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar, const char *caller) {
+    ModelBinding **bindings = m->arena ? &m->arena->bindings : &m->bindings;
+    int *numBindings = m->arena ? &m->arena->numBindings : &m->numBindings;
+    int layout = (m->normalArray ? 1 : 0) | (m->texCoordArray ? 2 : 0);
+
+    for(int i = 0; i < *numBindings; i++) {
+        ModelBinding *b = &(*bindings)[i];
+        if(b->program == program && b->layout == layout && same_name(b->vertexVar, vertexVar) && same_name(b->normalVar, normalVar) && same_name(b->textureVar, textureVar)) {
+            return b->vao;
+        }
+    }
+
+    *bindings = (ModelBinding *)realloc(*bindings, sizeof(ModelBinding) * (*numBindings + 1));
+    ModelBinding *b = &(*bindings)[(*numBindings)++];
+    b->program = program;
+    b->layout = layout;
+    b->vertexVar = copy_name(vertexVar);
+    b->normalVar = copy_name(normalVar);
+    b->textureVar = copy_name(textureVar);
+
+    glGenVertexArrays(1, &b->vao);
+    glBindVertexArray(b->vao);
+    configure_model_attributes(m, program, vertexVar, normalVar, textureVar, caller);
+    return b->vao;
+}
+
+static void bind_model_attributes(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar, const char *caller) {
+    glUseProgram(program);
+    glBindVertexArray(model_binding(m, program, vertexVar, normalVar, textureVar, caller));
+}
+
+// offset in bytes into the bound element buffer, arena models add their base vertex
+static void draw_model_elements(Model *m, GLenum mode, GLsizei count, GLintptr offset) {
+    if(m->arena) {
+        glDrawElementsBaseVertex(mode, count, m->indexType, (const void *)offset, m->baseVertex);
+    }
+    else {
+        glDrawElements(mode, count, m->indexType, (const void *)offset);
+    }
+}
+
+void glUtilitiesDrawModel(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
+    if(m) {
+        bind_model_attributes(m, program, vertexVar, normalVar, textureVar, "glUtilitiesDrawModel");
+		draw_model_elements(m, GL_TRIANGLES, m->numIndices, m->indexOffset);
+    }
+}
+
+// Unique undirected edges of the triangles as GL_LINES pairs, through an open addressing set
+static void build_edges(Model *m) {
+    int capacity = 16;
+    while(capacity < m->numIndices * 2) {
+        capacity *= 2;
+    }
+
+    unsigned long long *set = (unsigned long long *)malloc(sizeof(unsigned long long) * capacity);
+    memset(set, 0xff, sizeof(unsigned long long) * capacity);
+    GLuint *edges = (GLuint *)malloc(sizeof(GLuint) * (m->numIndices * 2 + 1));
+    int count = 0;
+
+    for(int i = 0; i + 2 < m->numIndices; i += 3) {
+        for(int k = 0; k < 3; k++) {
+            GLuint a = m->indexArray[i + k], b = m->indexArray[i + (k + 1) % 3];
+            if(a == b) {
+                continue;
+            }
+
+            unsigned long long key = a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a;
+            unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+            while(set[slot] != ~0ull && set[slot] != key) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            if(set[slot] != key) {
+                set[slot] = key;
+                edges[count++] = a;
+                edges[count++] = b;
+            }
+        }
+    }
+
+    glGenBuffers(1, &m->edgeIb);
+    glBindVertexArray(0); // keep m->ib as the VAO's element buffer
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->edgeIb);
+    upload_index_data(m, edges, count);
+    m->numEdgeIndices = count;
+
+    free(set);
+    free(edges);
+}
+
+void glUtilitiesDrawWireframe(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
+	if(m) {
+        if(!m->edgeIb) {
+            build_edges(m);
+        }
+
+        bind_model_attributes(m, program, vertexVar, normalVar, textureVar, "glUtilitiesDrawWireframe");
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->edgeIb);
+		draw_model_elements(m, GL_LINES, m->numEdgeIndices, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
+    }
+}
+
+void glUtilitiesDrawModelLOD(Model *m, Matrix4 projection, Matrix4 modelView, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
+    if(m) {
+        int level = glUtilitiesSelectLOD(m, projection, modelView);
+        if(level == 0) {
+            glUtilitiesDrawModel(m, program, vertexVar, normalVar, textureVar);
+            return;
+        }
+
+        bind_model_attributes(m, program, vertexVar, normalVar, textureVar, "glUtilitiesDrawModelLOD");
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->lods[level - 1].ib);
+		draw_model_elements(m, GL_TRIANGLES, m->lods[level - 1].numIndices, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
+    }
+}
+
+void glUtilitiesDrawModelClusters(Model *m, Matrix4 projection, Matrix4 modelView, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar) {
+    if(m) {
+        if(m->numClusters == 0) {
+            glUtilitiesDrawModel(m, program, vertexVar, normalVar, textureVar);
+            return;
+        }
+
+        static char *visible = NULL;
+        static GLsizei *counts = NULL;
+        static const void **offsets = NULL;
+        static GLint *baseVertices = NULL;
+        static int capacity = 0;
+        if(capacity < m->numClusters) {
+            capacity = m->numClusters;
+            visible = (char *)realloc(visible, capacity);
+            counts = (GLsizei *)realloc(counts, sizeof(GLsizei) * capacity);
+            offsets = (const void **)realloc((void *)offsets, sizeof(void *) * capacity);
+            baseVertices = (GLint *)realloc(baseVertices, sizeof(GLint) * capacity);
+        }
+
+        if(glUtilitiesCullClusters(m, projection, modelView, visible) == 0) {
+            return;
+        }
+
+        // Neighbouring survivors are contiguous in the index buffer, merge them into one range
+        int ranges = 0;
+        for(int i = 0; i < m->numClusters; i++) {
+            if(!visible[i]) {
+                continue;
+            }
+
+            if(ranges > 0 && i > 0 && visible[i - 1]) {
+                counts[ranges - 1] += m->clusters[i].numIndices;
+            }
+            else {
+                counts[ranges] = m->clusters[i].numIndices;
+                offsets[ranges] = (const void *)(size_t)(m->indexOffset + m->clusters[i].indexOffset * index_size(m));
+                baseVertices[ranges] = m->baseVertex;
+                ranges++;
+            }
+        }
+
+        bind_model_attributes(m, program, vertexVar, normalVar, textureVar, "glUtilitiesDrawModelClusters");
+        if(m->arena) {
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts, m->indexType, offsets, ranges, baseVertices);
+        }
+        else {
+            glMultiDrawElements(GL_TRIANGLES, counts, m->indexType, offsets, ranges);
+        }
+    }
+}
+
+static StreamBuffer *INSTANCE_STREAM = NULL; // instance data and indirect commands
+
+static void *map_instance_range(GLsizeiptr size, GLintptr *offset) {
+    if(!INSTANCE_STREAM) {
+        INSTANCE_STREAM = glUtilitiesCreateStreamBuffer(1 << 22);
+    }
+    return glUtilitiesStreamAlloc(INSTANCE_STREAM, size, 256, offset);
+}
+
+// mat4 attributes are read column by column, Matrix4 is row-major
+static void write_instance_transform(GLfloat *dst, Matrix4 t) {
+    for(int r = 0; r < 4; r++) {
+        for(int c = 0; c < 4; c++) {
+            dst[c * 4 + r] = t.m[r * 4 + c];
+        }
+    }
+}
+
+static GLint transform_location(GLuint program, const char *transformVar, const char *caller) {
+    GLint loc = glGetAttribLocation(program, transformVar);
+    if(loc < 0) {
+        report_loader_error(caller, transformVar);
+    }
+    return loc;
+}
+
+// Points the bound VAO's mat4 instance attribute at offset in the instance buffer
+static void bind_instance_transforms(GLint loc, GLintptr offset) {
+    if(loc >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, INSTANCE_STREAM->buffer);
+        for(int i = 0; i < 4; i++) {
+            glVertexAttribPointer(loc + i, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 16, (const void *)(offset + sizeof(GLfloat) * 4 * i));
+            glVertexAttribDivisor(loc + i, 1);
+            glEnableVertexAttribArray(loc + i);
+        }
+    }
+}
+
+// Instance arrays live on VAOs shared with plain draws of the model, they are turned off again after use
+static void reset_instance_attribute(GLint loc, int columns) {
+    for(int i = 0; i < columns && loc >= 0; i++) {
+        glVertexAttribDivisor(loc + i, 0);
+        glDisableVertexAttribArray(loc + i);
+    }
+}
+
+void glUtilitiesDrawModelInstanced(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar, const char *transformVar, Matrix4 *transforms, const char *colorVar, Vector3 *colors, int count) {
+    if(!m || count <= 0) {
+        return;
+    }
+
+    bind_model_attributes(m, program, vertexVar, normalVar, textureVar, "glUtilitiesDrawModelInstanced");
+
+    GLsizeiptr matrixBytes = sizeof(GLfloat) * 16 * count;
+    GLsizeiptr size = matrixBytes + (colors ? sizeof(Vector3) * count : 0);
+    GLintptr offset;
+    GLfloat *data = (GLfloat *)map_instance_range(size, &offset);
+    if(!data) {
+        return;
+    }
+
+    for(int i = 0; i < count; i++) {
+        write_instance_transform(data + i * 16, transforms[i]);
+    }
+    if(colors) {
+        memcpy((char *)data + matrixBytes, colors, sizeof(Vector3) * count);
+    }
+    glUtilitiesStreamCommit(INSTANCE_STREAM);
+
+    GLint transformLoc = transform_location(program, transformVar, "glUtilitiesDrawModelInstanced"), colorLoc = -1;
+    bind_instance_transforms(transformLoc, offset);
+
+    if(colors && colorVar) {
+        GLint loc = colorLoc = glGetAttribLocation(program, colorVar);
+        if(loc >= 0) {
+            glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, (const void *)(offset + matrixBytes));
+            glVertexAttribDivisor(loc, 1);
+            glEnableVertexAttribArray(loc);
+        }
+        else {
+            report_loader_error("glUtilitiesDrawModelInstanced", colorVar);
+        }
+    }
+
+    if(m->arena) {
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, m->numIndices, m->indexType, (const void *)m->indexOffset, count, m->baseVertex);
+    }
+    else {
+        glDrawElementsInstanced(GL_TRIANGLES, m->numIndices, m->indexType, (const void *)m->indexOffset, count);
+    }
+
+    reset_instance_attribute(transformLoc, 4);
+    reset_instance_attribute(colorLoc, 1);
+}
+
+typedef struct QueuePacket {
+    Model *m;
+    GLuint program, texture, vao;
+    GLenum target;
+    char transparent;
+    Matrix4 transform;
+    GLfloat region[5]; // texcoord offset, scale and layer
+} QueuePacket;
+
+typedef struct DrawElementsIndirectCommand {
+    GLuint count, instanceCount, firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+} DrawElementsIndirectCommand;
+
+static QueuePacket *QUEUE = NULL;
+static GLuint64 *QUEUE_KEYS = NULL;
+static int QUEUE_COUNT = 0;
+static int QUEUE_SIZE = 0;
+
+static Matrix4 QUEUE_VIEW;
+static char *QUEUE_VERTEX_VAR = NULL, *QUEUE_NORMAL_VAR = NULL, *QUEUE_TEXTURE_VAR = NULL, *QUEUE_TRANSFORM_VAR = NULL;
+static char *QUEUE_REGION_VAR = NULL, *QUEUE_LAYER_VAR = NULL;
+
+static int MULTI_DRAW_INDIRECT = -1; // checked at the first flush
+
+void glUtilitiesSetQueueRegionVars(const char *regionVar, const char *layerVar) {
+    free(QUEUE_REGION_VAR);
+    free(QUEUE_LAYER_VAR);
+    QUEUE_REGION_VAR = copy_name(regionVar);
+    QUEUE_LAYER_VAR = copy_name(layerVar);
+}
+
+// Per instance texture region attributes after the transforms, vec4 offset/scale and a float layer
+static void bind_instance_regions(GLint regionLoc, GLint layerLoc, GLintptr offset) {
+    glBindBuffer(GL_ARRAY_BUFFER, INSTANCE_STREAM->buffer);
+    if(regionLoc >= 0) {
+        glVertexAttribPointer(regionLoc, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 5, (const void *)offset);
+        glVertexAttribDivisor(regionLoc, 1);
+        glEnableVertexAttribArray(regionLoc);
+    }
+    if(layerLoc >= 0) {
+        glVertexAttribPointer(layerLoc, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 5, (const void *)(offset + sizeof(GLfloat) * 4));
+        glVertexAttribDivisor(layerLoc, 1);
+        glEnableVertexAttribArray(layerLoc);
+    }
+}
+
+void glUtilitiesBeginQueue(Matrix4 worldToView, const char* vertexVar, const char* normalVar, const char* textureVar, const char *transformVar) {
+    QUEUE_COUNT = 0;
+    QUEUE_VIEW = worldToView;
+
+    free(QUEUE_VERTEX_VAR);
+    free(QUEUE_NORMAL_VAR);
+    free(QUEUE_TEXTURE_VAR);
+    free(QUEUE_TRANSFORM_VAR);
+    QUEUE_VERTEX_VAR = copy_name(vertexVar);
+    QUEUE_NORMAL_VAR = copy_name(normalVar);
+    QUEUE_TEXTURE_VAR = copy_name(textureVar);
+    QUEUE_TRANSFORM_VAR = copy_name(transformVar);
+}
+
+// Positive floats compare like their bits, the top 24 are plenty for ordering
+static GLuint64 depth_bits(float depth) {
+    GLuint bits;
+    depth = depth > 0 ? depth : 0;
+    memcpy(&bits, &depth, sizeof(bits));
+    return bits >> 7;
+}
+
+// pass | transparent | opaque: program, texture, vao, front to back depth
+//                      transparent: back to front depth, program, texture, vao
+static GLuint64 queue_key(int pass, QueuePacket *p, float depth) {
+    GLuint64 key = (GLuint64)(pass & 15) << 60;
+    GLuint64 d = depth_bits(depth);
+    if(p->transparent) {
+        key |= (GLuint64)1 << 59 | (0xffffff - d) << 35 | (GLuint64)(p->program & 0xfff) << 23 | (GLuint64)(p->texture & 0xfff) << 11 | (p->vao & 0x7ff);
+    }
+    else {
+        key |= (GLuint64)(p->program & 0xfff) << 47 | (GLuint64)(p->texture & 0xfff) << 35 | (GLuint64)(p->vao & 0x7ff) << 24 | d;
+    }
+    return key;
+}
+
+static void queue_packet(Model *m, GLuint program, GLuint texture, GLenum target, GLfloat *region, Matrix4 transform, int pass) {
+    if(!m) {
+        return;
+    }
+
+    if(QUEUE_COUNT == QUEUE_SIZE) {
+        QUEUE_SIZE = QUEUE_SIZE ? QUEUE_SIZE * 2 : 256;
+        QUEUE = (QueuePacket *)realloc(QUEUE, sizeof(QueuePacket) * QUEUE_SIZE);
+        QUEUE_KEYS = (GLuint64 *)realloc(QUEUE_KEYS, sizeof(GLuint64) * QUEUE_SIZE);
+    }
+
+    QueuePacket *p = &QUEUE[QUEUE_COUNT];
+    p->m = m;
+    p->program = program;
+    p->texture = texture;
+    p->target = target;
+    p->vao = model_binding(m, program, QUEUE_VERTEX_VAR, QUEUE_NORMAL_VAR, QUEUE_TEXTURE_VAR, "glUtilitiesQueueModel");
+    p->transparent = m->material && (m->material->Tr > 0.0f || m->material->d < 1.0f);
+    p->transform = transform;
+    memcpy(p->region, region, sizeof(p->region));
+
+    float depth = -transform_point(QUEUE_VIEW, transform_point(transform, m->boundsCenter)).z;
+
+    QUEUE_KEYS[QUEUE_COUNT] = queue_key(pass, p, depth);
+    QUEUE_COUNT++;
+}
+
+void glUtilitiesQueueModel(Model *m, GLuint program, GLuint texture, Matrix4 transform, int pass) {
+    GLfloat region[5] = {0, 0, 1, 1, 0};
+    queue_packet(m, program, texture, GL_TEXTURE_2D, region, transform, pass);
+}
+
+void glUtilitiesQueueModelRegion(Model *m, GLuint program, TextureRegion *region, Matrix4 transform, int pass) {
+    GLfloat r[5] = {region->u0, region->v0, region->u1 - region->u0, region->v1 - region->v0, (GLfloat)region->layer};
+    queue_packet(m, program, region->texID, region->target, r, transform, pass);
+}
+
+// LSD radix sort of keys with their packet indices, bytes all keys share are skipped
+static int *radix_sort_queue(int count) {
+    static GLuint64 *keys[2] = { NULL, NULL };
+    static int *order[2] = { NULL, NULL };
+    static int capacity = 0;
+    if(capacity < count) {
+        capacity = count;
+        for(int i = 0; i < 2; i++) {
+            keys[i] = (GLuint64 *)realloc(keys[i], sizeof(GLuint64) * capacity);
+            order[i] = (int *)realloc(order[i], sizeof(int) * capacity);
+        }
+    }
+
+    memcpy(keys[0], QUEUE_KEYS, sizeof(GLuint64) * count);
+    for(int i = 0; i < count; i++) {
+        order[0][i] = i;
+    }
+
+    int src = 0;
+    for(int shift = 0; shift < 64; shift += 8) {
+        int histogram[256] = {0};
+        for(int i = 0; i < count; i++) {
+            histogram[(keys[src][i] >> shift) & 0xff]++;
+        }
+        if(histogram[(keys[src][0] >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        int sum = 0;
+        for(int b = 0; b < 256; b++) {
+            int n = histogram[b];
+            histogram[b] = sum;
+            sum += n;
+        }
+
+        for(int i = 0; i < count; i++) {
+            int dst = histogram[(keys[src][i] >> shift) & 0xff]++;
+            keys[1 - src][dst] = keys[src][i];
+            order[1 - src][dst] = order[src][i];
+        }
+        src = 1 - src;
+    }
+
+    return order[src];
+}
+
+static bool same_run(QueuePacket *a, QueuePacket *b) {
+    return a->program == b->program && a->texture == b->texture && a->vao == b->vao && a->transparent == b->transparent && a->m->indexType == b->m->indexType;
+}
+
+void glUtilitiesFlushQueue() {
+    if(QUEUE_COUNT == 0) {
+        return;
+    }
+
+    if(MULTI_DRAW_INDIRECT < 0) {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        MULTI_DRAW_INDIRECT = major > 4 || (major == 4 && minor >= 3);
+    }
+
+    int *order = radix_sort_queue(QUEUE_COUNT);
+
+    // Transforms in draw order, the i:th sorted packet is instance i of the block, regions and
+    // indirect commands follow. One allocation, a second one could wrap over the first.
+    bool regions = QUEUE_REGION_VAR || QUEUE_LAYER_VAR;
+    GLsizeiptr dataBytes = sizeof(GLfloat) * (regions ? 21 : 16) * QUEUE_COUNT;
+    GLsizeiptr commandStart = (dataBytes + 15) / 16 * 16;
+    GLsizeiptr commandBytes = MULTI_DRAW_INDIRECT ? sizeof(DrawElementsIndirectCommand) * QUEUE_COUNT : 0;
+    GLintptr offset, regionOffset = 0, commandOffset = 0;
+    GLfloat *data = (GLfloat *)map_instance_range(commandStart + commandBytes, &offset);
+    if(!data) {
+        return;
+    }
+    for(int i = 0; i < QUEUE_COUNT; i++) {
+        write_instance_transform(data + i * 16, QUEUE[order[i]].transform);
+    }
+    if(regions) {
+        regionOffset = offset + sizeof(GLfloat) * 16 * QUEUE_COUNT;
+        for(int i = 0; i < QUEUE_COUNT; i++) {
+            memcpy(data + QUEUE_COUNT * 16 + i * 5, QUEUE[order[i]].region, sizeof(GLfloat) * 5);
+        }
+    }
+
+    if(MULTI_DRAW_INDIRECT) {
+        DrawElementsIndirectCommand *commands = (DrawElementsIndirectCommand *)((char *)data + commandStart);
+        commandOffset = offset + commandStart;
+        for(int i = 0; i < QUEUE_COUNT; i++) {
+            Model *m = QUEUE[order[i]].m;
+            commands[i].count = m->numIndices;
+            commands[i].instanceCount = 1;
+            commands[i].firstIndex = (GLuint)(m->indexOffset / index_size(m));
+            commands[i].baseVertex = m->baseVertex;
+            commands[i].baseInstance = i;
+        }
+    }
+    glUtilitiesStreamCommit(INSTANCE_STREAM);
+    if(MULTI_DRAW_INDIRECT) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, INSTANCE_STREAM->buffer);
+    }
+
+    GLuint program = 0, texture = 0, vao = 0;
+    GLint transformLoc = -1, regionLoc = -1, layerLoc = -1;
+    char blending = 0;
+    GLboolean blendWasEnabled = glIsEnabled(GL_BLEND), depthMask;
+    glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+
+    for(int start = 0, end; start < QUEUE_COUNT; start = end) {
+        QueuePacket *p = &QUEUE[order[start]];
+        for(end = start + 1; end < QUEUE_COUNT && same_run(p, &QUEUE[order[end]]); end++) {}
+
+        // Only what differs from the previous run is touched
+        if(p->transparent != blending) {
+            blending = p->transparent;
+            if(blending) {
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                glDepthMask(GL_FALSE);
+            }
+            else {
+                if(!blendWasEnabled) {
+                    glDisable(GL_BLEND);
+                }
+                glDepthMask(depthMask);
+            }
+        }
+        if((p->program != program || p->vao != vao) && vao) {
+            reset_instance_attribute(transformLoc, 4);
+            reset_instance_attribute(regionLoc, 1);
+            reset_instance_attribute(layerLoc, 1);
+            vao = 0;
+        }
+        if(p->program != program) {
+            program = p->program;
+            glUseProgram(program);
+            transformLoc = transform_location(program, QUEUE_TRANSFORM_VAR, "glUtilitiesFlushQueue");
+            regionLoc = QUEUE_REGION_VAR ? glGetAttribLocation(program, QUEUE_REGION_VAR) : -1;
+            layerLoc = QUEUE_LAYER_VAR ? glGetAttribLocation(program, QUEUE_LAYER_VAR) : -1;
+            vao = 0; // attribute locations differ per program
+        }
+        if(p->texture != texture) {
+            texture = p->texture;
+            glBindTexture(p->target, texture);
+        }
+        if(p->vao != vao) {
+            vao = p->vao;
+            glBindVertexArray(vao);
+            bind_instance_transforms(transformLoc, offset);
+            if(regions) {
+                bind_instance_regions(regionLoc, layerLoc, regionOffset);
+            }
+        }
+
+        if(MULTI_DRAW_INDIRECT) {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, p->m->indexType, (const void *)(commandOffset + sizeof(DrawElementsIndirectCommand) * start), end - start, 0);
+        }
+        else {
+            for(int i = start; i < end; i++) {
+                Model *m = QUEUE[order[i]].m;
+                bind_instance_transforms(transformLoc, offset + sizeof(GLfloat) * 16 * i);
+                if(regions) {
+                    bind_instance_regions(regionLoc, layerLoc, regionOffset + sizeof(GLfloat) * 5 * i);
+                }
+                glDrawElementsInstancedBaseVertex(GL_TRIANGLES, m->numIndices, m->indexType, (const void *)m->indexOffset, 1, m->baseVertex);
+            }
+        }
+    }
+
+    reset_instance_attribute(transformLoc, 4);
+    reset_instance_attribute(regionLoc, 1);
+    reset_instance_attribute(layerLoc, 1);
+
+    if(blending) {
+        if(!blendWasEnabled) {
+            glDisable(GL_BLEND);
+        }
+        glDepthMask(depthMask);
+    }
+    if(MULTI_DRAW_INDIRECT) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+
+    QUEUE_COUNT = 0;
+}
+
+void glUtilitiesReloadModelData(Model *m) {
+    dispose_bindings(&m->bindings, &m->numBindings); // formats and strides may change
+
+    if(m->arena) {
+        m->vertexFormat |= VERTEX_INTERLEAVED; // arenas only hold interleaved vertices
+    }
+    m->indexType = choose_index_type(m);
+    compute_bounds(m);
+    if(m->bvh) {
+        m->bvh->stale |= MODEL_INDICES; // the arrays may have been replaced
+    }
+    dispose_edges(m);
+    compute_decode_range(m);
+    memset(m->dirty, 0, sizeof(m->dirty));
+
+    glBindVertexArray(0);
+    upload_lods(m);
+
+    if(m->arena) {
+        arena_store_model(m);
+        return;
+    }
+
+	glBindVertexArray(m->vao);
+
+    if(m->vertexFormat & VERTEX_INTERLEAVED) {
+        void *packed = pack_interleaved(m, 0, m->numVertices);
+        glBindBuffer(GL_ARRAY_BUFFER, m->vb);
+        glBufferData(GL_ARRAY_BUFFER, m->numVertices * vertex_stride(m), packed, GL_STATIC_DRAW);
+        free(packed);
+
+        // Release the separate streams of a previous layout
+        glBindBuffer(GL_ARRAY_BUFFER, m->nb);
+        glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_STATIC_DRAW);
+        if(m->texCoordArray) {
+            glBindBuffer(GL_ARRAY_BUFFER, m->tb);
+            glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_STATIC_DRAW);
+        }
+
+        upload_model_indices(m);
+        return;
+    }
+	
+    void *packed = pack_positions(m, 0, m->numVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, m->vb);
+	glBufferData(GL_ARRAY_BUFFER, m->numVertices * position_stride(m), packed ? packed : (void *)m->vertexArray, GL_STATIC_DRAW);
+    free(packed);
+	
+    packed = pack_normals(m, 0, m->numVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, m->nb);
+	glBufferData(GL_ARRAY_BUFFER, m->numVertices * normal_stride(m), packed ? packed : (void *)m->normalArray, GL_STATIC_DRAW);
+    free(packed);
+    
+	if (m->texCoordArray) {
+        packed = pack_texcoords(m, 0, m->numVertices);
+		glBindBuffer(GL_ARRAY_BUFFER, m->tb);
+		glBufferData(GL_ARRAY_BUFFER, m->numVertices * texcoord_stride(m), packed ? packed : (void *)m->texCoordArray, GL_STATIC_DRAW);
+        free(packed);
+    }
+    
+    upload_model_indices(m);
+}
+
+// Positions outside the quantization range can't be patched in, the range has to be rebuilt
+static bool dirty_positions_fit(Model *m) {
+    if(!(m->vertexFormat & COMPRESS_POSITION_SNORM16)) {
+        return true;
+    }
+
+    ModelDirtySpans *d = &m->dirty[0];
+    for(int s = 0; s < d->numSpans; s++) {
+        for(int i = d->first[s]; i < d->first[s] + d->count[s]; i++) {
+            Vector3 p = m->vertexArray[i];
+            if(fabsf(p.x - m->decodeOffset.x) > m->decodeScale.x || fabsf(p.y - m->decodeOffset.y) > m->decodeScale.y || fabsf(p.z - m->decodeOffset.z) > m->decodeScale.z) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void upload_dirty_spans(Model *m, ModelDirtySpans *d, GLuint buffer, GLintptr base, int stride, void *(*pack)(Model *, int, int), const void *source) {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    for(int s = 0; s < d->numSpans; s++) {
+        void *packed = pack ? pack(m, d->first[s], d->count[s]) : NULL;
+        const char *data = packed ? (const char *)packed : (const char *)source + (size_t)d->first[s] * stride;
+        glBufferSubData(GL_COPY_WRITE_BUFFER, base + (GLintptr)d->first[s] * stride, (GLsizeiptr)d->count[s] * stride, data);
+        free(packed);
+    }
+}
+
+void glUtilitiesFlushModelData(Model *m) {
+    if(!m || !m->vao) {
+        return;
+    }
+
+    if(m->dirty[0].numSpans > 0 && !dirty_positions_fit(m)) {
+        glUtilitiesReloadModelData(m);
+        return;
+    }
+
+    for(int s = 0; s < m->dirty[0].numSpans; s++) {
+        expand_bounds(m, m->dirty[0].first[s], m->dirty[0].count[s]);
+    }
+
+    if(m->vertexFormat & VERTEX_INTERLEAVED) {
+        // Every attribute of a vertex shares the span, upload whole vertices
+        ModelDirtySpans vertices = m->dirty[0];
+        for(int i = 1; i < 3; i++) {
+            for(int s = 0; s < m->dirty[i].numSpans; s++) {
+                add_dirty_span(&vertices, m->dirty[i].first[s], m->dirty[i].count[s]);
+            }
+        }
+        upload_dirty_spans(m, &vertices, m->vb, (GLintptr)m->baseVertex * vertex_stride(m), vertex_stride(m), pack_interleaved, NULL);
+    }
+    else {
+        upload_dirty_spans(m, &m->dirty[0], m->vb, 0, position_stride(m), pack_positions, m->vertexArray);
+        if(m->normalArray) {
+            upload_dirty_spans(m, &m->dirty[1], m->nb, 0, normal_stride(m), pack_normals, m->normalArray);
+        }
+        if(m->texCoordArray) {
+            upload_dirty_spans(m, &m->dirty[2], m->tb, 0, texcoord_stride(m), pack_texcoords, m->texCoordArray);
+        }
+    }
+
+    ModelDirtySpans *d = &m->dirty[3];
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m->ib);
+    for(int s = 0; s < d->numSpans; s++) {
+        const GLuint *indices = m->indexArray + d->first[s];
+        const void *packed = pack_index_data(m, indices, d->count[s]);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, m->indexOffset + (GLintptr)d->first[s] * index_size(m), (GLsizeiptr)d->count[s] * index_size(m), packed);
+        if(packed != indices) {
+            free((void *)packed);
+        }
+    }
+
+    memset(m->dirty, 0, sizeof(m->dirty));
+}
+
+static void generate_model_buffers(Model *m) {
+    m->vertexFormat = VERTEX_COMPRESSION;
+
+    if(MESH_ARENA) {
+        m->vertexFormat |= VERTEX_INTERLEAVED;
+        m->arena = find_arena(m->vertexFormat, vertex_stride(m));
+        glUtilitiesReloadModelData(m);
+        return;
+    }
+
+    glGenVertexArrays(1, &m->vao);
+	glGenBuffers(1, &m->vb);
+	glGenBuffers(1, &m->ib);
+	glGenBuffers(1, &m->nb);
+    
+	if (m->texCoordArray) {
+		glGenBuffers(1, &m->tb);
+    }
+    
+    glUtilitiesReloadModelData(m);
+}
+
+Model* glUtilitiesLoadModel(const char* n) {
+	Mesh *mesh = load_obj(n);
+    to_triangles(mesh);
+
+    generate_normals(mesh);
+    
+    Model *model = generate_model(mesh);
+    dispose_mesh(mesh);
+
+    if(OPTIMIZE_MODELS) {
+        optimize_model(model, NULL, NULL);
+    }
+
+    generate_lods(model, LOD_LEVELS, 0.5f);
+
+    generate_model_buffers(model);
+    model->data = 0;
+
+    return model;
+}
+
+typedef struct ModelSetJob {
+    Mesh **meshes;
+    Model **models;
+} ModelSetJob;
+
+static void generate_model_part(void *arg, int i) {
+    ModelSetJob *job = (ModelSetJob *)arg;
+    to_triangles(job->meshes[i]);
+    generate_normals(job->meshes[i]);
+    job->models[i] = generate_model(job->meshes[i]);
+
+    if(OPTIMIZE_MODELS) {
+        optimize_model(job->models[i], NULL, NULL);
+    }
+
+    generate_lods(job->models[i], LOD_LEVELS, 0.5f);
+}
+
+Model** glUtilitiesLoadModelSet(const char* n) {
+	Mesh *mesh = load_obj(n);
+	Mesh **mm = split_to_meshes(mesh);
+
+    int i;
+	for (i = 0; mm[i] != NULL; i++) {} // for populating i
+	
+    Model **md = (Model **)calloc(sizeof(Model *), i + 1);
+
+    // Parts are independent, only GL calls and mesh disposal (touches MATERIAL_NAME_LIST) stay on this thread
+    ModelSetJob job = { mm, md };
+    parallel_for(generate_model_part, &job, i);
+
+    for(i = 0; mm[i] != NULL; i++) {
+        dispose_mesh(mm[i]);
+    }
+
+    free(mm);
+    dispose_material_list(MATERIALS);
+    dispose_mesh(mesh);
+    
+    MATERIAL_NAME_LIST = NULL;
+	MATERIALS = NULL;
+
+    for(i = 0; md[i] != NULL; i++) {
+        generate_model_buffers(md[i]);
+		md[i]->data = 0;
+    }
+
+    return md;
+}
+
+Model* glUtilitiesLoadModelData(Vector3 *vertices, Vector3 *normals, Vector2 *texCoords, Vector3 *colors, GLuint *indices, int numVertices, int numIndices) {
+	Model* m = (Model *)malloc(sizeof(Model));
+	memset(m, 0, sizeof(Model));
+    
+    m->vertexArray = vertices;
+	m->texCoordArray = texCoords;
+	m->normalArray = normals;
+	m->indexArray = indices;
+	m->numVertices = numVertices;
+	m->numIndices = numIndices;
+	m->data = 1;
+
+    generate_model_buffers(m);
+
+    return m;
+}
+
+void glUtilitiesDisposeModel(Model *m) {
+    if(m) {
+        if(m->data == 0) {
+		    if(m->vertexArray) {
+				free(m->vertexArray);
+            }
+
+            if(m->normalArray) {
+				free(m->normalArray);
+            }
+
+            if(m->texCoordArray) {
+				free(m->texCoordArray);
+            }
+
+            if(m->colorArray) {
+				free(m->colorArray);
+            }
+
+            if(m->indexArray) {
+				free(m->indexArray);
+            }
+        }
+
+        dispose_lods(m);
+        dispose_clusters(m);
+        dispose_model_bvh(m);
+        dispose_edges(m);
+
+        dispose_bindings(&m->bindings, &m->numBindings);
+        if(m->arena) {
+            arena_release_model(m);
+        }
+        else {
+            glDeleteBuffers(1, &m->vb);
+		    glDeleteBuffers(1, &m->ib);
+		    glDeleteBuffers(1, &m->nb);
+		    glDeleteBuffers(1, &m->tb);
+		    glDeleteVertexArrays(1, &m->vao);
+        }
+
+        if (m->material) {
+			free(m->material);
+        }
+    }
+    
+    free(m);
+}
+
+/*
+
+SCENE UTILITIES
+
+*/
+
+static int *SCENE_STACK = NULL; // traversal stack shared by the queries
+static int SCENE_STACK_SIZE = 0;
+
+static int *scene_stack(Scene *s) {
+    if(SCENE_STACK_SIZE < s->numNodes + 1) {
+        SCENE_STACK_SIZE = s->numNodes + 1;
+        SCENE_STACK = (int *)realloc(SCENE_STACK, sizeof(int) * SCENE_STACK_SIZE);
+    }
+
+    return SCENE_STACK;
+}
+
+static bool box_contains(Vector3 outerMin, Vector3 outerMax, Vector3 lo, Vector3 hi) {
+    return outerMin.x <= lo.x && outerMin.y <= lo.y && outerMin.z <= lo.z &&
+           outerMax.x >= hi.x && outerMax.y >= hi.y && outerMax.z >= hi.z;
+}
+
+static int allocate_scene_node(Scene *s) {
+    int n = s->freeNode;
+    if(n >= 0) {
+        s->freeNode = s->nodes[n].parent;
+    }
+    else {
+        if(s->numNodes == s->nodeCapacity) {
+            s->nodeCapacity = s->nodeCapacity ? s->nodeCapacity * 2 : 64;
+            s->nodes = (SceneNode *)realloc(s->nodes, sizeof(SceneNode) * s->nodeCapacity);
+        }
+        n = s->numNodes++;
+    }
+
+    s->nodes[n].parent = -1;
+    s->nodes[n].child[0] = s->nodes[n].child[1] = -1;
+    s->nodes[n].item = -1;
+    return n;
+}
+
+static void release_scene_node(Scene *s, int n) {
+    s->nodes[n].parent = s->freeNode;
+    s->freeNode = n;
+}
+
+static void refit_scene_ancestors(Scene *s, int n) {
+    while(n >= 0) {
+        SceneNode *node = &s->nodes[n];
+        node->min = min_v3(s->nodes[node->child[0]].min, s->nodes[node->child[1]].min);
+        node->max = max_v3(s->nodes[node->child[0]].max, s->nodes[node->child[1]].max);
+        n = node->parent;
+    }
+}
+
+// Picks the sibling with the least added surface area, descending while a child can still win
+static void insert_scene_leaf(Scene *s, int leaf) {
+    if(s->root < 0) {
+        s->root = leaf;
+        s->nodes[leaf].parent = -1;
+        return;
+    }
+
+    Vector3 lo = s->nodes[leaf].min, hi = s->nodes[leaf].max;
+    int n = s->root;
+    while(s->nodes[n].item < 0) {
+        SceneNode *node = &s->nodes[n];
+        float area = box_area(node->min, node->max);
+        float combined = box_area(min_v3(node->min, lo), max_v3(node->max, hi));
+
+        float cost = 2 * combined; // new parent for this node and the leaf
+        float inherited = 2 * (combined - area); // every level below grows at least this much
+
+        float childCost[2];
+        for(int c = 0; c < 2; c++) {
+            SceneNode *child = &s->nodes[node->child[c]];
+            float grown = box_area(min_v3(child->min, lo), max_v3(child->max, hi));
+            childCost[c] = child->item >= 0 ? grown + inherited : grown - box_area(child->min, child->max) + inherited;
+        }
+
+        if(cost < childCost[0] && cost < childCost[1]) {
+            break;
+        }
+        n = node->child[childCost[1] < childCost[0]];
+    }
+
+    int oldParent = s->nodes[n].parent;
+    int parent = allocate_scene_node(s);
+    s->nodes[parent].parent = oldParent;
+    s->nodes[parent].child[0] = n;
+    s->nodes[parent].child[1] = leaf;
+    s->nodes[n].parent = parent;
+    s->nodes[leaf].parent = parent;
+
+    if(oldParent < 0) {
+        s->root = parent;
+    }
+    else {
+        SceneNode *p = &s->nodes[oldParent];
+        p->child[p->child[1] == n] = parent;
+    }
+
+    refit_scene_ancestors(s, parent);
+}
+
+static void remove_scene_leaf(Scene *s, int leaf) {
+    if(leaf == s->root) {
+        s->root = -1;
+        return;
+    }
+
+    int parent = s->nodes[leaf].parent;
+    int grandParent = s->nodes[parent].parent;
+    int sibling = s->nodes[parent].child[s->nodes[parent].child[0] == leaf];
+
+    s->nodes[sibling].parent = grandParent;
+    if(grandParent < 0) {
+        s->root = sibling;
+    }
+    else {
+        SceneNode *g = &s->nodes[grandParent];
+        g->child[g->child[1] == parent] = sibling;
+        refit_scene_ancestors(s, grandParent);
+    }
+
+    release_scene_node(s, parent);
+}
+
+// Leaves are fattened so small movements stay inside and skip the reinsert
+static void set_scene_leaf_box(Scene *s, int leaf, SceneItem *item) {
+    Vector3 d = SubV3(item->max, item->min);
+    Vector3 margin = SetV3(d.x * SCENE_MARGIN, d.y * SCENE_MARGIN, d.z * SCENE_MARGIN);
+    s->nodes[leaf].min = SubV3(item->min, margin);
+    s->nodes[leaf].max = SetV3(item->max.x + margin.x, item->max.y + margin.y, item->max.z + margin.z);
+}
+
+Scene *glUtilitiesCreateScene() {
+    Scene *s = (Scene *)calloc(1, sizeof(Scene));
+    s->root = -1;
+    s->freeNode = -1;
+    return s;
+}
+
+int glUtilitiesSceneInsert(Scene *s, Model *m, Matrix4 transform) {
+    int h;
+    if(s->numFreeItems > 0) {
+        h = s->freeItems[--s->numFreeItems];
+    }
+    else {
+        if(s->numItems == s->itemCapacity) {
+            s->itemCapacity = s->itemCapacity ? s->itemCapacity * 2 : 64;
+            s->items = (SceneItem *)realloc(s->items, sizeof(SceneItem) * s->itemCapacity);
+            s->freeItems = (int *)realloc(s->freeItems, sizeof(int) * s->itemCapacity);
+        }
+        h = s->numItems++;
+    }
+
+    SceneItem *item = &s->items[h];
+    item->model = m;
+    item->transform = transform;
+    glUtilitiesModelWorldBounds(m, transform, &item->min, &item->max);
+
+    item->node = allocate_scene_node(s);
+    s->nodes[item->node].item = h;
+    set_scene_leaf_box(s, item->node, item);
+    insert_scene_leaf(s, item->node);
+
+    return h;
+}
+
+void glUtilitiesSceneRemove(Scene *s, int h) {
+    SceneItem *item = &s->items[h];
+    if(item->node < 0) {
+        return;
+    }
+
+    remove_scene_leaf(s, item->node);
+    release_scene_node(s, item->node);
+    item->node = -1;
+    item->model = NULL;
+    s->freeItems[s->numFreeItems++] = h;
+}
+
+void glUtilitiesSceneMove(Scene *s, int h, Matrix4 transform) {
+    SceneItem *item = &s->items[h];
+    if(item->node < 0) {
+        return;
+    }
+
+    item->transform = transform;
+    glUtilitiesModelWorldBounds(item->model, transform, &item->min, &item->max);
+
+    SceneNode *leaf = &s->nodes[item->node];
+    if(box_contains(leaf->min, leaf->max, item->min, item->max)) {
+        return;
+    }
+
+    remove_scene_leaf(s, item->node);
+    set_scene_leaf_box(s, item->node, item);
+    insert_scene_leaf(s, item->node);
+}
+
+void glUtilitiesRefitScene(Scene *s) {
+    if(s->root < 0) {
+        return;
+    }
+
+    // Preorder puts parents before children, walking it backwards refits bottom-up
+    int *order = (int *)malloc(sizeof(int) * s->numNodes);
+    int *stack = scene_stack(s);
+    int top = 0, count = 0;
+    stack[top++] = s->root;
+    while(top > 0) {
+        int n = stack[--top];
+        order[count++] = n;
+        if(s->nodes[n].item < 0) {
+            stack[top++] = s->nodes[n].child[0];
+            stack[top++] = s->nodes[n].child[1];
+        }
+    }
+
+    for(int i = count - 1; i >= 0; i--) {
+        SceneNode *node = &s->nodes[order[i]];
+        if(node->item >= 0) {
+            SceneItem *item = &s->items[node->item];
+            glUtilitiesModelWorldBounds(item->model, item->transform, &item->min, &item->max);
+            set_scene_leaf_box(s, order[i], item);
+        }
+        else {
+            node->min = min_v3(s->nodes[node->child[0]].min, s->nodes[node->child[1]].min);
+            node->max = max_v3(s->nodes[node->child[0]].max, s->nodes[node->child[1]].max);
+        }
+    }
+
+    free(order);
+}
+
+typedef struct SceneBin {
+    Vector3 min, max;
+    int count;
+} SceneBin;
+
+static int build_scene_range(Scene *s, int *handles, Vector3 *centroids, int count, int parent) {
+    int n = allocate_scene_node(s);
+    s->nodes[n].parent = parent;
+
+    if(count == 1) {
+        SceneItem *item = &s->items[handles[0]];
+        item->node = n;
+        s->nodes[n].item = handles[0];
+        set_scene_leaf_box(s, n, item);
+        return n;
+    }
+
+    Vector3 clo = centroids[handles[0]], chi = centroids[handles[0]];
+    for(int i = 1; i < count; i++) {
+        clo = min_v3(clo, centroids[handles[i]]);
+        chi = max_v3(chi, centroids[handles[i]]);
+    }
+
+    // Binned SAH over the widest centroid axis
+    Vector3 extent = SubV3(chi, clo);
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    float axisMin = ((float *)&clo)[axis], axisExtent = ((float *)&extent)[axis];
+
+    int split = count / 2;
+    if(axisExtent > 0) {
+        SceneBin bins[SCENE_SAH_BINS];
+        for(int b = 0; b < SCENE_SAH_BINS; b++) {
+            bins[b].count = 0;
+        }
+
+        float binScale = SCENE_SAH_BINS / axisExtent;
+        for(int i = 0; i < count; i++) {
+            int b = (int)((((float *)&centroids[handles[i]])[axis] - axisMin) * binScale);
+            b = b < SCENE_SAH_BINS ? b : SCENE_SAH_BINS - 1;
+            SceneItem *item = &s->items[handles[i]];
+            bins[b].min = bins[b].count ? min_v3(bins[b].min, item->min) : item->min;
+            bins[b].max = bins[b].count ? max_v3(bins[b].max, item->max) : item->max;
+            bins[b].count++;
+        }
+
+        // Sweep from the right for the suffix areas, then from the left picking the cheapest plane
+        float rightCost[SCENE_SAH_BINS];
+        Vector3 rlo = bins[SCENE_SAH_BINS - 1].min, rhi = bins[SCENE_SAH_BINS - 1].max;
+        int rightCount = 0;
+        for(int b = SCENE_SAH_BINS - 1; b > 0; b--) {
+            if(bins[b].count) {
+                rlo = rightCount ? min_v3(rlo, bins[b].min) : bins[b].min;
+                rhi = rightCount ? max_v3(rhi, bins[b].max) : bins[b].max;
+                rightCount += bins[b].count;
+            }
+            rightCost[b] = rightCount ? box_area(rlo, rhi) * rightCount : 0;
+        }
+
+        float bestCost = INFINITY;
+        int bestBin = -1, leftCount = 0;
+        Vector3 llo = bins[0].min, lhi = bins[0].max;
+        for(int b = 0; b < SCENE_SAH_BINS - 1; b++) {
+            if(bins[b].count) {
+                llo = leftCount ? min_v3(llo, bins[b].min) : bins[b].min;
+                lhi = leftCount ? max_v3(lhi, bins[b].max) : bins[b].max;
+                leftCount += bins[b].count;
+            }
+            if(leftCount == 0 || leftCount == count) {
+                continue;
+            }
+
+            float cost = box_area(llo, lhi) * leftCount + rightCost[b + 1];
+            if(cost < bestCost) {
+                bestCost = cost;
+                bestBin = b;
+            }
+        }
+
+        if(bestBin >= 0) {
+            int i = 0, j = count - 1;
+            while(i <= j) {
+                int b = (int)((((float *)&centroids[handles[i]])[axis] - axisMin) * binScale);
+                if((b < SCENE_SAH_BINS ? b : SCENE_SAH_BINS - 1) <= bestBin) {
+                    i++;
+                }
+                else {
+                    int t = handles[i]; handles[i] = handles[j]; handles[j--] = t;
+                }
+            }
+            split = i;
+        }
+    }
+
+    int left = build_scene_range(s, handles, centroids, split, n);
+    int right = build_scene_range(s, handles + split, centroids, count - split, n);
+    s->nodes[n].child[0] = left;
+    s->nodes[n].child[1] = right;
+    s->nodes[n].min = min_v3(s->nodes[left].min, s->nodes[right].min);
+    s->nodes[n].max = max_v3(s->nodes[left].max, s->nodes[right].max);
+    return n;
+}
+
+void glUtilitiesBuildScene(Scene *s) {
+    int *handles = (int *)malloc(sizeof(int) * (s->numItems + 1));
+    Vector3 *centroids = (Vector3 *)malloc(sizeof(Vector3) * (s->numItems + 1));
+
+    int count = 0;
+    for(int h = 0; h < s->numItems; h++) {
+        SceneItem *item = &s->items[h];
+        if(item->node < 0) {
+            continue;
+        }
+
+        glUtilitiesModelWorldBounds(item->model, item->transform, &item->min, &item->max);
+        centroids[h] = SetV3((item->min.x + item->max.x) / 2, (item->min.y + item->max.y) / 2, (item->min.z + item->max.z) / 2);
+        handles[count++] = h;
+    }
+
+    s->numNodes = 0;
+    s->freeNode = -1;
+    s->root = count ? build_scene_range(s, handles, centroids, count, -1) : -1;
+
+    free(handles);
+    free(centroids);
+}
+
+// -1 outside a plane, 1 inside all, 0 straddling
+static int classify_scene_box(float planes[6][4], Vector3 lo, Vector3 hi) {
+    Vector3 c = SetV3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+    Vector3 e = SetV3((hi.x - lo.x) / 2, (hi.y - lo.y) / 2, (hi.z - lo.z) / 2);
+    int inside = 1;
+    for(int p = 0; p < 6; p++) {
+        float d = planes[p][0] * c.x + planes[p][1] * c.y + planes[p][2] * c.z + planes[p][3];
+        float r = fabsf(planes[p][0]) * e.x + fabsf(planes[p][1]) * e.y + fabsf(planes[p][2]) * e.z;
+        if(d + r < 0) {
+            return -1;
+        }
+        if(d - r < 0) {
+            inside = 0;
+        }
+    }
+    return inside;
+}
+
+int glUtilitiesSceneQueryFrustum(Scene *s, Matrix4 viewProjection, int *handles, int maxHandles) {
+    if(s->root < 0) {
+        return 0;
+    }
+
+    float planes[6][4];
+    extract_frustum_planes(viewProjection, planes);
+
+    // Entries are node * 2 + 1 once an ancestor was fully inside, those skip the tests
+    int *stack = scene_stack(s);
+    int top = 0, found = 0;
+    stack[top++] = s->root * 2;
+    while(top > 0) {
+        int entry = stack[--top];
+        SceneNode *node = &s->nodes[entry >> 1];
+        int inside = entry & 1;
+
+        if(!inside) {
+            // Leaves are fat, test the item itself
+            inside = node->item >= 0 ? classify_scene_box(planes, s->items[node->item].min, s->items[node->item].max)
+                                     : classify_scene_box(planes, node->min, node->max);
+            if(inside < 0) {
+                continue;
+            }
+        }
+
+        if(node->item >= 0) {
+            if(found < maxHandles) {
+                handles[found] = node->item;
+            }
+            found++;
+        }
+        else {
+            stack[top++] = node->child[0] * 2 + inside;
+            stack[top++] = node->child[1] * 2 + inside;
+        }
+    }
+
+    return found;
+}
+
+int glUtilitiesSceneQuerySphere(Scene *s, Vector3 center, float radius, int *handles, int maxHandles) {
+    if(s->root < 0) {
+        return 0;
+    }
+
+    int *stack = scene_stack(s);
+    int top = 0, found = 0;
+    stack[top++] = s->root;
+    while(top > 0) {
+        SceneNode *node = &s->nodes[stack[--top]];
+        if(node->item >= 0) {
+            SceneItem *item = &s->items[node->item];
+            if(box_distance_squared(item->min, item->max, center) <= radius * radius) {
+                if(found < maxHandles) {
+                    handles[found] = node->item;
+                }
+                found++;
+            }
+        }
+        else if(box_distance_squared(node->min, node->max, center) <= radius * radius) {
+            stack[top++] = node->child[0];
+            stack[top++] = node->child[1];
+        }
+    }
+
+    return found;
+}
+
+int glUtilitiesSceneRaycast(Scene *s, Vector3 origin, Vector3 direction, float maxDistance, float *distance) {
+    if(s->root < 0) {
+        return -1;
+    }
+
+    Vector3 inverse = ray_inverse(direction);
+    float best = maxDistance;
+    int hit = -1;
+
+    int *stack = scene_stack(s);
+    int top = 0;
+    stack[top++] = s->root;
+    while(top > 0) {
+        SceneNode *node = &s->nodes[stack[--top]];
+        if(node->item >= 0) {
+            SceneItem *item = &s->items[node->item];
+            float t = ray_box(origin, inverse, item->min, item->max, best);
+            if(t == INFINITY || (hit >= 0 && t >= best)) {
+                continue;
+            }
+
+            // Models with a BVH are hit exactly, in model space t is unchanged
+            if(item->model->bvh) {
+                Matrix4 toModel = InvertM4(item->transform);
+                Vector3 o = transform_point(toModel, origin);
+                Vector3 d = SubV3(transform_point(toModel, AddV3(origin, direction)), o);
+                ModelHit modelHit;
+                if(!glUtilitiesModelRaycast(item->model, o, d, best, &modelHit)) {
+                    continue;
+                }
+                t = modelHit.distance;
+            }
+
+            best = t;
+            hit = node->item;
+            continue;
+        }
+
+        // Nearer child goes on top so it can shorten the ray for the other
+        SceneNode *a = &s->nodes[node->child[0]], *b = &s->nodes[node->child[1]];
+        float ta = ray_box(origin, inverse, a->min, a->max, best);
+        float tb = ray_box(origin, inverse, b->min, b->max, best);
+        if(ta < tb) {
+            if(tb < INFINITY) stack[top++] = node->child[1];
+            stack[top++] = node->child[0];
+        }
+        else {
+            if(ta < INFINITY) stack[top++] = node->child[0];
+            if(tb < INFINITY) stack[top++] = node->child[1];
+        }
+    }
+
+    if(hit >= 0 && distance) {
+        *distance = best;
+    }
+    return hit;
+}
+
+void glUtilitiesDisposeScene(Scene *s) {
+    free(s->nodes);
+    free(s->items);
+    free(s->freeItems);
+    free(s);
+}
+
+/*
+
+OCCLUSION UTILITIES
+
+*/
+
+static int OCCLUSION_W = OCCLUSION_WIDTH, OCCLUSION_H = OCCLUSION_HEIGHT;
+static float *OCCLUSION_DEPTH = NULL; // z / w of the nearest occluder, row-major
+static Matrix4 OCCLUSION_VIEW_PROJECTION;
+
+static float *OCCLUSION_TRIANGLES = NULL; // screen space x, y, z for 3 vertices, waiting to be binned
+static int OCCLUSION_NUM_TRIANGLES = 0, OCCLUSION_TRIANGLE_CAPACITY = 0;
+static bool OCCLUSION_PENDING = false;
+
+static int *OCCLUSION_BINS = NULL; // triangle indices grouped per tile
+static int *OCCLUSION_BIN_START = NULL; // numTiles + 1 offsets into OCCLUSION_BINS
+static int OCCLUSION_BIN_CAPACITY = 0;
+
+static Vector4 *OCCLUSION_CLIP = NULL; // transformed vertices of the current occluder
+static int OCCLUSION_CLIP_CAPACITY = 0;
+
+void glUtilitiesSetOcclusionResolution(int w, int h) {
+    OCCLUSION_W = (w + OCCLUSION_TILE_W - 1) / OCCLUSION_TILE_W * OCCLUSION_TILE_W;
+    OCCLUSION_H = (h + OCCLUSION_TILE_H - 1) / OCCLUSION_TILE_H * OCCLUSION_TILE_H;
+    free(OCCLUSION_DEPTH);
+    OCCLUSION_DEPTH = NULL;
+
+    // Queued occluders were binned for the old tile grid
+    OCCLUSION_NUM_TRIANGLES = 0;
+    OCCLUSION_PENDING = false;
+}
+
+void glUtilitiesBeginOcclusion(Matrix4 viewProjection) {
+    if(!OCCLUSION_DEPTH) {
+        OCCLUSION_DEPTH = (float *)malloc(sizeof(float) * OCCLUSION_W * OCCLUSION_H);
+    }
+
+    for(int i = 0; i < OCCLUSION_W * OCCLUSION_H; i++) {
+        OCCLUSION_DEPTH[i] = INFINITY;
+    }
+
+    OCCLUSION_VIEW_PROJECTION = viewProjection;
+    OCCLUSION_NUM_TRIANGLES = 0;
+    OCCLUSION_PENDING = false;
+}
+
+static void emit_occluder_triangle(Vector4 a, Vector4 b, Vector4 c) {
+    if(OCCLUSION_NUM_TRIANGLES == OCCLUSION_TRIANGLE_CAPACITY) {
+        OCCLUSION_TRIANGLE_CAPACITY = OCCLUSION_TRIANGLE_CAPACITY ? OCCLUSION_TRIANGLE_CAPACITY * 2 : 4096;
+        OCCLUSION_TRIANGLES = (float *)realloc(OCCLUSION_TRIANGLES, sizeof(float) * 9 * OCCLUSION_TRIANGLE_CAPACITY);
+    }
+
+    float *t = OCCLUSION_TRIANGLES + OCCLUSION_NUM_TRIANGLES++ * 9;
+    Vector4 v[3] = {a, b, c};
+    for(int i = 0; i < 3; i++) {
+        t[i * 3] = (v[i].x / v[i].w * 0.5f + 0.5f) * OCCLUSION_W;
+        t[i * 3 + 1] = (v[i].y / v[i].w * 0.5f + 0.5f) * OCCLUSION_H;
+        t[i * 3 + 2] = v[i].z / v[i].w;
+    }
+}
+
+static Vector4 clip_lerp(Vector4 a, Vector4 b, float t) {
+    Vector4 r;
+    r.x = a.x + (b.x - a.x) * t;
+    r.y = a.y + (b.y - a.y) * t;
+    r.z = a.z + (b.z - a.z) * t;
+    r.w = a.w + (b.w - a.w) * t;
+    return r;
+}
+
+void glUtilitiesRasterizeOccluder(Model *m, Matrix4 transform) {
+    if(!OCCLUSION_DEPTH || !m->vertexArray || !m->indexArray) {
+        return;
+    }
+
+    if(OCCLUSION_CLIP_CAPACITY < m->numVertices) {
+        OCCLUSION_CLIP_CAPACITY = m->numVertices;
+        OCCLUSION_CLIP = (Vector4 *)realloc(OCCLUSION_CLIP, sizeof(Vector4) * OCCLUSION_CLIP_CAPACITY);
+    }
+
+    float *p = MultM4(OCCLUSION_VIEW_PROJECTION, transform).m;
+    for(int i = 0; i < m->numVertices; i++) {
+        Vector3 v = m->vertexArray[i];
+        OCCLUSION_CLIP[i].x = p[0] * v.x + p[1] * v.y + p[2] * v.z + p[3];
+        OCCLUSION_CLIP[i].y = p[4] * v.x + p[5] * v.y + p[6] * v.z + p[7];
+        OCCLUSION_CLIP[i].z = p[8] * v.x + p[9] * v.y + p[10] * v.z + p[11];
+        OCCLUSION_CLIP[i].w = p[12] * v.x + p[13] * v.y + p[14] * v.z + p[15];
+    }
+
+    for(int i = 0; i + 2 < m->numIndices; i += 3) {
+        Vector4 v[3] = {OCCLUSION_CLIP[m->indexArray[i]], OCCLUSION_CLIP[m->indexArray[i + 1]], OCCLUSION_CLIP[m->indexArray[i + 2]]};
+        float d[3];
+        int inside = 0;
+        for(int k = 0; k < 3; k++) {
+            d[k] = v[k].z + v[k].w; // distance to the near plane
+            inside += d[k] >= 0;
+        }
+
+        if(inside == 3) {
+            emit_occluder_triangle(v[0], v[1], v[2]);
+        }
+        else if(inside > 0) {
+            // Clip against the near plane, what is left is a triangle or a quad
+            Vector4 poly[4];
+            int n = 0;
+            for(int k = 0; k < 3; k++) {
+                int l = (k + 1) % 3;
+                if(d[k] >= 0) {
+                    poly[n++] = v[k];
+                }
+                if((d[k] >= 0) != (d[l] >= 0)) {
+                    poly[n++] = clip_lerp(v[k], v[l], d[k] / (d[k] - d[l]));
+                }
+            }
+
+            emit_occluder_triangle(poly[0], poly[1], poly[2]);
+            if(n == 4) {
+                emit_occluder_triangle(poly[0], poly[2], poly[3]);
+            }
+        }
+    }
+
+    OCCLUSION_PENDING = true;
+}
+
+static void rasterize_occlusion_tile(void *unused, int tile) {
+    (void)unused;
+    int tilesX = OCCLUSION_W / OCCLUSION_TILE_W;
+    int tx0 = (tile % tilesX) * OCCLUSION_TILE_W, ty0 = (tile / tilesX) * OCCLUSION_TILE_H;
+
+    for(int b = OCCLUSION_BIN_START[tile]; b < OCCLUSION_BIN_START[tile + 1]; b++) {
+        float *t = OCCLUSION_TRIANGLES + OCCLUSION_BINS[b] * 9;
+        float x0 = t[0], y0 = t[1], z0 = t[2];
+        float x1 = t[3], y1 = t[4], z1 = t[5];
+        float x2 = t[6], y2 = t[7], z2 = t[8];
+
+        // Both windings are occluders, flip to counter-clockwise
+        float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+        if(area == 0) {
+            continue;
+        }
+        if(area < 0) {
+            float s;
+            s = x1; x1 = x2; x2 = s;
+            s = y1; y1 = y2; y2 = s;
+            s = z1; z1 = z2; z2 = s;
+            area = -area;
+        }
+
+        // Edge functions edgeX * x + edgeY * y + edgeC, positive inside
+        float edgeX[3] = {y0 - y1, y1 - y2, y2 - y0};
+        float edgeY[3] = {x1 - x0, x2 - x1, x0 - x2};
+        float edgeC[3] = {x0 * y1 - y0 * x1, x1 * y2 - y1 * x2, x2 * y0 - y2 * x0};
+        float dzdx = ((z1 - z0) * (y2 - y0) - (z2 - z0) * (y1 - y0)) / area;
+        float dzdy = ((z2 - z0) * (x1 - x0) - (z1 - z0) * (x2 - x0)) / area;
+        float zc = z0 - dzdx * x0 - dzdy * y0;
+
+        int minX = (int)floorf(min_f(x0, min_f(x1, x2))), maxX = (int)ceilf(max_f(x0, max_f(x1, x2)));
+        int minY = (int)floorf(min_f(y0, min_f(y1, y2))), maxY = (int)ceilf(max_f(y0, max_f(y1, y2)));
+        minX = minX > tx0 ? minX & ~3 : tx0; // rows go 4 pixels at a time
+        maxX = maxX < tx0 + OCCLUSION_TILE_W ? maxX : tx0 + OCCLUSION_TILE_W;
+        minY = minY > ty0 ? minY : ty0;
+        maxY = maxY < ty0 + OCCLUSION_TILE_H ? maxY : ty0 + OCCLUSION_TILE_H;
+
+        for(int y = minY; y < maxY; y++) {
+            float *row = OCCLUSION_DEPTH + y * OCCLUSION_W;
+            float py = y + 0.5f;
+#ifdef __SSE2__
+            __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            __m128 e0row = _mm_set1_ps(edgeY[0] * py + edgeC[0]), e1row = _mm_set1_ps(edgeY[1] * py + edgeC[1]), e2row = _mm_set1_ps(edgeY[2] * py + edgeC[2]);
+            __m128 zrow = _mm_set1_ps(dzdy * py + zc);
+            for(int x = minX; x < maxX; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeX[0]), px), e0row);
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeX[1]), px), e1row);
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeX[2]), px), e2row);
+                __m128 inside = _mm_cmpge_ps(_mm_min_ps(e0, _mm_min_ps(e1, e2)), _mm_setzero_ps());
+                if(!_mm_movemask_ps(inside)) {
+                    continue;
+                }
+
+                __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), px), zrow);
+                __m128 old = _mm_loadu_ps(row + x);
+                __m128 nearer = _mm_min_ps(old, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+            }
+#else
+            for(int x = minX; x < maxX; x++) {
+                float px = x + 0.5f;
+                if(edgeX[0] * px + edgeY[0] * py + edgeC[0] >= 0 && edgeX[1] * px + edgeY[1] * py + edgeC[1] >= 0 && edgeX[2] * px + edgeY[2] * py + edgeC[2] >= 0) {
+                    float z = dzdx * px + dzdy * py + zc;
+                    row[x] = z < row[x] ? z : row[x];
+                }
+            }
+#endif
+        }
+    }
+}
+
+// Bins the queued occluder triangles per tile and rasterizes the tiles on the pool
+static void resolve_occlusion() {
+    if(!OCCLUSION_PENDING || !OCCLUSION_DEPTH) {
+        OCCLUSION_PENDING = false;
+        return;
+    }
+    OCCLUSION_PENDING = false;
+
+    int tilesX = OCCLUSION_W / OCCLUSION_TILE_W, tilesY = OCCLUSION_H / OCCLUSION_TILE_H;
+    int numTiles = tilesX * tilesY;
+    OCCLUSION_BIN_START = (int *)realloc(OCCLUSION_BIN_START, sizeof(int) * (numTiles + 1));
+    memset(OCCLUSION_BIN_START, 0, sizeof(int) * (numTiles + 1));
+
+    // Counting pass, then the same walk fills the bins
+    for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < OCCLUSION_NUM_TRIANGLES; i++) {
+            float *t = OCCLUSION_TRIANGLES + i * 9;
+            float minX = min_f(t[0], min_f(t[3], t[6])), maxX = max_f(t[0], max_f(t[3], t[6]));
+            float minY = min_f(t[1], min_f(t[4], t[7])), maxY = max_f(t[1], max_f(t[4], t[7]));
+            if(maxX < 0 || maxY < 0 || minX >= OCCLUSION_W || minY >= OCCLUSION_H) {
+                continue;
+            }
+
+            int bx0 = minX > 0 ? (int)minX / OCCLUSION_TILE_W : 0;
+            int by0 = minY > 0 ? (int)minY / OCCLUSION_TILE_H : 0;
+            int bx1 = maxX < OCCLUSION_W ? (int)maxX / OCCLUSION_TILE_W : tilesX - 1;
+            int by1 = maxY < OCCLUSION_H ? (int)maxY / OCCLUSION_TILE_H : tilesY - 1;
+            for(int by = by0; by <= by1; by++) {
+                for(int bx = bx0; bx <= bx1; bx++) {
+                    if(pass == 0) {
+                        OCCLUSION_BIN_START[by * tilesX + bx + 1]++;
+                    }
+                    else {
+                        OCCLUSION_BINS[OCCLUSION_BIN_START[by * tilesX + bx]++] = i;
+                    }
+                }
+            }
+        }
+
+        if(pass == 0) {
+            for(int tile = 0; tile < numTiles; tile++) {
+                OCCLUSION_BIN_START[tile + 1] += OCCLUSION_BIN_START[tile];
+            }
+            if(OCCLUSION_BIN_CAPACITY < OCCLUSION_BIN_START[numTiles]) {
+                OCCLUSION_BIN_CAPACITY = OCCLUSION_BIN_START[numTiles];
+                OCCLUSION_BINS = (int *)realloc(OCCLUSION_BINS, sizeof(int) * OCCLUSION_BIN_CAPACITY);
+            }
+        }
+    }
+
+    // The fill advanced every start to the next bin's
+    for(int tile = numTiles; tile > 0; tile--) {
+        OCCLUSION_BIN_START[tile] = OCCLUSION_BIN_START[tile - 1];
+    }
+    OCCLUSION_BIN_START[0] = 0;
+
+    parallel_for(rasterize_occlusion_tile, NULL, numTiles);
+    OCCLUSION_NUM_TRIANGLES = 0;
+}
+
+int glUtilitiesOcclusionTestBoxes(Vector3 *mins, Vector3 *maxs, int count, char *visible) {
+    resolve_occlusion();
+
+    int numVisible = 0;
+    float *p = OCCLUSION_VIEW_PROJECTION.m;
+    for(int i = 0; i < count; i++) {
+        if(!visible[i]) {
+            continue;
+        }
+        if(!OCCLUSION_DEPTH) {
+            numVisible++;
+            continue;
+        }
+
+        // Screen rectangle and nearest depth of the corners, crossing the near plane counts as visible
+        float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, minZ = INFINITY;
+        bool crossesNear = false;
+        for(int k = 0; k < 8; k++) {
+            float x = k & 1 ? maxs[i].x : mins[i].x;
+            float y = k & 2 ? maxs[i].y : mins[i].y;
+            float z = k & 4 ? maxs[i].z : mins[i].z;
+            float cz = p[8] * x + p[9] * y + p[10] * z + p[11];
+            float cw = p[12] * x + p[13] * y + p[14] * z + p[15];
+            if(cz + cw < 0 || cw <= 0) {
+                crossesNear = true;
+                break;
+            }
+
+            float sx = ((p[0] * x + p[1] * y + p[2] * z + p[3]) / cw * 0.5f + 0.5f) * OCCLUSION_W;
+            float sy = ((p[4] * x + p[5] * y + p[6] * z + p[7]) / cw * 0.5f + 0.5f) * OCCLUSION_H;
+            minX = min_f(minX, sx); maxX = max_f(maxX, sx);
+            minY = min_f(minY, sy); maxY = max_f(maxY, sy);
+            minZ = min_f(minZ, cz / cw);
+        }
+
+        int x0 = crossesNear ? 0 : (int)floorf(max_f(minX, 0)), x1 = crossesNear ? 0 : (int)ceilf(min_f(maxX, OCCLUSION_W));
+        int y0 = crossesNear ? 0 : (int)floorf(max_f(minY, 0)), y1 = crossesNear ? 0 : (int)ceilf(min_f(maxY, OCCLUSION_H));
+        bool occluded = !crossesNear && x0 < x1 && y0 < y1;
+        for(int y = y0; y < y1 && occluded; y++) {
+            float *row = OCCLUSION_DEPTH + y * OCCLUSION_W;
+            int x = x0;
+#ifdef __SSE2__
+            __m128 z = _mm_set1_ps(minZ);
+            for(; x + 4 <= x1; x += 4) {
+                if(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + x), z))) {
+                    occluded = false;
+                    break;
+                }
+            }
+#endif
+            for(; x < x1 && occluded; x++) {
+                occluded = row[x] <= minZ;
+            }
+        }
+
+        visible[i] = !occluded;
+        numVisible += visible[i];
+    }
+
+    return numVisible;
+}
+
+/*
+
+TGA UTILITIES
+
+*/
+
+static bool MIPMAP = true;
+
+void glUtilitiesLoadTGASetMipmapping(bool active) {
+    MIPMAP = active;
+}
+
+static void copy_tga_pixels_scalar(GLubyte *dst, const GLubyte *src, int count, int bytes) {
+    if(bytes < 3) {
+        memcpy(dst, src, count);
+        return;
+    }
+
+    for(int i = 0; i < count; i++, dst += bytes, src += bytes) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        if(bytes == 4) {
+            dst[3] = src[3];
+        }
+    }
+}
+
+#ifdef TGA_SSSE3
+// BGR(A) to RGB(A) with pshufb, 24 bit pixels go 4 at a time through 16 byte loads
+__attribute__((target("ssse3")))
+static void copy_tga_pixels_ssse3(GLubyte *dst, const GLubyte *src, int count, int bytes) {
+    int i = 0;
+    if(bytes == 4) {
+        const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        for(; i + 4 <= count; i += 4) {
+            _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i * 4)), mask));
+        }
+    }
+    else {
+        // The 4 bytes past the 12 written are overwritten by the next step, 6 pixels keep both in bounds
+        const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+        for(; i + 6 <= count; i += 4) {
+            _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i * 3)), mask));
+        }
+    }
+    copy_tga_pixels_scalar(dst + i * bytes, src + i * bytes, count - i, bytes);
+}
+#endif
+
+// Copies count pixels swapping red and blue
+static void copy_tga_pixels(GLubyte *dst, const GLubyte *src, int count, int bytes) {
+#ifdef TGA_SSSE3
+    static int ssse3 = -1;
+    if(ssse3 < 0) {
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+    if(ssse3 && bytes >= 3 && count >= 8) {
+        copy_tga_pixels_ssse3(dst, src, count, bytes);
+        return;
+    }
+#endif
+    copy_tga_pixels_scalar(dst, src, count, bytes);
+}
+
+// Repeats an already swizzled pixel, doubling the filled span with each memcpy
+static void fill_tga_pixels(GLubyte *dst, const GLubyte *pixel, int count, int bytes) {
+    if(bytes == 1) {
+        memset(dst, pixel[0], count);
+        return;
+    }
+
+    size_t total = (size_t)count * bytes, filled = bytes;
+    memcpy(dst, pixel, bytes);
+    while(filled < total) {
+        size_t n = filled < total - filled ? filled : total - filled;
+        memcpy(dst + filled, dst, n);
+        filled += n;
+    }
+}
+
+// Maps the file and reads the header into texture, NULL with a message when it can not be used
+static GLubyte *open_tga(const char *filename, TextureData *texture, long *size) {
+	GLubyte uncompressedheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	GLubyte compressedheader[12] = {0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	GLubyte uncompressedbwheader[12] = {0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	GLubyte compressedbwheader[12] = {0, 0, 11, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+    // The whole file mapped, decoding then works on memory
+    GLubyte *data = NULL;
+    int err = 0;
+    int file = open(filename, O_RDONLY);
+    struct stat info;
+    *size = 0;
+	if (file < 0) {
+        err = 1;
+    }
+    else {
+        *size = fstat(file, &info) == 0 ? (long)info.st_size : 0;
+        data = *size >= 12 ? (GLubyte *)mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file, 0) : NULL;
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
+        if (!data) {
+            err = 2;
+        }
+        close(file);
+    }
+
+    GLubyte *actualHeader = data;
+	if (err == 0 &&
+				(memcmp(uncompressedheader, actualHeader, sizeof(uncompressedheader)-4) != 0) &&
+				(memcmp(compressedheader, actualHeader, sizeof(compressedheader)-4) != 0) &&
+				(memcmp(uncompressedbwheader, actualHeader, sizeof(uncompressedheader)-4) != 0) &&
+				(memcmp(compressedbwheader, actualHeader, sizeof(compressedheader)-4) != 0)
+			) {
+		err = 3; // Does The Header Match What We Want?
+		for (int i = 0; i < 12; i++) {
+			printf("%d ", actualHeader[i]);
+        }
+		printf("\n");
+	}
+	else if (err == 0 && *size < 18) {
+        err = 4;
+    }
+
+	if (err != 0) {
+		switch (err) {
+			case 1: printf("could not open file %s\n", filename); break;
+			case 2: printf("could not read header of %s\n", filename); break;
+			case 3: printf("unsupported format in %s\n", filename); break;
+			case 4: printf("could not read file %s\n", filename); break;
+		}
+
+        if (data) {
+            munmap(data, *size);
+        }
+        return NULL;
+	}
+
+    GLubyte *header = data + 12;
+	texture->w  = header[1] * 256 + header[0];
+    texture->h = header[3] * 256 + header[2];
+	if (texture->w <= 0 || texture->h <= 0 || (header[4] != 24 && header[4] != 32 && header[4] != 8)) {
+        munmap(data, *size);
+		return NULL;
+	}
+	texture->bpp = header[4];
+    texture->imageData = NULL;
+    if ((data[2] == 2 || data[2] == 3) && (size_t)(*size - 18) < (size_t)texture->w * texture->h * (texture->bpp / 8)) {
+        munmap(data, *size);
+        return NULL;
+    }
+    return data;
+}
+
+static void copy_tga_span(GLubyte *dst, const GLubyte *src, int count, int bytes, bool swizzle) {
+    if (swizzle) {
+        copy_tga_pixels(dst, src, count, bytes);
+    }
+    else {
+        memcpy(dst, src, (size_t)count * bytes);
+    }
+}
+
+// Decodes the mapped file into tightly packed rows, bottom row first. Without swizzle
+// the pixels stay BGR(A) as stored, for uploads with GL_BGR / GL_BGRA.
+static bool decode_tga(const GLubyte *data, long size, const TextureData *texture, GLubyte *pixels, bool swizzle) {
+	char flipped = (data[17] & 32) != 0; // top-left origin, the first row read is the last one stored
+	int bytesPerPixel = texture->bpp / 8;
+    size_t rowSize = (size_t)texture->w * bytesPerPixel;
+	size_t imageSize = rowSize * texture->h;
+
+    const GLubyte *src = data + 18, *end = data + size;
+	if (data[2] == 2 || data[2] == 3) {
+        if ((size_t)(end - src) < imageSize) {
+			return false;
+        }
+
+		for (GLuint row = 0; row < texture->h; row++, src += rowSize) {
+            GLuint y = flipped ? texture->h - 1 - row : row;
+            copy_tga_span(pixels + y * rowSize, src, texture->w, bytesPerPixel, swizzle);
+		}
+	}
+	else {
+        // Packets may run over row ends, each is split at them
+        size_t pixel = 0, numPixels = (size_t)texture->w * texture->h;
+        GLubyte repeated[4];
+		while (pixel < numPixels && src < end) {
+            GLubyte rle = *src++;
+            size_t n = (rle & 127) + 1;
+            bool run = rle >= 128;
+            if ((size_t)(end - src) < (run ? 1 : n) * bytesPerPixel) {
+                break; // truncated, keep what was decoded
+            }
+
+            if (run) {
+                copy_tga_span(repeated, src, 1, bytesPerPixel, swizzle);
+                src += bytesPerPixel;
+            }
+
+            n = n < numPixels - pixel ? n : numPixels - pixel;
+            while (n > 0) {
+                GLuint row = pixel / texture->w, x = pixel % texture->w;
+                GLuint y = flipped ? texture->h - 1 - row : row;
+                size_t chunk = texture->w - x < n ? texture->w - x : n;
+                GLubyte *dst = pixels + y * rowSize + (size_t)x * bytesPerPixel;
+                if (run) {
+                    fill_tga_pixels(dst, repeated, chunk, bytesPerPixel);
+                }
+                else {
+                    copy_tga_span(dst, src, chunk, bytesPerPixel, swizzle);
+                    src += chunk * bytesPerPixel;
+                }
+                pixel += chunk;
+                n -= chunk;
+            }
+		}
+	}
+
+	return true;
+}
+
+bool glUtilitiesLoadTGATextureData(const char *filename, TextureData *texture) {
+    long size;
+    GLubyte *data = open_tga(filename, texture, &size);
+    if (!data) {
+        return false;
+    }
+
+	texture->imageData = (GLubyte *)calloc(1, (size_t)texture->w * texture->h * (texture->bpp / 8));
+	if (texture->imageData == NULL || !decode_tga(data, size, texture, texture->imageData, true)) {
+        free(texture->imageData);
+        texture->imageData = NULL;
+        munmap(data, size);
+		return false;
+	}
+
+    munmap(data, size);
+	return true;
+}
+
+static GLubyte *build_mip_chain(const TextureData *tex, int channels, int first, int *levels, size_t *size);
+
+// Levels below the top from the filtered chain, pixels laid out like the top level's.
+// internalFormat 0 fills storage that is already there, otherwise each level is specified with it.
+static void upload_mip_levels(const TextureData *tex, const GLubyte *pixels, GLenum internalFormat, GLenum format) {
+    TextureData top = *tex;
+    top.imageData = (GLubyte *)pixels;
+    int levels, bytes = tex->bpp / 8;
+    size_t size;
+    GLubyte *chain = build_mip_chain(&top, bytes, 1, &levels, &size);
+    if(!chain) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        return;
+    }
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const GLubyte *level = chain;
+    for(int i = 1; i < levels; i++) {
+        int w = tex->w >> i > 0 ? tex->w >> i : 1, h = tex->h >> i > 0 ? tex->h >> i : 1;
+        if(internalFormat) {
+            glTexImage2D(GL_TEXTURE_2D, i, internalFormat, w, h, 0, format, GL_UNSIGNED_BYTE, level);
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, w, h, format, GL_UNSIGNED_BYTE, level);
+        }
+        level += (size_t)w * h * bytes;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    free(chain);
+}
+
+bool glUtilitiesLoadTGATexture(const char *n, TextureData *tex) {
+    char ok;
+    GLuint type = GL_RGBA;
+
+    ok = glUtilitiesLoadTGATextureData(n, tex);
+    if(!ok) {
+        return false;
+    }
+
+    glGenTextures(1, &tex->texID);
+    glBindTexture(GL_TEXTURE_2D, tex->texID);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    
+    if(tex->bpp == 8) {
+        type = GL_RED;
+    }
+
+    if(tex->bpp == 24) {
+        type = GL_RGB;
+    }
+	glTexImage2D(GL_TEXTURE_2D, 0, type, tex->w, tex->h, 0, type, GL_UNSIGNED_BYTE, tex[0].imageData);
+    
+	if(MIPMAP) {
+		upload_mip_levels(tex, tex->imageData, type, type);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    }
+    
+    return true;
+}
+
+static int TEXTURE_STORAGE = -1; // glTexStorage2D, checked on first use
+static StreamBuffer *TEXTURE_STREAM = NULL; // pixel unpack ring shared by loads and texture updates
+
+static int texture_bytes(GLenum format) {
+    switch(format) {
+        case GL_RED: return 1;
+        case GL_RG: return 2;
+        case GL_RGB: case GL_BGR: return 3;
+        default: return 4;
+    }
+}
+
+GLuint glUtilitiesCreateTexture(int w, int h, GLenum internalFormat, int levels) {
+    if(TEXTURE_STORAGE < 0) {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        TEXTURE_STORAGE = major > 4 || (major == 4 && minor >= 2) || has_extension("GL_ARB_texture_storage");
+    }
+
+    if(levels <= 0) {
+        levels = 1;
+        while((w >> levels) > 0 || (h >> levels) > 0) {
+            levels++;
+        }
+    }
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    if(TEXTURE_STORAGE) {
+        glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, w, h);
+    }
+    else {
+        for(int i = 0; i < levels; i++) {
+            int lw = w >> i > 0 ? w >> i : 1, lh = h >> i > 0 ? h >> i : 1;
+            glTexImage2D(GL_TEXTURE_2D, i, internalFormat, lw, lh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    return tex;
+}
+
+static struct {
+    GLuint texID;
+    int x, y, w, h;
+    GLenum format;
+    GLintptr offset;
+} TEXTURE_UPDATE = {0};
+
+void *glUtilitiesBeginTextureUpdate(GLuint texID, int x, int y, int w, int h, GLenum format) {
+    if(!TEXTURE_STREAM) {
+        TEXTURE_STREAM = glUtilitiesCreateStreamBuffer(1 << 24);
+    }
+
+    TEXTURE_UPDATE.texID = texID;
+    TEXTURE_UPDATE.x = x;
+    TEXTURE_UPDATE.y = y;
+    TEXTURE_UPDATE.w = w;
+    TEXTURE_UPDATE.h = h;
+    TEXTURE_UPDATE.format = format;
+    return glUtilitiesStreamAlloc(TEXTURE_STREAM, (GLsizeiptr)w * h * texture_bytes(format), 16, &TEXTURE_UPDATE.offset);
+}
+
+void glUtilitiesEndTextureUpdate() {
+    glUtilitiesStreamCommit(TEXTURE_STREAM);
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows are tightly packed
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, TEXTURE_STREAM->buffer);
+    glBindTexture(GL_TEXTURE_2D, TEXTURE_UPDATE.texID);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, TEXTURE_UPDATE.x, TEXTURE_UPDATE.y, TEXTURE_UPDATE.w, TEXTURE_UPDATE.h,
+        TEXTURE_UPDATE.format, GL_UNSIGNED_BYTE, (const void *)TEXTURE_UPDATE.offset);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+}
+
+bool glUtilitiesUpdateTexture(GLuint texID, int x, int y, int w, int h, GLenum format, const void *pixels) {
+    void *dst = glUtilitiesBeginTextureUpdate(texID, x, y, w, h, format);
+    if(!dst) {
+        return false;
+    }
+    memcpy(dst, pixels, (size_t)w * h * texture_bytes(format));
+    glUtilitiesEndTextureUpdate();
+    return true;
+}
+
+static GLenum tga_format(GLuint bpp) {
+    return bpp == 8 ? GL_RED : bpp == 24 ? GL_BGR : GL_BGRA;
+}
+
+static GLuint create_tga_texture(TextureData *tex) {
+    GLenum internalFormat = tex->bpp == 8 ? GL_R8 : tex->bpp == 24 ? GL_RGB8 : GL_RGBA8;
+    tex->texID = glUtilitiesCreateTexture(tex->w, tex->h, internalFormat, MIPMAP ? 0 : 1);
+    return tex->texID;
+}
+
+// Uploads decoded BGR(A) pixels from client memory into a new texture
+static void upload_tga_pixels(TextureData *tex, const GLubyte *pixels) {
+    create_tga_texture(tex);
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex->w, tex->h, tga_format(tex->bpp), GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+	if(MIPMAP) {
+		upload_mip_levels(tex, pixels, 0, tga_format(tex->bpp));
+    }
+}
+
+bool glUtilitiesLoadTGATextureDirect(const char *n, TextureData *tex) {
+    long size;
+    GLubyte *data = open_tga(n, tex, &size);
+    if(!data) {
+        return false;
+    }
+
+    size_t imageSize = (size_t)tex->w * tex->h * (tex->bpp / 8);
+    GLubyte *decoded = NULL;
+    if(MIPMAP) {
+        // The mip filter reads the top level back, the ring is mapped for writing only
+        decoded = (GLubyte *)calloc(1, imageSize);
+        if(!decoded) {
+            munmap(data, size);
+            return false;
+        }
+        decode_tga(data, size, tex, decoded, false);
+    }
+
+    GLubyte *pixels = NULL;
+    if(imageSize <= (1 << 24)) {
+        create_tga_texture(tex);
+        pixels = (GLubyte *)glUtilitiesBeginTextureUpdate(tex->texID, 0, 0, tex->w, tex->h, tga_format(tex->bpp));
+        if(!pixels) {
+            glDeleteTextures(1, &tex->texID); // could not map the ring, the client memory path below
+            tex->texID = 0;
+        }
+    }
+    if(pixels) {
+        // The driver copies level 0 from the ring on the GPU timeline
+        if(decoded) {
+            memcpy(pixels, decoded, imageSize);
+        }
+        else {
+            if(data[2] != 2 && data[2] != 3) {
+                memset(pixels, 0, imageSize); // truncated RLE data leaves the rest black
+            }
+            decode_tga(data, size, tex, pixels, false); // straight into the ring
+        }
+        glUtilitiesEndTextureUpdate();
+
+        if(decoded) {
+            upload_mip_levels(tex, decoded, 0, tga_format(tex->bpp));
+        }
+    }
+    else {
+        // Larger than the ring or it could not be mapped, one temporary buffer rather than growing the ring for good
+        if(!decoded) {
+            decoded = (GLubyte *)calloc(1, imageSize);
+            if(!decoded) {
+                munmap(data, size);
+                return false;
+            }
+            decode_tga(data, size, tex, decoded, false);
+        }
+        upload_tga_pixels(tex, decoded);
+    }
+
+    free(decoded);
+    munmap(data, size);
+    return true;
+}
+
+typedef struct TGABatch {
+    const char **names;
+    TextureData *textures;
+    GLubyte **pixels; // decoded BGR(A), NULL when the file failed
+    int count, next;
+    int *decoded, numDecoded; // finished files in the order they came in
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+} TGABatch;
+
+static int claim_tga_file(TGABatch *b) {
+    pthread_mutex_lock(&b->mutex);
+    int i = b->next < b->count ? b->next++ : -1;
+    pthread_mutex_unlock(&b->mutex);
+    return i;
+}
+
+static void decode_tga_file(TGABatch *b, int i) {
+    long size;
+    GLubyte *pixels = NULL;
+    GLubyte *data = open_tga(b->names[i], &b->textures[i], &size);
+    if(data) {
+        pixels = (GLubyte *)calloc(1, (size_t)b->textures[i].w * b->textures[i].h * (b->textures[i].bpp / 8));
+        if(pixels && !decode_tga(data, size, &b->textures[i], pixels, false)) {
+            free(pixels);
+            pixels = NULL;
+        }
+        munmap(data, size);
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    b->pixels[i] = pixels;
+    b->decoded[b->numDecoded++] = i;
+    pthread_cond_signal(&b->ready);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// One lane of the pool job, decodes files until none are left
+static void decode_tga_lane(void *arg, int lane) {
+    (void)lane;
+    TGABatch *b = (TGABatch *)arg;
+    for(int i = claim_tga_file(b); i >= 0; i = claim_tga_file(b)) {
+        decode_tga_file(b, i);
+    }
+}
+
+int glUtilitiesLoadTGATextureBatch(const char **names, int count, TextureData *textures, int threads) {
+    TGABatch b;
+    b.names = names;
+    b.textures = textures;
+    b.pixels = (GLubyte **)calloc(count > 0 ? count : 1, sizeof(GLubyte *));
+    b.decoded = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+    b.count = count;
+    b.next = 0;
+    b.numDecoded = 0;
+    pthread_mutex_init(&b.mutex, NULL);
+    pthread_cond_init(&b.ready, NULL);
+    memset(textures, 0, count * sizeof(TextureData));
+
+    // The calling thread counts as one of the threads, it decodes too whenever nothing waits for upload
+    int lanes = threads > 0 ? threads - 1 : glUtilitiesGetWorkerThreads();
+    lanes = lanes < count ? lanes : count;
+    if(lanes > 0 && glUtilitiesGetWorkerThreads() == 0) {
+        lanes = 0;
+    }
+
+    PoolJob job;
+    start_job(&job, decode_tga_lane, &b, lanes);
+
+    int loaded = 0;
+    for(int uploaded = 0; uploaded < count; ) {
+        pthread_mutex_lock(&b.mutex);
+        if(uploaded == b.numDecoded) {
+            if(b.next < b.count) {
+                int i = b.next++;
+                pthread_mutex_unlock(&b.mutex);
+                decode_tga_file(&b, i);
+            }
+            else {
+                pthread_cond_wait(&b.ready, &b.mutex);
+                pthread_mutex_unlock(&b.mutex);
+            }
+            continue;
+        }
+        int i = b.decoded[uploaded++];
+        pthread_mutex_unlock(&b.mutex);
+
+        if(b.pixels[i]) {
+            upload_tga_pixels(&textures[i], b.pixels[i]);
+            free(b.pixels[i]);
+            loaded++;
+        }
+        else {
+            memset(&textures[i], 0, sizeof(TextureData));
+        }
+    }
+
+    wait_job(&job);
+    pthread_cond_destroy(&b.ready);
+    pthread_mutex_destroy(&b.mutex);
+    free(b.pixels);
+    free(b.decoded);
+    return loaded;
+}
+
+void glUtilitiesLoadTGATextureSimple(const char *n, GLuint *tex) {
+	TextureData texture;
+    memset(&texture, 0, sizeof(texture));
+
+	if (glUtilitiesLoadTGATextureDirect(n, &texture)) {
         *tex = texture.texID;
     }
     else {
-        *tex = 0;
+        *tex = 0;
+    }
+}
+
+static int block_bytes(GLenum format) {
+    return format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RED_RGTC1 ? 8 : 16;
+}
+
+static size_t compressed_level_size(GLenum format, int w, int h) {
+    return (size_t)((w + 3) / 4) * ((h + 3) / 4) * block_bytes(format);
+}
+
+static int mip_levels(int w, int h) {
+    int levels = 1;
+    while((w >> levels) > 0 || (h >> levels) > 0) {
+        levels++;
+    }
+    return levels;
+}
+
+static float clamp_byte(float v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static int pack_565(const float *c) {
+    int r = (int)(clamp_byte(c[0]) * 31 / 255 + 0.5f);
+    int g = (int)(clamp_byte(c[1]) * 63 / 255 + 0.5f);
+    int b = (int)(clamp_byte(c[2]) * 31 / 255 + 0.5f);
+    return r << 11 | g << 5 | b;
+}
+
+// Expanded back the way the hardware does it, top bits replicated
+static void unpack_565(int c, float *out) {
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    out[0] = (float)(r << 3 | r >> 2);
+    out[1] = (float)(g << 2 | g >> 4);
+    out[2] = (float)(b << 3 | b >> 2);
+}
+
+// Nearest of the four BC1 colors for each pixel, c0 > c1 as four color mode requires.
+// Returns the squared error, the 2 bit indices go to indices.
+static float bc1_indices(const float *r, const float *g, const float *b, int c0, int c1, GLuint *indices) {
+    float palette[4][3];
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for(int c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    float error = 0;
+    *indices = 0;
+#ifdef __SSE2__
+    __m128 total = _mm_setzero_ps();
+    for(int i = 0; i < 16; i += 4) {
+        __m128 pr = _mm_loadu_ps(r + i), pg = _mm_loadu_ps(g + i), pb = _mm_loadu_ps(b + i);
+        __m128 best = _mm_set1_ps(INFINITY);
+        __m128i index = _mm_setzero_si128();
+        for(int k = 0; k < 4; k++) {
+            __m128 dr = _mm_sub_ps(pr, _mm_set1_ps(palette[k][0]));
+            __m128 dg = _mm_sub_ps(pg, _mm_set1_ps(palette[k][1]));
+            __m128 db = _mm_sub_ps(pb, _mm_set1_ps(palette[k][2]));
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+            __m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+            best = _mm_min_ps(d, best);
+            index = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)), _mm_andnot_si128(closer, index));
+        }
+        total = _mm_add_ps(total, best);
+
+        int lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, index);
+        for(int j = 0; j < 4; j++) {
+            *indices |= (GLuint)lanes[j] << (2 * (i + j));
+        }
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, total);
+    error = sums[0] + sums[1] + sums[2] + sums[3];
+#else
+    for(int i = 0; i < 16; i++) {
+        float best = INFINITY;
+        int index = 0;
+        for(int k = 0; k < 4; k++) {
+            float dr = r[i] - palette[k][0], dg = g[i] - palette[k][1], db = b[i] - palette[k][2];
+            float d = dr * dr + dg * dg + db * db;
+            if(d < best) {
+                best = d;
+                index = k;
+            }
+        }
+        error += best;
+        *indices |= (GLuint)index << (2 * i);
+    }
+#endif
+
+    return error;
+}
+
+// Endpoints in 5:6:5 with their indices, swapped into four color order when needed
+static float bc1_fit(const float *r, const float *g, const float *b, const float *e0, const float *e1, int *c0, int *c1, GLuint *indices) {
+    *c0 = pack_565(e0);
+    *c1 = pack_565(e1);
+    if(*c0 < *c1) {
+        int t = *c0;
+        *c0 = *c1;
+        *c1 = t;
+    }
+    if(*c0 == *c1) {
+        // Three color mode would follow, every pixel takes c0 instead
+        float c[3], error = 0;
+        unpack_565(*c0, c);
+        for(int i = 0; i < 16; i++) {
+            error += (r[i] - c[0]) * (r[i] - c[0]) + (g[i] - c[1]) * (g[i] - c[1]) + (b[i] - c[2]) * (b[i] - c[2]);
+        }
+        *indices = 0;
+        return error;
+    }
+    return bc1_indices(r, g, b, *c0, *c1, indices);
+}
+
+// Quality 0 takes the box diagonal, 1 the principal axis, 2 also refines the endpoints by least squares
+static void encode_color_block(const GLubyte *block, GLubyte *out, int quality) {
+    float r[16], g[16], b[16], mean[3] = {0, 0, 0}, lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+    for(int i = 0; i < 16; i++) {
+        r[i] = block[i * 4];
+        g[i] = block[i * 4 + 1];
+        b[i] = block[i * 4 + 2];
+        float v[3] = {r[i], g[i], b[i]};
+        for(int c = 0; c < 3; c++) {
+            mean[c] += v[c];
+            lo[c] = v[c] < lo[c] ? v[c] : lo[c];
+            hi[c] = v[c] > hi[c] ? v[c] : hi[c];
+        }
+    }
+    for(int c = 0; c < 3; c++) {
+        mean[c] /= 16;
+    }
+
+    float cov[6] = {0, 0, 0, 0, 0, 0}; // rr rg rb gg gb bb
+    for(int i = 0; i < 16; i++) {
+        float dr = r[i] - mean[0], dg = g[i] - mean[1], db = b[i] - mean[2];
+        cov[0] += dr * dr;
+        cov[1] += dr * dg;
+        cov[2] += dr * db;
+        cov[3] += dg * dg;
+        cov[4] += dg * db;
+        cov[5] += db * db;
+    }
+
+    // Channels falling while the widest one rises flip the diagonal
+    float axis[3] = {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]};
+    int widest = axis[0] >= axis[1] && axis[0] >= axis[2] ? 0 : axis[1] >= axis[2] ? 1 : 2;
+    const int row[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+    for(int c = 0; c < 3; c++) {
+        if(cov[row[widest][c]] < 0) {
+            axis[c] = -axis[c];
+        }
+    }
+
+    if(quality > 0) {
+        for(int k = 0; k < 8; k++) {
+            float next[3], scale = 0;
+            for(int c = 0; c < 3; c++) {
+                next[c] = cov[row[c][0]] * axis[0] + cov[row[c][1]] * axis[1] + cov[row[c][2]] * axis[2];
+                scale = fabsf(next[c]) > scale ? fabsf(next[c]) : scale;
+            }
+            if(scale <= 0) {
+                break;
+            }
+            for(int c = 0; c < 3; c++) {
+                axis[c] = next[c] / scale;
+            }
+        }
+    }
+
+    float length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float tmin = 0, tmax = 0;
+    for(int i = 0; i < 16 && length > 0; i++) {
+        float t = ((r[i] - mean[0]) * axis[0] + (g[i] - mean[1]) * axis[1] + (b[i] - mean[2]) * axis[2]) / length;
+        tmin = t < tmin ? t : tmin;
+        tmax = t > tmax ? t : tmax;
+    }
+
+    float e0[3], e1[3];
+    for(int c = 0; c < 3; c++) {
+        e0[c] = mean[c] + axis[c] * tmax;
+        e1[c] = mean[c] + axis[c] * tmin;
+    }
+
+    int c0, c1;
+    GLuint indices;
+    float error = bc1_fit(r, g, b, e0, e1, &c0, &c1, &indices);
+
+    for(int k = 0; k < 2 && quality >= 2 && error > 0; k++) {
+        // Weight of c0 for each index, the same system is solved for every channel
+        const float weights[4] = {1, 0, 2.0f / 3, 1.0f / 3};
+        float aa = 0, ab = 0, bb = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+        for(int i = 0; i < 16; i++) {
+            float wa = weights[(indices >> (2 * i)) & 3], wb = 1 - wa;
+            float v[3] = {r[i], g[i], b[i]};
+            aa += wa * wa;
+            ab += wa * wb;
+            bb += wb * wb;
+            for(int c = 0; c < 3; c++) {
+                ax[c] += wa * v[c];
+                bx[c] += wb * v[c];
+            }
+        }
+
+        float det = aa * bb - ab * ab;
+        if(fabsf(det) < 1e-6f) {
+            break;
+        }
+        for(int c = 0; c < 3; c++) {
+            e0[c] = (ax[c] * bb - bx[c] * ab) / det;
+            e1[c] = (bx[c] * aa - ax[c] * ab) / det;
+        }
+
+        int n0, n1;
+        GLuint refined;
+        float refinedError = bc1_fit(r, g, b, e0, e1, &n0, &n1, &refined);
+        if(refinedError >= error) {
+            break;
+        }
+        error = refinedError;
+        c0 = n0;
+        c1 = n1;
+        indices = refined;
+    }
+
+    out[0] = c0 & 255;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 255;
+    out[3] = c1 >> 8;
+    for(int i = 0; i < 4; i++) {
+        out[4 + i] = (indices >> (8 * i)) & 255;
+    }
+}
+
+// Eight level BC4 block, endpoints at the extremes and 3 bit indices from thresholds
+static void encode_value_block(const GLubyte *values, GLubyte *out) {
+    int lo = 255, hi = 0;
+    for(int i = 0; i < 16; i++) {
+        lo = values[i] < lo ? values[i] : lo;
+        hi = values[i] > hi ? values[i] : hi;
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+    memset(out + 2, 0, 6);
+    if(hi == lo) {
+        return;
+    }
+
+    // Steps from hi count the thresholds (2k - 1) * range / 14 each value passes
+    int range = hi - lo;
+    short steps[16];
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *)values), zero = _mm_setzero_si128();
+    __m128i halves[2] = {_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)};
+    for(int j = 0; j < 2; j++) {
+        __m128i d = _mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(hi), halves[j]), _mm_set1_epi16(14));
+        __m128i t = _mm_setzero_si128();
+        for(int k = 1; k <= 7; k++) {
+            t = _mm_sub_epi16(t, _mm_cmpgt_epi16(d, _mm_set1_epi16((2 * k - 1) * range - 1)));
+        }
+        _mm_storeu_si128((__m128i *)(steps + j * 8), t);
+    }
+#else
+    for(int i = 0; i < 16; i++) {
+        int d = (hi - values[i]) * 14;
+        steps[i] = 0;
+        for(int k = 1; k <= 7; k++) {
+            steps[i] += d >= (2 * k - 1) * range;
+        }
+    }
+#endif
+
+    uint64_t bits = 0;
+    for(int i = 0; i < 16; i++) {
+        int index = steps[i] == 0 ? 0 : steps[i] == 7 ? 1 : steps[i] + 1;
+        bits |= (uint64_t)index << (3 * i);
+    }
+    for(int i = 0; i < 6; i++) {
+        out[2 + i] = (bits >> (8 * i)) & 255;
+    }
+}
+
+typedef struct CompressJob {
+    const GLubyte *rgba;
+    int w, h;
+    GLenum format;
+    int quality;
+    GLubyte *out;
+} CompressJob;
+
+// One row of blocks, edge blocks repeat the last row and column
+static void compress_block_row(void *arg, int by) {
+    CompressJob *job = (CompressJob *)arg;
+    int blocksX = (job->w + 3) / 4, size = block_bytes(job->format);
+    GLubyte *out = job->out + (size_t)by * blocksX * size;
+
+    for(int bx = 0; bx < blocksX; bx++, out += size) {
+        GLubyte block[64], channel[16];
+        for(int y = 0; y < 4; y++) {
+            int py = by * 4 + y < job->h ? by * 4 + y : job->h - 1;
+            for(int x = 0; x < 4; x++) {
+                int px = bx * 4 + x < job->w ? bx * 4 + x : job->w - 1;
+                memcpy(block + (y * 4 + x) * 4, job->rgba + ((size_t)py * job->w + px) * 4, 4);
+            }
+        }
+
+        switch(job->format) {
+            case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+                encode_color_block(block, out, job->quality);
+                break;
+            case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+                for(int i = 0; i < 16; i++) {
+                    channel[i] = block[i * 4 + 3];
+                }
+                encode_value_block(channel, out);
+                encode_color_block(block, out + 8, job->quality);
+                break;
+            default:
+                for(int c = 0; c < (job->format == GL_COMPRESSED_RG_RGTC2 ? 2 : 1); c++) {
+                    for(int i = 0; i < 16; i++) {
+                        channel[i] = block[i * 4 + c];
+                    }
+                    encode_value_block(channel, out + c * 8);
+                }
+                break;
+        }
+    }
+}
+
+GLubyte *glUtilitiesCompressTexture(const GLubyte *rgba, int w, int h, GLenum format, int quality, size_t *size) {
+    CompressJob job = {rgba, w, h, format, quality, NULL};
+    *size = compressed_level_size(format, w, h);
+    job.out = (GLubyte *)malloc(*size);
+    if(job.out) {
+        parallel_for(compress_block_row, &job, (h + 3) / 4);
+    }
+    return job.out;
+}
+
+static int MIP_FILTER = MIP_BOX;
+static bool MIP_SRGB = false;
+static float MIP_ALPHA_CUTOFF = 0;
+
+void glUtilitiesLoadTGASetMipFilter(int filter, bool srgb, float alphaCutoff) {
+    MIP_FILTER = filter;
+    MIP_SRGB = srgb;
+    MIP_ALPHA_CUTOFF = alphaCutoff;
+}
+
+static float SRGB_TO_LINEAR[256];
+static GLubyte LINEAR_TO_SRGB[4096];
+
+static void init_srgb_tables() {
+    if(SRGB_TO_LINEAR[255] != 0) {
+        return;
+    }
+    for(int i = 0; i < 4096; i++) {
+        float v = i / 4095.0f;
+        v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+        LINEAR_TO_SRGB[i] = (GLubyte)(v * 255 + 0.5f);
+    }
+    for(int i = 0; i < 256; i++) {
+        float v = i / 255.0f;
+        SRGB_TO_LINEAR[i] = v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+// Windowed sinc for halving, taps at texel centers 0.5 .. MIP_KAISER_TAPS - 0.5 either side
+static void kaiser_weights(float *weights) {
+    float sum = 0;
+    for(int k = 0; k < MIP_KAISER_TAPS; k++) {
+        float t = k + 0.5f, x = t / MIP_KAISER_TAPS;
+        float sinc = sinf((float)M_PI * t / 2) / ((float)M_PI * t / 2);
+
+        // Bessel I0 by its series, for the window and its normalization
+        float window = 0, normal = 0, term = 1, termNormal = 1;
+        float y = MIP_KAISER_ALPHA * sqrtf(1 - x * x) / 2, z = MIP_KAISER_ALPHA / 2;
+        for(int i = 1; i < 20; i++) {
+            window += term;
+            normal += termNormal;
+            term *= y * y / (i * i);
+            termNormal *= z * z / (i * i);
+        }
+
+        weights[k] = sinc * window / normal;
+        sum += 2 * weights[k];
+    }
+    for(int k = 0; k < MIP_KAISER_TAPS; k++) {
+        weights[k] /= sum;
+    }
+}
+
+typedef struct MipJob {
+    const float *src;
+    float *dst;
+    int w, h, nw, nh; // source and destination size, Kaiser passes go w x h -> nw x h -> nw x nh
+    float weights[MIP_KAISER_TAPS];
+
+    GLubyte *out; // conversion back to bytes
+    int channels;
+    float alphaScale;
+} MipJob;
+
+#ifdef __SSE2__
+#define MIP_PIXEL __m128
+#define mip_load(p) _mm_loadu_ps(p)
+#define mip_store(p, v) _mm_storeu_ps(p, v)
+#define mip_add(a, b) _mm_add_ps(a, b)
+#define mip_scale(a, s) _mm_mul_ps(a, _mm_set1_ps(s))
+#define mip_zero() _mm_setzero_ps()
+#else
+typedef struct MipPixel { float v[4]; } MipPixel;
+#define MIP_PIXEL MipPixel
+static MipPixel mip_load(const float *p) { MipPixel r = {{p[0], p[1], p[2], p[3]}}; return r; }
+static void mip_store(float *p, MipPixel a) { memcpy(p, a.v, sizeof(a.v)); }
+static MipPixel mip_add(MipPixel a, MipPixel b) { for(int c = 0; c < 4; c++) a.v[c] += b.v[c]; return a; }
+static MipPixel mip_scale(MipPixel a, float s) { for(int c = 0; c < 4; c++) a.v[c] *= s; return a; }
+static MipPixel mip_zero() { MipPixel r = {{0, 0, 0, 0}}; return r; }
+#endif
+
+// 2x2 box, odd edges repeat their last texel
+static void box_mip_row(void *arg, int y) {
+    MipJob *job = (MipJob *)arg;
+    const float *row0 = job->src + (size_t)(2 * y < job->h ? 2 * y : job->h - 1) * job->w * 4;
+    const float *row1 = job->src + (size_t)(2 * y + 1 < job->h ? 2 * y + 1 : job->h - 1) * job->w * 4;
+    float *out = job->dst + (size_t)y * job->nw * 4;
+    for(int x = 0; x < job->nw; x++) {
+        int x0 = (2 * x < job->w ? 2 * x : job->w - 1) * 4, x1 = (2 * x + 1 < job->w ? 2 * x + 1 : job->w - 1) * 4;
+        MIP_PIXEL sum = mip_add(mip_add(mip_load(row0 + x0), mip_load(row0 + x1)), mip_add(mip_load(row1 + x0), mip_load(row1 + x1)));
+        mip_store(out + x * 4, mip_scale(sum, 0.25f));
+    }
+}
+
+// Horizontal Kaiser pass over one source row, clamped at the edges. A side of 1 is copied.
+static void kaiser_mip_row(void *arg, int y) {
+    MipJob *job = (MipJob *)arg;
+    const float *row = job->src + (size_t)y * job->w * 4;
+    float *out = job->dst + (size_t)y * job->nw * 4;
+    for(int x = 0; x < job->nw; x++) {
+        if(job->w == 1) {
+            mip_store(out, mip_load(row));
+            continue;
+        }
+        MIP_PIXEL sum = mip_zero();
+        for(int k = 0; k < MIP_KAISER_TAPS; k++) {
+            int left = 2 * x - k, right = 2 * x + 1 + k;
+            left = left < 0 ? 0 : left;
+            right = right < job->w ? right : job->w - 1;
+            sum = mip_add(sum, mip_scale(mip_add(mip_load(row + left * 4), mip_load(row + right * 4)), job->weights[k]));
+        }
+        mip_store(out + x * 4, sum);
+    }
+}
+
+// Vertical Kaiser pass producing one destination row
+static void kaiser_mip_column(void *arg, int y) {
+    MipJob *job = (MipJob *)arg;
+    float *out = job->dst + (size_t)y * job->nw * 4;
+    for(int x = 0; x < job->nw; x++) {
+        if(job->h == 1) {
+            mip_store(out + x * 4, mip_load(job->src + x * 4));
+            continue;
+        }
+        MIP_PIXEL sum = mip_zero();
+        for(int k = 0; k < MIP_KAISER_TAPS; k++) {
+            int top = 2 * y - k, bottom = 2 * y + 1 + k;
+            top = top < 0 ? 0 : top;
+            bottom = bottom < job->h ? bottom : job->h - 1;
+            MIP_PIXEL pair = mip_add(mip_load(job->src + ((size_t)top * job->nw + x) * 4), mip_load(job->src + ((size_t)bottom * job->nw + x) * 4));
+            sum = mip_add(sum, mip_scale(pair, job->weights[k]));
+        }
+        mip_store(out + x * 4, sum);
+    }
+}
+
+// Linear floats back to bytes, sRGB encoded when the chain is, alpha scaled for coverage
+static void store_mip_row(void *arg, int y) {
+    MipJob *job = (MipJob *)arg;
+    const float *in = job->src + (size_t)y * job->w * 4;
+    GLubyte *out = job->out + (size_t)y * job->w * job->channels;
+    for(int x = 0; x < job->w; x++, in += 4, out += job->channels) {
+        for(int c = 0; c < job->channels && c < 3; c++) {
+            float v = clamp_byte(in[c] * 255) / 255;
+            out[c] = MIP_SRGB ? LINEAR_TO_SRGB[(int)(v * 4095 + 0.5f)] : (GLubyte)(v * 255 + 0.5f);
+        }
+        if(job->channels == 4) {
+            out[3] = (GLubyte)(clamp_byte(in[3] * job->alphaScale * 255) + 0.5f);
+        }
+    }
+}
+
+static float alpha_coverage(const float *pixels, size_t n, float scale) {
+    size_t covered = 0;
+    for(size_t i = 0; i < n; i++) {
+        covered += pixels[i * 4 + 3] * scale >= MIP_ALPHA_CUTOFF;
+    }
+    return (float)covered / n;
+}
+
+// Scale keeping the share of texels passing the alpha test what it was at the top level
+static float coverage_scale(const float *pixels, size_t n, float target) {
+    float lo = 0, hi = 4;
+    for(int i = 0; i < 16; i++) {
+        float mid = (lo + hi) / 2;
+        if(alpha_coverage(pixels, n, mid) < target) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return hi;
+}
+
+// The levels from first on one after the other, bytes with the given channel count
+static GLubyte *build_mip_chain(const TextureData *tex, int channels, int first, int *levels, size_t *size) {
+    init_srgb_tables();
+
+    int w = tex->w, h = tex->h, bytes = tex->bpp / 8;
+    *levels = MIPMAP ? mip_levels(w, h) : 1;
+    *size = 0;
+    for(int i = first; i < *levels; i++) {
+        *size += (size_t)(w >> i > 0 ? w >> i : 1) * (h >> i > 0 ? h >> i : 1) * channels;
+    }
+
+    GLubyte *chain = (GLubyte *)malloc(*size);
+    float *level = (float *)malloc((size_t)w * h * 4 * sizeof(float));
+    float *next = (float *)malloc((size_t)(w + 1) / 2 * h * 4 * sizeof(float));
+    float *temp = (float *)malloc((size_t)(w + 1) / 2 * h * 4 * sizeof(float));
+    if(!chain || !level || !next || !temp) {
+        free(chain);
+        free(level);
+        free(next);
+        free(temp);
+        return NULL;
+    }
+
+    // 8 bit gray goes to all three colors, alpha is always linear
+    for(size_t i = 0; i < (size_t)w * h; i++) {
+        const GLubyte *p = tex->imageData + i * bytes;
+        for(int c = 0; c < 3; c++) {
+            GLubyte v = bytes > 1 ? p[c] : p[0];
+            level[i * 4 + c] = MIP_SRGB ? SRGB_TO_LINEAR[v] : v / 255.0f;
+        }
+        level[i * 4 + 3] = bytes > 3 ? p[3] / 255.0f : 1;
+    }
+
+    float coverage = MIP_ALPHA_CUTOFF > 0 && bytes == 4 ? alpha_coverage(level, (size_t)w * h, 1) : 0;
+
+    MipJob job;
+    kaiser_weights(job.weights);
+    job.channels = channels;
+    GLubyte *out = chain;
+    for(int i = 0; i < *levels; i++) {
+        job.src = level;
+        job.w = w;
+        job.h = h;
+        if(i >= first) {
+            job.out = out;
+            job.alphaScale = coverage > 0 && i > 0 ? coverage_scale(level, (size_t)w * h, coverage) : 1;
+            parallel_for(store_mip_row, &job, h);
+            out += (size_t)w * h * channels;
+        }
+
+        if(i + 1 == *levels) {
+            break;
+        }
+
+        job.nw = w > 1 ? w / 2 : 1;
+        job.nh = h > 1 ? h / 2 : 1;
+        if(MIP_FILTER == MIP_KAISER) {
+            job.dst = temp;
+            parallel_for(kaiser_mip_row, &job, h);
+            job.src = temp;
+            job.dst = next;
+            parallel_for(kaiser_mip_column, &job, job.nh);
+        }
+        else {
+            job.dst = next;
+            parallel_for(box_mip_row, &job, job.nh);
+        }
+
+        float *t = level;
+        level = next;
+        next = t;
+        w = job.nw;
+        h = job.nh;
+    }
+
+    free(level);
+    free(next);
+    free(temp);
+    return chain;
+}
+
+static GLenum default_compression(GLuint bpp) {
+    return bpp == 8 ? GL_COMPRESSED_RED_RGTC1 : bpp == 24 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+static bool is_compressed(GLenum format) {
+    return format != GL_R8 && format != GL_RGB8 && format != GL_RGBA8;
+}
+
+static int format_channels(GLenum format) {
+    return format == GL_R8 ? 1 : format == GL_RGB8 ? 3 : 4;
+}
+
+static size_t level_size(GLenum format, int w, int h) {
+    return is_compressed(format) ? compressed_level_size(format, w, h) : (size_t)w * h * format_channels(format);
+}
+
+static GLuint dds_four_cc(GLenum format) {
+    const char *code = format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? "DXT1" : format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? "DXT5" :
+        format == GL_COMPRESSED_RED_RGTC1 ? "ATI1" : "ATI2";
+    return code[0] | code[1] << 8 | code[2] << 16 | (GLuint)code[3] << 24;
+}
+
+// Identifies the mip settings a cache was built with, 0 in caches written by other tools
+static GLuint mip_settings() {
+    return 1 + MIP_FILTER + 2 * MIP_SRGB + 4 * (GLuint)(MIP_ALPHA_CUTOFF * 255 + 0.5f) + 1024 * MIPMAP;
+}
+
+static void texture_cache_name(const char *n, char *cache, size_t size) {
+    snprintf(cache, size, "%s%s", n, TEXTURE_CACHE_EXTENSION);
+}
+
+// Magic, the 124 byte header and every level after the other, as DDS with a FourCC
+// or uncompressed R, RGB or RGBA in memory order
+static bool write_texture_cache(const char *cache, GLenum format, int quality, int w, int h, int levels, const GLubyte *data, size_t size) {
+    GLuint header[32];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "DDS ", 4);
+    header[1] = 124;
+    header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | (is_compressed(format) ? 0x80000 : 0x8); // caps, height, width, pixel format, mip count, linear size or pitch
+    header[3] = h;
+    header[4] = w;
+    header[5] = (GLuint)(is_compressed(format) ? compressed_level_size(format, w, h) : (size_t)w * format_channels(format));
+    header[7] = levels;
+    header[8] = quality + 1; // reserved, 0 in caches written by other tools
+    header[9] = mip_settings();
+    header[19] = 32;
+    if(is_compressed(format)) {
+        header[20] = 0x4; // FourCC
+        header[21] = dds_four_cc(format);
+    }
+    else {
+        int channels = format_channels(format);
+        header[20] = channels == 1 ? 0x20000 : channels == 3 ? 0x40 : 0x41; // luminance, RGB, RGB with alpha
+        header[22] = channels * 8;
+        header[23] = 0xff;
+        header[24] = channels > 1 ? 0xff00 : 0;
+        header[25] = channels > 1 ? 0xff0000 : 0;
+        header[26] = channels > 3 ? 0xff000000 : 0;
+    }
+    header[27] = 0x1000 | 0x8 | 0x400000; // texture, complex, mipmap
+
+    // Written next to the cache and renamed over it, managed textures keep mapping the old file
+    char temp[1040];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", cache);
+    int fd = mkstemp(temp);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(!file) {
+        if(fd >= 0) {
+            close(fd);
+            remove(temp);
+        }
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(data, 1, size, file) == size;
+    ok &= fclose(file) == 0;
+    ok = ok && rename(temp, cache) == 0;
+    if(!ok) {
+        remove(temp);
+    }
+    return ok;
+}
+
+// The filtered chain, compressed level by level for block formats
+static GLubyte *build_texture_chain(const TextureData *tex, GLenum format, int quality, int *levels, size_t *size) {
+    if(!is_compressed(format)) {
+        return build_mip_chain(tex, format_channels(format), 0, levels, size);
+    }
+
+    size_t rgbaSize;
+    GLubyte *rgba = build_mip_chain(tex, 4, 0, levels, &rgbaSize);
+    if(!rgba) {
+        return NULL;
+    }
+
+    *size = 0;
+    for(int i = 0; i < *levels; i++) {
+        *size += compressed_level_size(format, tex->w >> i > 0 ? tex->w >> i : 1, tex->h >> i > 0 ? tex->h >> i : 1);
+    }
+
+    GLubyte *blocks = (GLubyte *)malloc(*size), *out = blocks;
+    const GLubyte *in = rgba;
+    for(int i = 0; i < *levels && blocks; i++) {
+        int w = tex->w >> i > 0 ? tex->w >> i : 1, h = tex->h >> i > 0 ? tex->h >> i : 1;
+        size_t levelSize;
+        GLubyte *level = glUtilitiesCompressTexture(in, w, h, format, quality, &levelSize);
+        memcpy(out, level, levelSize);
+        free(level);
+        out += levelSize;
+        in += (size_t)w * h * 4;
+    }
+    free(rgba);
+    return blocks;
+}
+
+// Level copies only, no glGenerateMipmap
+static void upload_texture_chain(TextureData *tex, GLenum format, int levels, const GLubyte *data) {
+    levels = MIPMAP ? levels : 1;
+    tex->texID = glUtilitiesCreateTexture(tex->w, tex->h, format, levels);
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for(int i = 0; i < levels; i++) {
+        int w = tex->w >> i > 0 ? tex->w >> i : 1, h = tex->h >> i > 0 ? tex->h >> i : 1;
+        size_t size = level_size(format, w, h);
+        if(is_compressed(format)) {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, w, h, format, (GLsizei)size, data);
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, w, h, format == GL_R8 ? GL_RED : format == GL_RGB8 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+        }
+        data += size;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+}
+
+static GLenum resolve_cache_format(GLenum format, GLuint bpp) {
+    if(format == GL_RGBA) {
+        return bpp == 8 ? GL_R8 : bpp == 24 ? GL_RGB8 : GL_RGBA8;
+    }
+    return format ? format : default_compression(bpp);
+}
+
+bool glUtilitiesCompressTGA(const char *n, GLenum format, int quality) {
+    TextureData tex;
+    memset(&tex, 0, sizeof(tex));
+    if(!glUtilitiesLoadTGATextureData(n, &tex)) {
+        return false;
+    }
+
+    format = resolve_cache_format(format, tex.bpp);
+    int levels;
+    size_t size;
+    GLubyte *data = build_texture_chain(&tex, format, quality, &levels, &size);
+    free(tex.imageData);
+
+    char cache[1024];
+    texture_cache_name(n, cache, sizeof(cache));
+    bool ok = data && write_texture_cache(cache, format, quality, tex.w, tex.h, levels, data, size);
+    free(data);
+    return ok;
+}
+
+typedef struct TextureCache {
+    GLubyte *data; // the mapped file, levels start 128 bytes in
+    size_t size;
+    GLenum format;
+    int w, h, levels;
+} TextureCache;
+
+// Maps the cache if it is newer than the TGA, built the same way and at least as good as asked for
+static bool map_texture_cache(const char *n, GLenum format, int quality, TextureCache *cache) {
+    char name[1024];
+    texture_cache_name(n, name, sizeof(name));
+
+    struct stat source, info;
+    int file = open(name, O_RDONLY);
+    if(file < 0) {
+        return false;
+    }
+    if(fstat(file, &info) != 0 || info.st_size < 128 || (stat(n, &source) == 0 && source.st_mtime > info.st_mtime)) {
+        close(file);
+        return false;
+    }
+    GLubyte *data = (GLubyte *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+
+    const GLuint *header = (const GLuint *)data;
+    const GLenum formats[4] = {GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RED_RGTC1, GL_COMPRESSED_RG_RGTC2};
+    GLenum cached = 0;
+    if(header[20] & 0x4) {
+        for(int i = 0; i < 4; i++) {
+            cached = header[21] == dds_four_cc(formats[i]) ? formats[i] : cached;
+        }
+    }
+    else if(header[23] == 0xff && (header[22] == 8 || header[22] == 24 || header[22] == 32)) {
+        cached = header[22] == 8 ? GL_R8 : header[22] == 24 ? GL_RGB8 : GL_RGBA8;
+    }
+
+    bool uncompressed = format == GL_RGBA && cached && !is_compressed(cached);
+    int w = header[4], h = header[3], levels = header[7] > 0 ? header[7] : 1;
+    bool ok = memcmp(data, "DDS ", 4) == 0 && header[1] == 124 && cached && ((!format && is_compressed(cached)) || cached == format || uncompressed) &&
+        (header[8] == 0 || (int)header[8] - 1 >= quality) && (header[9] == 0 || header[9] == mip_settings()) &&
+        w > 0 && h > 0 && levels <= mip_levels(w, h);
+
+    size_t size = 0;
+    for(int i = 0; i < levels && ok; i++) {
+        size += level_size(cached, w >> i > 0 ? w >> i : 1, h >> i > 0 ? h >> i : 1);
+    }
+    ok &= (size_t)info.st_size >= 128 + size;
+
+    if(!ok) {
+        munmap(data, info.st_size);
+        return false;
+    }
+
+    cache->data = data;
+    cache->size = info.st_size;
+    cache->format = cached;
+    cache->w = w;
+    cache->h = h;
+    cache->levels = levels;
+    return true;
+}
+
+static bool load_texture_cache(const char *n, TextureData *tex, GLenum format, int quality) {
+    TextureCache cache;
+    if(!map_texture_cache(n, format, quality, &cache)) {
+        return false;
+    }
+
+    tex->w = cache.w;
+    tex->h = cache.h;
+    tex->bpp = cache.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || cache.format == GL_RGB8 ? 24 : cache.format == GL_COMPRESSED_RED_RGTC1 || cache.format == GL_R8 ? 8 : 32;
+    tex->imageData = NULL;
+    upload_texture_chain(tex, cache.format, cache.levels, cache.data + 128);
+    munmap(cache.data, cache.size);
+    return true;
+}
+
+bool glUtilitiesLoadTGATextureCompressed(const char *n, TextureData *tex, GLenum format, int quality) {
+    if(load_texture_cache(n, tex, format, quality)) {
+        return true;
+    }
+
+    memset(tex, 0, sizeof(TextureData));
+    if(!glUtilitiesLoadTGATextureData(n, tex)) {
+        return false;
+    }
+
+    format = resolve_cache_format(format, tex->bpp);
+    int levels;
+    size_t size;
+    GLubyte *data = build_texture_chain(tex, format, quality, &levels, &size);
+    free(tex->imageData);
+    tex->imageData = NULL;
+    if(!data) {
+        return false;
+    }
+
+    char cache[1024];
+    texture_cache_name(n, cache, sizeof(cache));
+    if(!write_texture_cache(cache, format, quality, tex->w, tex->h, levels, data, size)) {
+        fprintf(stderr, "Could not write the texture cache %s\n", cache);
+    }
+
+    upload_texture_chain(tex, format, levels, data);
+    free(data);
+    return true;
+}
+
+bool glUtilitiesLoadTGATextureMipmapped(const char *n, TextureData *tex) {
+    return glUtilitiesLoadTGATextureCompressed(n, tex, GL_RGBA, 0);
+}
+
+static size_t TEXTURE_BUDGET = 0; // 0 is unlimited
+static size_t TEXTURE_MEMORY = 0;
+static unsigned TEXTURE_FRAME = 1;
+static ManagedTexture *MANAGED_TEXTURES = NULL;
+
+typedef struct TextureStream {
+    PoolJob job;
+    ManagedTexture *t;
+    int first;
+    GLubyte *data;
+} TextureStream;
+
+void glUtilitiesSetTextureBudget(size_t bytes) {
+    TEXTURE_BUDGET = bytes;
+}
+
+size_t glUtilitiesTextureMemory() {
+    return TEXTURE_MEMORY;
+}
+
+static int level_width(const ManagedTexture *t, int level) {
+    return t->w >> level > 0 ? t->w >> level : 1;
+}
+
+static int level_height(const ManagedTexture *t, int level) {
+    return t->h >> level > 0 ? t->h >> level : 1;
+}
+
+static size_t managed_level_offset(const ManagedTexture *t, int level) {
+    size_t offset = 128;
+    for(int i = 0; i < level; i++) {
+        offset += level_size(t->format, level_width(t, i), level_height(t, i));
+    }
+    return offset;
+}
+
+// First level small enough to stay resident when a texture is dropped to low mips
+static int managed_floor_level(const ManagedTexture *t) {
+    int level = 0;
+    while(level + 1 < t->levels && (level_width(t, level) > TEXTURE_RESIDENT_SIZE || level_height(t, level) > TEXTURE_RESIDENT_SIZE)) {
+        level++;
+    }
+    return level;
+}
+
+// Replaces the texture with one holding the levels from first on, data as laid out in the cache
+static void set_managed_levels(ManagedTexture *t, int first, const GLubyte *data) {
+    if(t->texID) {
+        glDeleteTextures(1, &t->texID);
+        t->texID = 0;
+    }
+    TEXTURE_MEMORY -= t->bytes;
+    t->bytes = 0;
+    t->baseLevel = t->levels;
+
+    if(first < t->levels) {
+        TextureData tex;
+        memset(&tex, 0, sizeof(tex));
+        tex.w = level_width(t, first);
+        tex.h = level_height(t, first);
+        upload_texture_chain(&tex, t->format, t->levels - first, data);
+
+        t->texID = tex.texID;
+        t->baseLevel = first;
+        t->bytes = managed_level_offset(t, t->levels) - managed_level_offset(t, first);
+        TEXTURE_MEMORY += t->bytes;
+    }
+}
+
+// Copies the levels out of the mapping on a worker, the page faults reading the file happen there
+static void stream_managed_levels(void *arg, int unused) {
+    (void)unused;
+    TextureStream *s = (TextureStream *)arg;
+    size_t offset = managed_level_offset(s->t, s->first);
+    size_t size = managed_level_offset(s->t, s->t->levels) - offset;
+    s->data = (GLubyte *)malloc(size);
+    if(s->data) {
+        memcpy(s->data, s->t->cache + offset, size);
+    }
+}
+
+static void request_managed_levels(ManagedTexture *t, int first) {
+    if(t->streaming || first >= t->baseLevel) {
+        return;
     }
+
+    TextureStream *s = (TextureStream *)calloc(1, sizeof(TextureStream));
+    s->t = t;
+    s->first = first;
+    t->streaming = s;
+    if(glUtilitiesGetWorkerThreads() > 0) {
+        start_job(&s->job, stream_managed_levels, s, 1);
+    }
+}
+
+static bool stream_finished(TextureStream *s) {
+    pthread_mutex_lock(&POOL_MUTEX);
+    bool done = s->job.done == s->job.count;
+    pthread_mutex_unlock(&POOL_MUTEX);
+    return done;
+}
+
+static void finish_managed_stream(ManagedTexture *t) {
+    TextureStream *s = (TextureStream *)t->streaming;
+    if(s->job.func) {
+        wait_job(&s->job);
+    }
+    else {
+        stream_managed_levels(s, 0);
+    }
+
+    if(s->data) {
+        set_managed_levels(t, s->first, s->data);
+        free(s->data);
+    }
+    free(s);
+    t->streaming = NULL;
+}
+
+static void discard_managed_stream(ManagedTexture *t) {
+    TextureStream *s = (TextureStream *)t->streaming;
+    if(s->job.func) {
+        wait_job(&s->job);
+    }
+    free(s->data);
+    free(s);
+    t->streaming = NULL;
+}
+
+ManagedTexture *glUtilitiesManageTexture(const char *n, GLenum format, int quality) {
+    TextureCache cache;
+    if(!map_texture_cache(n, format, quality, &cache)) {
+        if(!glUtilitiesCompressTGA(n, format, quality) || !map_texture_cache(n, format, quality, &cache)) {
+            fprintf(stderr, "Could not build the texture cache for %s\n", n);
+            return NULL;
+        }
+    }
+
+    ManagedTexture *t = (ManagedTexture *)calloc(1, sizeof(ManagedTexture));
+    t->format = cache.format;
+    t->w = cache.w;
+    t->h = cache.h;
+    t->levels = cache.levels;
+    t->baseLevel = t->levels;
+    t->cache = cache.data;
+    t->cacheSize = cache.size;
+    t->lastUse = TEXTURE_FRAME;
+    t->next = MANAGED_TEXTURES;
+    MANAGED_TEXTURES = t;
+
+    // The small levels right away, the rest streams in
+    int floor = managed_floor_level(t);
+    set_managed_levels(t, floor, t->cache + managed_level_offset(t, floor));
+    request_managed_levels(t, 0);
+    return t;
+}
+
+void glUtilitiesBindManagedTexture(ManagedTexture *t, int unit) {
+    t->lastUse = TEXTURE_FRAME;
+    if(t->baseLevel == t->levels) {
+        // Fully evicted, the small levels come back at once so there is something to sample
+        int floor = managed_floor_level(t);
+        set_managed_levels(t, floor, t->cache + managed_level_offset(t, floor));
+    }
+    if(t->baseLevel > 0) {
+        request_managed_levels(t, 0);
+    }
+
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, t->texID);
+}
+
+static int compare_last_use(const void *a, const void *b) {
+    unsigned x = (*(ManagedTexture *const *)a)->lastUse, y = (*(ManagedTexture *const *)b)->lastUse;
+    return x < y ? -1 : x > y;
+}
+
+// Least recently bound first, down to low mips before anything goes entirely.
+// Textures bound this frame stay.
+static void enforce_texture_budget() {
+    if(TEXTURE_BUDGET == 0 || TEXTURE_MEMORY <= TEXTURE_BUDGET) {
+        return;
+    }
+
+    int count = 0;
+    for(ManagedTexture *t = MANAGED_TEXTURES; t; t = t->next) {
+        count++;
+    }
+    ManagedTexture **order = (ManagedTexture **)malloc(count * sizeof(ManagedTexture *));
+    count = 0;
+    for(ManagedTexture *t = MANAGED_TEXTURES; t; t = t->next) {
+        if(t->lastUse < TEXTURE_FRAME && !t->streaming) {
+            order[count++] = t;
+        }
+    }
+    qsort(order, count, sizeof(ManagedTexture *), compare_last_use);
+
+    for(int i = 0; i < count && TEXTURE_MEMORY > TEXTURE_BUDGET; i++) {
+        int floor = managed_floor_level(order[i]);
+        if(order[i]->baseLevel < floor) {
+            set_managed_levels(order[i], floor, order[i]->cache + managed_level_offset(order[i], floor));
+        }
+    }
+    for(int i = 0; i < count && TEXTURE_MEMORY > TEXTURE_BUDGET; i++) {
+        set_managed_levels(order[i], order[i]->levels, NULL);
+    }
+    free(order);
+}
+
+void glUtilitiesUpdateTextureManager() {
+    for(ManagedTexture *t = MANAGED_TEXTURES; t; t = t->next) {
+        TextureStream *s = (TextureStream *)t->streaming;
+        if(s && (!s->job.func || stream_finished(s))) {
+            size_t grow = managed_level_offset(t, t->levels) - managed_level_offset(t, s->first) - t->bytes;
+            if(TEXTURE_BUDGET && t->lastUse < TEXTURE_FRAME && TEXTURE_MEMORY + grow > TEXTURE_BUDGET) {
+                // Not bound this frame, the budget pass would evict it again. It is requested anew once bound.
+                discard_managed_stream(t);
+            }
+            else {
+                finish_managed_stream(t);
+            }
+        }
+    }
+
+    enforce_texture_budget();
+    TEXTURE_FRAME++;
+}
+
+void glUtilitiesReleaseManagedTexture(ManagedTexture *t) {
+    if(!t) {
+        return;
+    }
+
+    ManagedTexture **p = &MANAGED_TEXTURES;
+    while(*p != t) {
+        p = &(*p)->next;
+    }
+    *p = t->next;
+
+    if(t->streaming) {
+        discard_managed_stream(t);
+    }
+    set_managed_levels(t, t->levels, NULL);
+    munmap(t->cache, t->cacheSize);
+    free(t);
+}
+
+static GLenum texture_format(GLuint bpp) {
+    return bpp == 8 ? GL_RED : bpp == 24 ? GL_RGB : GL_RGBA;
+}
+
+GLuint glUtilitiesBuildTextureArray(TextureData *textures, int count, TextureRegion *regions) {
+    if(count <= 0) {
+        return 0;
+    }
+
+    GLuint w = textures[0].w, h = textures[0].h, bpp = textures[0].bpp;
+    GLenum format = texture_format(bpp);
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, w, h, count, 0, format, GL_UNSIGNED_BYTE, NULL);
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB rows are not padded
+
+    for(int i = 0; i < count; i++) {
+        memset(&regions[i], 0, sizeof(TextureRegion));
+        if(textures[i].w != w || textures[i].h != h || textures[i].bpp != bpp || !textures[i].imageData) {
+            fprintf(stderr, "Texture %d does not match the %ux%u %u bit layers of the array\n", i, w, h, bpp);
+            continue;
+        }
+
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, w, h, 1, format, GL_UNSIGNED_BYTE, textures[i].imageData);
+        regions[i].texID = tex;
+        regions[i].target = GL_TEXTURE_2D_ARRAY;
+        regions[i].layer = i;
+        regions[i].u1 = regions[i].v1 = 1;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if(MIPMAP) {
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    }
+
+    return tex;
+}
+
+typedef struct SkylineNode {
+    int x, y, w;
+} SkylineNode;
+
+// Bottom-left skyline packing of w x h slots. Returns how many were placed, with partial set
+// slots that do not fit get x = -1 and the rest goes on, otherwise it stops at the first miss.
+static int skyline_pack(int width, int height, int *ws, int *hs, int *order, int count, bool partial, int *xs, int *ys) {
+    SkylineNode *nodes = (SkylineNode *)malloc(sizeof(SkylineNode) * (count * 2 + 1));
+    int numNodes = 1, placed = 0;
+    nodes[0].x = 0;
+    nodes[0].y = 0;
+    nodes[0].w = width;
+
+    for(int k = 0; k < count; k++) {
+        int r = order[k];
+        int bestNode = -1, bestY = height, bestX = 0;
+
+        // Lowest resting place, ties go left
+        for(int i = 0; i < numNodes; i++) {
+            int x = nodes[i].x;
+            if(x + ws[r] > width) {
+                break;
+            }
+
+            int y = 0, left = ws[r];
+            for(int j = i; left > 0; j++) {
+                y = nodes[j].y > y ? nodes[j].y : y;
+                left -= nodes[j].w;
+            }
+
+            if(y + hs[r] <= height && y < bestY) {
+                bestNode = i;
+                bestY = y;
+                bestX = x;
+            }
+        }
+
+        if(bestNode < 0) {
+            xs[r] = -1;
+            if(!partial) {
+                break;
+            }
+            continue;
+        }
+        xs[r] = bestX;
+        ys[r] = bestY;
+        placed++;
+
+        // New segment on top of the slot, the ones it covers are cut back
+        memmove(&nodes[bestNode + 1], &nodes[bestNode], sizeof(SkylineNode) * (numNodes - bestNode));
+        numNodes++;
+        nodes[bestNode].x = bestX;
+        nodes[bestNode].y = bestY + hs[r];
+        nodes[bestNode].w = ws[r];
+
+        int end = bestX + ws[r];
+        int i = bestNode + 1;
+        while(i < numNodes && nodes[i].x < end) {
+            int shrink = end - nodes[i].x;
+            if(shrink >= nodes[i].w) {
+                memmove(&nodes[i], &nodes[i + 1], sizeof(SkylineNode) * (numNodes - i - 1));
+                numNodes--;
+            }
+            else {
+                nodes[i].x += shrink;
+                nodes[i].w -= shrink;
+                break;
+            }
+        }
+
+        for(i = 0; i + 1 < numNodes; i++) {
+            if(nodes[i].y == nodes[i + 1].y) {
+                nodes[i].w += nodes[i + 1].w;
+                memmove(&nodes[i + 1], &nodes[i + 2], sizeof(SkylineNode) * (numNodes - i - 2));
+                numNodes--;
+                i--;
+            }
+        }
+    }
+
+    free(nodes);
+    return placed;
+}
+
+GLuint glUtilitiesBuildTextureAtlas(TextureData *textures, int count, int maxSize, int padding, TextureRegion *regions) {
+    if(count <= 0) {
+        return 0;
+    }
+
+    // Slots are aligned to the largest power of two within the padding, mips stop at that size
+    // so no level mixes texels of two images
+    int align = 1, levels = 1;
+    while(align * 2 <= padding) {
+        align *= 2;
+        levels++;
+    }
+
+    int *ws = (int *)malloc(sizeof(int) * count * 5);
+    int *hs = ws + count, *xs = ws + count * 2, *ys = ws + count * 3, *order = ws + count * 4;
+    int packed = 0;
+    long area = 0;
+    for(int i = 0; i < count; i++) {
+        memset(&regions[i], 0, sizeof(TextureRegion));
+        if(!textures[i].imageData) {
+            continue;
+        }
+
+        ws[i] = (textures[i].w + 2 * padding + align - 1) / align * align;
+        hs[i] = (textures[i].h + 2 * padding + align - 1) / align * align;
+        area += (long)ws[i] * hs[i];
+
+        // Tallest first
+        int k = packed++;
+        while(k > 0 && hs[order[k - 1]] < hs[i]) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    // Power of two sides grown in turn, from the first size that could hold the area
+    int limit = 1;
+    while(limit * 2 <= maxSize) {
+        limit *= 2;
+    }
+    int width = 1, height = 1;
+    for(;;) {
+        if(width * height >= area && skyline_pack(width, height, ws, hs, order, packed, false, xs, ys) == packed) {
+            break;
+        }
+        if(width >= limit && height >= limit) {
+            skyline_pack(width, height, ws, hs, order, packed, true, xs, ys); // what fits at full size
+            break;
+        }
+
+        if(width <= height && width < limit) {
+            width *= 2;
+        }
+        else {
+            height *= 2;
+        }
+    }
+
+    // Everything as RGBA with the edges extruded into the gutters
+    GLubyte *pixels = (GLubyte *)calloc((size_t)width * height, 4);
+    for(int k = 0; k < packed; k++) {
+        int i = order[k];
+        TextureData *t = &textures[i];
+        if(xs[i] < 0) {
+            fprintf(stderr, "Texture %d does not fit in a %dx%d atlas\n", i, width, height);
+            continue;
+        }
+
+        int bytes = t->bpp / 8;
+        for(int y = -padding; y < (int)t->h + padding; y++) {
+            int sy = y < 0 ? 0 : y >= (int)t->h ? (int)t->h - 1 : y;
+            GLubyte *dst = pixels + ((size_t)(ys[i] + padding + y) * width + xs[i]) * 4;
+            for(int x = -padding; x < (int)t->w + padding; x++) {
+                int sx = x < 0 ? 0 : x >= (int)t->w ? (int)t->w - 1 : x;
+                GLubyte *src = t->imageData + ((size_t)sy * t->w + sx) * bytes;
+                GLubyte *p = dst + (padding + x) * 4;
+                p[0] = src[0];
+                p[1] = bytes >= 3 ? src[1] : src[0];
+                p[2] = bytes >= 3 ? src[2] : src[0];
+                p[3] = bytes == 4 ? src[3] : 255;
+            }
+        }
+
+        regions[i].target = GL_TEXTURE_2D;
+        regions[i].u0 = (GLfloat)(xs[i] + padding) / width;
+        regions[i].v0 = (GLfloat)(ys[i] + padding) / height;
+        regions[i].u1 = (GLfloat)(xs[i] + padding + t->w) / width;
+        regions[i].v1 = (GLfloat)(ys[i] + padding + t->h) / height;
+    }
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if(MIPMAP && levels > 1) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    }
+
+    for(int k = 0; k < packed; k++) {
+        if(xs[order[k]] >= 0) {
+            regions[order[k]].texID = tex;
+        }
+    }
+
+    free(pixels);
+    free(ws);
+    return tex;
 }
 
 int glUtilitiesSaveTGAData(char	*n, short int w, short int h, unsigned char pixelDepth, unsigned char *imageData) {
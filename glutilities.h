@@ -83,6 +83,41 @@ void glUtilitiesExit();
 
 /*
 
+THREAD UTILITIES
+
+*/
+
+void glUtilitiesSetWorkerThreads(int n); // -1 = one per core (minus the calling thread), 0 = run everything serially
+int  glUtilitiesGetWorkerThreads();
+
+/*
+
+STREAM BUFFERS
+
+*/
+
+// Ring for data rewritten every frame. Persistently mapped when GL 4.4 / ARB_buffer_storage is
+// available, regions are reused once the fence of the frame that wrote them has passed.
+// Otherwise ranges are mapped unsynchronized and the buffer is orphaned when it wraps.
+typedef struct StreamBuffer {
+    GLuint buffer; // bind to any target, e.g. GL_ARRAY_BUFFER or glBindBufferRange(GL_UNIFORM_BUFFER, ...)
+    GLsizeiptr size;
+    GLintptr head;
+    char *mapping;
+    char mapped;
+    int region, dirty;
+    GLsync fences[STREAM_REGIONS];
+    struct StreamBuffer *next;
+} StreamBuffer;
+
+StreamBuffer *glUtilitiesCreateStreamBuffer(GLsizeiptr size);
+void *glUtilitiesStreamAlloc(StreamBuffer *s, GLsizeiptr size, GLsizeiptr alignment, GLintptr *offset); // Write pointer, draw from it before the ring comes around
+void glUtilitiesStreamCommit(StreamBuffer *s); // Before drawing from the written range
+void glUtilitiesStreamFence(StreamBuffer *s); // End of frame, glUtilitiesSwapBuffers does it for all
+void glUtilitiesDisposeStreamBuffer(StreamBuffer *s);
+
+/*
+
 SHADER UTILITIES
 
 */
@@ -132,7 +167,60 @@ typedef struct Material {
 	char map_Ka[255], map_Kd[255], map_Ks[255], map_Ke[255], map_Ns[255], map_d[255], map_bump[255];
 } Material, *MaterialPtr, **MaterialHandle;
 
-typedef struct {
+typedef struct ModelLOD {
+  GLuint* indexArray; // indexes the parent model's vertices
+  int numIndices;
+  float error; // max geometric deviation from the full model, in model units
+  GLuint ib;
+} ModelLOD;
+
+typedef struct ModelCluster {
+  int indexOffset; // into indexArray
+  int numIndices;
+  Vector3 center;
+  float radius;
+  Vector3 coneApex, coneAxis;
+  float coneCutoff; // back-facing when dot(normalize(apex - eye), axis) >= cutoff, > 1 never
+} ModelCluster;
+
+typedef struct ModelBVHNode {
+  Vector3 min, max;
+  int first; // left child (the right one follows it), or the leaf's packet
+  int count; // triangles in a leaf, 0 for inner nodes
+} ModelBVHNode;
+
+typedef struct ModelBVH {
+  ModelBVHNode *nodes; // nodes[0] is the root
+  int numNodes;
+  float *packets; // per leaf 4 triangles as vertex, edge1, edge2, 36 floats stored x0-3 y0-3 z0-3
+  int *triangles; // 4 per packet, -1 for padding
+  int numPackets;
+  int stale; // MODEL_POSITIONS refits, MODEL_INDICES rebuilds on the next query
+} ModelBVH;
+
+typedef struct ModelHit {
+  Vector3 position;
+  Vector3 normal; // faces the ray, or points from the triangle to the sphere center
+  int triangle; // indexArray[3 * triangle] is its first corner
+  float distance; // ray parameter in units of the direction's length, or distance to the sphere center
+} ModelHit;
+
+struct MeshArena;
+struct TextureRegion;
+
+typedef struct ModelDirtySpans {
+  int first[MAX_DIRTY_SPANS], count[MAX_DIRTY_SPANS];
+  int numSpans;
+} ModelDirtySpans;
+
+typedef struct ModelBinding {
+  GLuint program;
+  GLuint vao; // attributes set up for program
+  int layout;
+  char *vertexVar, *normalVar, *textureVar;
+} ModelBinding;
+
+typedef struct Model {
   Vector2* texCoordArray;
 
   Vector3* vertexArray;
@@ -150,24 +238,176 @@ typedef struct {
   GLuint vb, ib, nb, tb; // VBOs
   
   Material *material;
+
+  int vertexFormat; // COMPRESS_* and VERTEX_INTERLEAVED flags the GPU copy was packed with
+  GLenum indexType;
+  Vector3 decodeOffset, decodeScale; // position = decodeOffset + decodeScale * attribute
+
+  ModelDirtySpans dirty[4]; // changed positions, normals, texcoords and indices not yet uploaded
+
+  ModelBinding *bindings; // VAOs per program used to draw the model, rebuilt on reload
+  int numBindings;
+
+  struct MeshArena *arena; // shared owner of vao/vb/ib, NULL when the model has its own
+  GLint baseVertex; // first vertex in the arena's vb
+  GLintptr indexOffset; // bytes into ib
+  int arenaVertices, arenaIndexWords; // allocated range sizes
+
+  ModelCluster *clusters; // meshlets, contiguous ranges of indexArray
+  int numClusters;
+
+  ModelLOD *lods; // coarser levels, lods[0] is the first step down
+  int numLods;
+
+  ModelBVH *bvh; // triangle hierarchy for queries, NULL until glUtilitiesBuildModelBVH
+
+  GLuint edgeIb; // unique edges as GL_LINES pairs, built by the first wireframe draw
+  int numEdgeIndices;
+
+  Vector3 boundsMin, boundsMax; // model space box
+  Vector3 boundsCenter;
+  float boundsRadius;
 } Model;
 
+void glUtilitiesSetNormalCreaseAngle(float degrees); // Generated normals split at sharper edges, 0 = smooth everything
+
 Model** glUtilitiesLoadModelSet(const char* n); // Multi-part Object
 Model* glUtilitiesLoadModel(const char* n); // Single Object
 
-void glUtilitiesDrawWireframe(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar);
+void glUtilitiesDrawModelLOD(Model *m, Matrix4 projection, Matrix4 modelView, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar);
+void glUtilitiesDrawModelClusters(Model *m, Matrix4 projection, Matrix4 modelView, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar);
+// One draw for count copies, transformVar is a mat4 attribute and colorVar an optional vec3 attribute
+void glUtilitiesDrawModelInstanced(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar, const char *transformVar, Matrix4 *transforms, const char *colorVar, Vector3 *colors, int count);
+// Render queue: packets are sorted by pass, transparency (material Tr > 0, blended back to front),
+// program, texture, VAO and depth. Runs sharing state go out as one glMultiDrawElementsIndirect
+// (GL 4.3) or as direct draws. Shaders read the packet's transform like glUtilitiesDrawModelInstanced.
+void glUtilitiesBeginQueue(Matrix4 worldToView, const char* vertexVar, const char* normalVar, const char* textureVar, const char *transformVar);
+void glUtilitiesQueueModel(Model *m, GLuint program, GLuint texture, Matrix4 transform, int pass); // pass 0-15, drawn in order
+// Packets from one texture array or atlas share a run, the shader maps its texcoords with the
+// per instance attributes: vec4 region (offset.xy, scale.zw) and float layer
+void glUtilitiesSetQueueRegionVars(const char *regionVar, const char *layerVar);
+void glUtilitiesQueueModelRegion(Model *m, GLuint program, struct TextureRegion *region, Matrix4 transform, int pass);
+void glUtilitiesFlushQueue();
+
+void glUtilitiesDrawWireframe(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar); // Each edge once as GL_LINES
 void glUtilitiesDrawModel(Model *m, GLuint program, const char* vertexVar, const char* normalVar, const char* textureVar);
 
 Model* glUtilitiesLoadModelData(Vector3 *vertices, Vector3 *normals, Vector2 *texCoords, Vector3 *colors, GLuint *indices, int numVertices, int numIndices);
 
 void glUtilitiesReloadModelData(Model *m);
 
+// Partial updates after editing the CPU arrays, streams is a mask of MODEL_POSITIONS, MODEL_NORMALS,
+// MODEL_TEXCOORDS and MODEL_INDICES. glUtilitiesScaleModel and glUtilitiesCenterModel mark positions.
+// Changing numVertices/numIndices still needs glUtilitiesReloadModelData.
+void glUtilitiesMarkModelDirty(Model *m, int streams, int first, int count);
+void glUtilitiesFlushModelData(Model *m); // Uploads just the marked spans
+
+typedef struct ModelCacheStats {
+    float acmr; // post-transform cache misses per triangle
+    float atvr; // misses per vertex, 1.0 is optimal
+} ModelCacheStats;
+
+void glUtilitiesSetModelOptimization(bool active); // Optimize index/vertex order of loaded OBJs
+void glUtilitiesOptimizeModel(Model *m, ModelCacheStats *before, ModelCacheStats *after);
+void glUtilitiesModelCacheStats(Model *m, ModelCacheStats *stats);
+
+// Quantized GPU vertex formats (COMPRESS_* flags), the float arrays on the CPU side are kept.
+// Positions must be decoded with the model's decode uniforms, octahedral normals in the shader:
+//   vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+//   if(n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * sign(n.xy);
+//   n = normalize(n);
+// VERTEX_INTERLEAVED packs position, normal and texcoord into vb (nb/tb unused), combinable with the rest.
+// Indices are GL_UNSIGNED_SHORT for every model with at most 65536 vertices, see Model.indexType.
+void glUtilitiesSetVertexCompression(int flags); // Used by models created after the call
+void glUtilitiesCompressModel(Model *m, int flags);
+void glUtilitiesSetModelDecodeUniforms(Model *m, GLuint program, const char *offsetVar, const char *scaleVar);
+
+// Models created after the call are suballocated from big vertex/index buffers shared per vertex
+// format (always interleaved) and drawn with a base vertex, disposal returns their ranges.
+void glUtilitiesSetMeshArena(bool active);
+
+void glUtilitiesSetModelLODLevels(int levels); // LODs generated for loaded OBJs, each halving the triangle count
+void glUtilitiesSetLODThreshold(float pixels); // Max on-screen error of a selected LOD
+void glUtilitiesGenerateLODs(Model *m, int levels, float ratio);
+int  glUtilitiesSelectLOD(Model *m, Matrix4 projection, Matrix4 modelView); // 0 = full model, i = lods[i - 1]
+
+void glUtilitiesBuildClusters(Model *m); // Meshlets of <= 64 vertices / 124 triangles, reorders indexArray
+int  glUtilitiesCullClusters(Model *m, Matrix4 projection, Matrix4 modelView, char *visible); // Returns visible count
+
+// Frustum culling, viewProjection is projection * worldToView. Returns the visible count,
+// transforms may be NULL for models placed in world space.
+void glUtilitiesModelWorldBounds(Model *m, Matrix4 transform, Vector3 *min, Vector3 *max);
+int  glUtilitiesCullBoxes(Matrix4 viewProjection, Vector3 *mins, Vector3 *maxs, int count, char *visible);
+int  glUtilitiesCullModels(Matrix4 viewProjection, Model **models, Matrix4 *transforms, int count, char *visible);
+
+// Triangle BVH for ray and sphere queries in model space, kept up to date through
+// glUtilitiesMarkModelDirty. Sphere queries return the count and write the first maxHits.
+void glUtilitiesBuildModelBVH(Model *m);
+bool glUtilitiesModelRaycast(Model *m, Vector3 origin, Vector3 direction, float maxDistance, ModelHit *hit);
+int  glUtilitiesModelSphereQuery(Model *m, Vector3 center, float radius, ModelHit *hits, int maxHits);
+
 void glUtilitiesScaleModel(Model *m, float sx, float sy, float sz);
 void glUtilitiesDisposeModel(Model *m);
 void glUtilitiesCenterModel(Model *m);
 
 /*
 
+SCENE UTILITIES
+
+*/
+
+// Dynamic BVH over model instances keyed by their world boxes. Handles stay valid until removed.
+typedef struct SceneNode {
+    Vector3 min, max;
+    int parent; // next free node while unused
+    int child[2];
+    int item; // leaves only, -1 for inner nodes
+} SceneNode;
+
+typedef struct SceneItem {
+    Model *model;
+    Matrix4 transform;
+    Vector3 min, max; // world box
+    int node; // leaf, -1 once removed
+} SceneItem;
+
+typedef struct Scene {
+    SceneNode *nodes;
+    int numNodes, nodeCapacity, freeNode, root;
+
+    SceneItem *items; // indexed by handle
+    int numItems, itemCapacity;
+    int *freeItems, numFreeItems;
+} Scene;
+
+Scene *glUtilitiesCreateScene();
+int  glUtilitiesSceneInsert(Scene *s, Model *m, Matrix4 transform); // Returns the handle
+void glUtilitiesSceneRemove(Scene *s, int handle);
+void glUtilitiesSceneMove(Scene *s, int handle, Matrix4 transform); // Reinserts only when the item leaves its fattened box
+void glUtilitiesRefitScene(Scene *s); // Tightens every box, after models changed shape or many items moved
+void glUtilitiesBuildScene(Scene *s); // Full binned SAH rebuild, for the best tree after loading
+
+// Queries return the number of matches and write the first maxHandles of them
+int  glUtilitiesSceneQueryFrustum(Scene *s, Matrix4 viewProjection, int *handles, int maxHandles);
+int  glUtilitiesSceneQuerySphere(Scene *s, Vector3 center, float radius, int *handles, int maxHandles);
+int  glUtilitiesSceneRaycast(Scene *s, Vector3 origin, Vector3 direction, float maxDistance, float *distance); // Nearest hit, exact for models with a BVH, -1 for none
+void glUtilitiesDisposeScene(Scene *s);
+
+/*
+
+OCCLUSION UTILITIES
+
+*/
+
+// Software depth buffer for occlusion culling. Occluders are drawn on the CPU (tiles run on the
+// thread pool), then boxes already marked visible, e.g. by glUtilitiesCullBoxes, are tested against it.
+void glUtilitiesSetOcclusionResolution(int w, int h); // Rounded up to whole tiles
+void glUtilitiesBeginOcclusion(Matrix4 viewProjection); // Clears the buffer
+void glUtilitiesRasterizeOccluder(Model *m, Matrix4 transform); // Use simplified meshes, e.g. a LOD of the terrain
+int  glUtilitiesOcclusionTestBoxes(Vector3 *mins, Vector3 *maxs, int count, char *visible); // Clears visible[i] of hidden boxes, returns the visible count
+
+/*
+
 TGA UTILITIES
 
 */
@@ -184,11 +424,65 @@ typedef struct TextureData {
 	GLfloat	texWidth, texHeight;
 } TextureData, *TextureDataPtr;
 
+// Where a texture ended up in an array (full layer) or an atlas (layer 0)
+typedef struct TextureRegion {
+    GLuint texID; // 0 when it could not be placed
+    GLenum target; // GL_TEXTURE_2D_ARRAY or GL_TEXTURE_2D
+    int layer;
+    GLfloat u0, v0, u1, v1;
+} TextureRegion;
+
+GLuint glUtilitiesBuildTextureArray(TextureData *textures, int count, TextureRegion *regions); // Same size and bpp, one layer each
+GLuint glUtilitiesBuildTextureAtlas(TextureData *textures, int count, int maxSize, int padding, TextureRegion *regions); // RGBA, edges extruded padding texels, sides at most maxSize rounded down to a power of two
+
 void glUtilitiesLoadTGATextureSimple(const char *n, GLuint *tex);
-void glUtilitiesLoadTGASetMipmapping(bool active);
+void glUtilitiesLoadTGASetMipmapping(bool active); // On by default, the chain is filtered on the CPU at every load, glUtilitiesLoadTGATextureMipmapped caches it
+void glUtilitiesLoadTGASetMipFilter(int filter, bool srgb, float alphaCutoff); // Chains of every loader, MIP_BOX or MIP_KAISER, colors averaged in linear when srgb, alpha coverage kept at a cutoff above 0
 
 bool glUtilitiesLoadTGATextureData(const char *n, TextureData *tex);
 bool glUtilitiesLoadTGATexture(const char *n, TextureData *tex);
+bool glUtilitiesLoadTGATextureDirect(const char *n, TextureData *tex); // Level 0 through a pixel unpack buffer as BGR(A), decoded straight into it without mipmapping. imageData stays NULL
+// Decodes on the thread pool (threads 0 for all of it) and uploads on this thread as files finish.
+// Returns the number loaded, failed textures have texID 0. imageData stays NULL.
+int glUtilitiesLoadTGATextureBatch(const char **names, int count, TextureData *textures, int threads);
+
+// Immutable textures updated through a pixel unpack ring, e.g. video or procedural content every frame.
+// levels 0 gives a full mip chain.
+GLuint glUtilitiesCreateTexture(int w, int h, GLenum internalFormat, int levels);
+void *glUtilitiesBeginTextureUpdate(GLuint texID, int x, int y, int w, int h, GLenum format); // Write w*h tightly packed unsigned byte pixels, NULL skips the End call
+void glUtilitiesEndTextureUpdate();
+bool glUtilitiesUpdateTexture(GLuint texID, int x, int y, int w, int h, GLenum format, const void *pixels); // false when the ring could not be mapped
+
+// BC1 (GL_COMPRESSED_RGB_S3TC_DXT1_EXT), BC3 (..._DXT5_EXT), BC4 (GL_COMPRESSED_RED_RGTC1) or BC5 (GL_COMPRESSED_RG_RGTC2).
+// format 0 picks BC4, BC1 or BC3 from the bpp, GL_RGBA keeps the chain uncompressed. quality 0 is fastest,
+// 1 fits the principal axis, 2 also refines endpoints.
+// The mip chain is filtered and encoded on the thread pool once and cached next to the TGA, later loads upload the cache.
+bool glUtilitiesLoadTGATextureCompressed(const char *n, TextureData *tex, GLenum format, int quality);
+bool glUtilitiesLoadTGATextureMipmapped(const char *n, TextureData *tex); // Uncompressed chain, filtered once and read back from the cache
+bool glUtilitiesCompressTGA(const char *n, GLenum format, int quality); // Only writes the cache, e.g. from a build step
+GLubyte *glUtilitiesCompressTexture(const GLubyte *rgba, int w, int h, GLenum format, int quality, size_t *size); // One level, malloc'd blocks
+
+// Textures whose mip chains are streamed from the texture cache. Over the budget, the least recently
+// bound ones drop to their small levels, then out entirely. Levels come back on a worker once bound again.
+typedef struct ManagedTexture {
+    GLuint texID; // changes as levels come and go, bind with glUtilitiesBindManagedTexture
+    GLenum format;
+    int w, h, levels;
+    int baseLevel; // first resident level of the chain, levels when evicted
+    size_t bytes; // resident footprint
+    unsigned lastUse;
+    GLubyte *cache; // mapped cache file
+    size_t cacheSize;
+    void *streaming;
+    struct ManagedTexture *next;
+} ManagedTexture;
+
+void glUtilitiesSetTextureBudget(size_t bytes); // 0 for no limit
+size_t glUtilitiesTextureMemory(); // Bytes resident in managed textures
+ManagedTexture *glUtilitiesManageTexture(const char *n, GLenum format, int quality); // format and quality as for glUtilitiesLoadTGATextureCompressed
+void glUtilitiesBindManagedTexture(ManagedTexture *t, int unit);
+void glUtilitiesUpdateTextureManager(); // Uploads streamed levels and evicts, done by glUtilitiesSwapBuffers
+void glUtilitiesReleaseManagedTexture(ManagedTexture *t);
 
 int glUtilitiesSaveTGAData(char	*n, short int w, short int h, unsigned char pixelDepth, unsigned char *imageData);
 
@@ -191,10 +191,12 @@ void initf(void) {
     
     glUtilitiesLoadTGATextureData("test/res/terrain.tga", &ttex);
 	tm = GenerateTerrain(&ttex);
+	glUtilitiesBuildModelBVH(tm);
 
 	glUtilitiesReportError("TERRAIN INIT");
 
 	msg = glUtilitiesLoadModel("test/res/bubble.obj");
+	glUtilitiesGenerateLODs(msg, 3, 0.5f);
 }
 
 Vector2 camRot = Vector2(0, 0);
@@ -276,18 +278,11 @@ float lerp(float t, float a, float b) {
 }
 
 float curr = 0;
-float getY(float x, float z, TextureData *tex) {
-	Vector2 last = Vector2((int)floor(x), (int)floor(z)); // last visited point
-
-	int other = (((x - last.x) + (z - last.y)) >= 1); // upper right triangle
-
-	float h1 = vArray[(int)((last.x + other) + (last.y + other) * tex->w)].y; // bottom left or top right
-	float h2 = vArray[(int)((last.x + 1) + last.y * tex->w)].y;
-	float h3 = vArray[(int)(last.x + (last.y + 1) * tex->w)].y;
-
-	float height = (lerp((x - round(x + 0.5f)) + 1, h1, h2) + lerp((z - round(z + 0.5f)) + 1, h1, h3)) / 2;
-
-	curr = lerp(((x - last.x) + (z - last.y)) / 2, curr, height);
+float getY(float x, float z) {
+	ModelHit hit;
+	if(glUtilitiesModelRaycast(tm, {x, 1000.0f, z}, {0, -1, 0}, 2000.0f, &hit)) {
+		curr = lerp(0.5f, curr, hit.position.y);
+	}
 	return curr;
 }
 
@@ -318,7 +313,7 @@ void displayf(void) {
 	FORWARD = direction;
 
     // TODO: Implement rest
-    velocity.y = getY(velocity.x, velocity.z, &ttex) + PLAYER_HEIGHT;
+    velocity.y = getY(velocity.x, velocity.z) + PLAYER_HEIGHT;
     Matrix4 worldToView = LookAtVector(velocity, AddV3(velocity, direction), {0, 1, 0});
  	glUniformMatrix4fv(glGetUniformLocation(program, "worldToView"), 1, GL_TRUE, worldToView.m);
 	
@@ -334,7 +329,7 @@ void displayf(void) {
         Matrix4 modelView2 = Transform(msgPosArr[i].x, msgPosArr[i].y, msgPosArr[i].z);
         //modelView2 = MultM4(modelView2, RotateX(M_PI/2));
         glUniformMatrix4fv(glGetUniformLocation(program, "mdlMatrix"), 1, GL_TRUE, modelView2.m);
-	    glUtilitiesDrawModel(msg, program, "inPosition", "inNormal", "inTexCoord");
+	    glUtilitiesDrawModelLOD(msg, projectionMatrix, MultM4(worldToView, modelView2), program, "inPosition", "inNormal", "inTexCoord");
     }
 
 	glUtilitiesReportError("DISPLAY");